@@ -0,0 +1,380 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+#include <iomanip>
+#include <cmath>
+
+#include "blockhash.h"
+#include "pagecheck.h"
+#ifdef _WIN32
+#include "compress.h"
+#endif
+
+// what a backup stream is made of, to choose codecs, stripes and dedupe by.
+// The stream is read once in 1MB frames, on the reading thread: 8KB blocks
+// are tested for zeros, pages are found as pagecheck finds them, and every
+// 4KB block is hashed, with the hashes of larger chunks made from those of
+// their 4KB blocks. Compression is measured on a thread of its own, on
+// whichever frames come by while it is idle, so it samples as much as the
+// codecs keep up with. Nothing here needs SQL Server, and only the codecs
+// need Windows; elsewhere the samples give just their entropy, and the
+// analyze directory builds this on its own.
+struct streamanalysis
+{
+	static constexpr uint32_t frameSize = 0x100000;
+	static constexpr uint32_t carrySize = 2 * sqlpage::size;
+	static constexpr uint32_t blockSize = 0x1000;
+
+	// duplicates among chunks of one size. Only hashes with their top
+	// sampleBits clear are kept, which estimates the ratio of the whole
+	// stream in a fraction of the memory. Zero chunks would all be in or all
+	// out of such a sample, so they are counted apart, in full.
+	struct dedupe
+	{
+		uint32_t chunkSize;
+		int sampleBits;
+		uint64_t chunks = 0;
+		uint64_t duplicates = 0;
+		uint64_t zeroChunks = 0;
+		std::unordered_set<uint64_t> seen;
+
+		dedupe(uint32_t chunkSize, int sampleBits)
+			: chunkSize(chunkSize)
+			, sampleBits(sampleBits)
+		{
+		}
+
+		void add(uint64_t hash, bool zero)
+		{
+			if (zero) {
+				++zeroChunks;
+				return;
+			}
+			if (sampleBits && (hash >> (64 - sampleBits))) {
+				return;
+			}
+			++chunks;
+			if (!seen.insert(hash).second) {
+				++duplicates;
+			}
+		}
+
+		// the sample scaled up to the whole stream; all zero chunks but one are duplicates
+		double ratio() const
+		{
+			double scale = static_cast<double>(1ull << sampleBits);
+			double all = chunks * scale + zeroChunks;
+			return all ? (duplicates * scale + (zeroChunks ? zeroChunks - 1 : 0)) / all : 0;
+		}
+	};
+
+	streamanalysis()
+		: frame(carrySize + frameSize)
+		, sample(frameSize)
+	{
+		dedupes.emplace_back(0x1000, 6);
+		dedupes.emplace_back(0x2000, 5);
+		dedupes.emplace_back(0x10000, 2);
+		dedupes.emplace_back(0x100000, 0);
+
+#ifdef _WIN32
+		packedBytes.resize(compressLevelCount);
+#endif
+		pageTypes.fill(0);
+		byteCounts.fill(0);
+
+		sampler = std::thread([this] { sampleLoop(); });
+	}
+
+	~streamanalysis()
+	{
+		finish();
+	}
+
+	void feed(const uint8_t* buf, size_t len)
+	{
+		while (len > 0) {
+			uint32_t n = static_cast<uint32_t>((std::min)(len, static_cast<size_t>(carry + frameSize - frameLen)));
+			memcpy(frame.data() + frameLen, buf, n);
+			frameLen += n;
+			buf += n;
+			len -= n;
+
+			if (frameLen == carry + frameSize) {
+				analyzeFrame(false);
+			}
+		}
+	}
+
+	// analyzes the partial frame at the end and waits for the sampler
+	void finish()
+	{
+		if (!sampler.joinable()) {
+			return;
+		}
+
+		analyzeFrame(true);
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cv.notify_all();
+		sampler.join();
+	}
+
+	// bits per byte of the sampled frames, order 0
+	double entropy() const
+	{
+		double bits = 0;
+		for (auto c : byteCounts) {
+			if (c) {
+				double p = static_cast<double>(c) / sampledBytes;
+				bits -= p * std::log2(p);
+			}
+		}
+		return bits;
+	}
+
+	// what was found, a line for each thing measured
+	void report(std::ostream& o) const
+	{
+		auto share = [&o](double ratio) -> std::ostream& {
+			return o << std::fixed << std::setprecision(1) << 100.0 * ratio << "%";
+		};
+		auto percent = [&share](uint64_t part, uint64_t whole) -> std::ostream& {
+			return share(whole ? static_cast<double>(part) / whole : 0.0);
+		};
+
+		o << "Zero blocks: ";
+		percent(zeroBlocks, blocks) << " of " << blocks << " 8KB blocks" << std::endl;
+
+		o << "Pages: " << pages << " found, " << badPages << " failing their checksum";
+		for (int type = 0; type < 256; ++type) {
+			if (pageTypes[type]) {
+				o << "; " << pageTypeName(static_cast<uint8_t>(type)) << " ";
+				percent(pageTypes[type], pages);
+			}
+		}
+		o << std::endl;
+
+		o << "Sampled " << (sampledBytes >> 20) << " MB: " << std::fixed << std::setprecision(2) << entropy() << " bits per byte";
+#ifdef _WIN32
+		if (codecs) {
+			o << "; packed to";
+			for (size_t i = 1; i < compressLevelCount; ++i) {
+				o << " " << compressLevels[i].name << " ";
+				percent(packedBytes[i], sampledBytes);
+			}
+		}
+#endif
+		o << std::endl;
+
+		o << "Duplicate chunks:";
+		for (auto&& d : dedupes) {
+			if (d.chunkSize % 0x100000) {
+				o << " " << (d.chunkSize >> 10) << "k ";
+			}
+			else {
+				o << " " << (d.chunkSize >> 20) << "m ";
+			}
+			share(d.ratio());
+		}
+		o << std::endl;
+	}
+
+	static const char* pageTypeName(uint8_t type)
+	{
+		switch (type) {
+		case 1: return "data";
+		case 2: return "index";
+		case 3: return "text mix";
+		case 4: return "text tree";
+		case 7: return "sort";
+		case 8: return "GAM";
+		case 9: return "SGAM";
+		case 10: return "IAM";
+		case 11: return "PFS";
+		case 13: return "boot";
+		case 15: return "file header";
+		case 16: return "diff map";
+		case 17: return "ML map";
+		default: return "other";
+		}
+	}
+
+	uint64_t bytes = 0;
+	uint64_t blocks = 0;
+	uint64_t zeroBlocks = 0;
+
+	uint64_t pages = 0;
+	uint64_t badPages = 0;
+	std::array<uint64_t, 256> pageTypes;
+
+	// what the sampler saw, and what each codec made of it; stored is left 0
+	bool codecs = false;
+	uint64_t sampledBytes = 0;
+	std::vector<uint64_t> packedBytes;
+	std::array<uint64_t, 256> byteCounts;
+
+	std::vector<dedupe> dedupes;
+
+protected:
+	static bool isZero(const uint8_t* buf, uint32_t len)
+	{
+		uint64_t acc = 0;
+		for (uint32_t i = 0; i < len; i += sizeof(acc)) {
+			uint64_t w;
+			memcpy(&w, buf + i, sizeof(w));
+			acc |= w;
+		}
+		return !acc;
+	}
+
+	// the frame's own bytes follow the carry, the end of the frame before
+	void analyzeFrame(bool last)
+	{
+		const uint8_t* data = frame.data() + carry;
+		uint32_t len = frameLen - carry;
+
+		for (uint32_t i = 0; i + sqlpage::size <= len; i += sqlpage::size) {
+			++blocks;
+			if (isZero(data + i, sqlpage::size)) {
+				++zeroBlocks;
+			}
+		}
+
+		// the pages that start from one page back up to one page before the next frame
+		uint64_t base = bytes - carry;
+		uint64_t end = bytes + len;
+		uint64_t ownFrom = bytes - (std::min)(bytes, static_cast<uint64_t>(sqlpage::size));
+		uint64_t ownTo = last ? end : end - sqlpage::size;
+		sqlpage::scan(frame.data(), base, frameLen, ownFrom, ownTo, [this](const sqlpageheader& h, uint64_t, const char* problem) {
+			++pages;
+			++pageTypes[h.type];
+			if (problem) {
+				++badPages;
+			}
+		});
+
+		hashBlocks(data, len);
+		offerSample(data, len);
+
+		bytes += len;
+
+		carry = (std::min)(frameLen, static_cast<uint32_t>(carrySize));
+		memmove(frame.data(), frame.data() + frameLen - carry, carry);
+		frameLen = carry;
+	}
+
+	// a chunk's hash is the hash of its blocks' hashes
+	void hashBlocks(const uint8_t* data, uint32_t len)
+	{
+		blockHashes.clear();
+		zeroBlocksIn.clear();
+		for (uint32_t i = 0; i < len; i += blockSize) {
+			uint32_t n = (std::min)(static_cast<uint32_t>(blockSize), len - i);
+			blockHashes.push_back(blockhash(data + i, n));
+			zeroBlocksIn.push_back(n == blockSize && isZero(data + i, n));
+		}
+
+		for (auto&& d : dedupes) {
+			size_t per = d.chunkSize / blockSize;
+			for (size_t i = 0; i < blockHashes.size(); i += per) {
+				size_t n = (std::min)(per, blockHashes.size() - i);
+				bool zero = n == per && std::all_of(zeroBlocksIn.begin() + i, zeroBlocksIn.begin() + i + n, [](bool z) { return z; });
+				d.add(per == 1 ? blockHashes[i] : blockhash(reinterpret_cast<const uint8_t*>(&blockHashes[i]), static_cast<uint32_t>(n * sizeof(uint64_t))), zero);
+			}
+		}
+	}
+
+	void offerSample(const uint8_t* data, uint32_t len)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (sampleLen || !len) {
+				return;
+			}
+			memcpy(sample.data(), data, len);
+			sampleLen = len;
+		}
+		cv.notify_all();
+	}
+
+	void sampleLoop()
+	{
+#ifdef _WIN32
+		const compressapi& api = compressapi::get();
+
+		std::vector<HANDLE> compressors(compressLevelCount);
+		for (size_t i = 1; i < compressLevelCount && api.available(); ++i) {
+			if (!api.createCompressor(compressLevels[i].algorithm, nullptr, &compressors[i])) {
+				compressors[i] = nullptr;
+			}
+		}
+		codecs = api.available();
+
+		std::vector<uint8_t> packed(frameSize);
+#endif
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this] { return sampleLen || stopping; });
+				if (!sampleLen) {
+					break;
+				}
+			}
+
+			for (uint32_t i = 0; i < sampleLen; ++i) {
+				++byteCounts[sample[i]];
+			}
+
+#ifdef _WIN32
+			// what does not shrink would be stored, so it counts at its own size
+			for (size_t i = 1; i < compressLevelCount; ++i) {
+				SIZE_T packedLen = 0;
+				if (!compressors[i] || !api.compress(compressors[i], sample.data(), sampleLen, packed.data(), sampleLen, &packedLen) || packedLen > sampleLen) {
+					packedLen = sampleLen;
+				}
+				packedBytes[i] += packedLen;
+			}
+#endif
+			sampledBytes += sampleLen;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				sampleLen = 0;
+			}
+		}
+
+#ifdef _WIN32
+		for (auto&& c : compressors) {
+			if (c) {
+				api.closeCompressor(c);
+			}
+		}
+#endif
+	}
+
+	std::vector<uint8_t> frame;
+	uint32_t frameLen = 0;
+	uint32_t carry = 0;
+	std::vector<uint64_t> blockHashes;
+	std::vector<bool> zeroBlocksIn;
+
+	std::vector<uint8_t> sample;
+	uint32_t sampleLen = 0;
+	std::thread sampler;
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool stopping = false;
+};
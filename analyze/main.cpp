@@ -0,0 +1,55 @@
+// mssqlPipe analyze on its own, for where the backups are but Windows is
+// not. It reads a backup from a file or stdin and reports as analyze does,
+// without the codecs, so a backup written with --compress is not expanded.
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+#include "../analyze.h"
+
+int main(int argc, char* argv[])
+{
+	if (argc > 2) {
+		std::cerr << "usage: " << argv[0] << " [filename]" << std::endl;
+		return 2;
+	}
+
+	FILE* file = stdin;
+	if (argc == 2) {
+		file = std::fopen(argv[1], "rb");
+		if (!file) {
+			std::perror(argv[1]);
+			return 1;
+		}
+	}
+
+	streamanalysis a;
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<uint8_t> buf(streamanalysis::frameSize);
+	for (;;) {
+		size_t got = std::fread(buf.data(), 1, buf.size(), file);
+		if (got) {
+			a.feed(buf.data(), got);
+		}
+		if (got < buf.size()) {
+			break;
+		}
+	}
+	bool failed = std::ferror(file) != 0;
+	if (file != stdin) {
+		std::fclose(file);
+	}
+	a.finish();
+
+	if (failed) {
+		std::perror(argc == 2 ? argv[1] : "stdin");
+		return 1;
+	}
+
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+	std::cout << "Analyzed " << (a.bytes >> 20) << " MB in " << ms << " ms" << std::endl;
+	a.report(std::cout);
+	return 0;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+// the settings autotune tries: SQL Server's own choice of buffers is often
+// too few for a fast device, so trials go from a few large transfers up to
+// many of them
+inline std::vector<tuning> AutotuneGrid(const tuning& base)
+{
+	std::vector<tuning> grid;
+	for (DWORD maxTransferSize : { 0x100000, 0x200000, 0x400000 }) {
+		for (DWORD bufferCount : { 16, 32, 64 }) {
+			tuning t = base;
+			t.autotune = false;
+			t.bufferCount = bufferCount;
+			t.maxTransferSize = maxTransferSize;
+			grid.push_back(t);
+		}
+	}
+	return grid;
+}
+
+// the null sink for one autotune trial. It throws the backup away and, once
+// it has seen enough bytes or time to judge the throughput, calls done so the
+// trial can be aborted instead of backing up the whole database.
+struct trialsink : public bytesink
+{
+	explicit trialsink(std::function<void()> done, unsigned __int64 budgetBytes = 1ull << 30, DWORD budgetMillis = 15 * 1000)
+		: finished(false)
+		, done(done)
+		, budgetBytes(budgetBytes)
+		, budgetMillis(budgetMillis)
+	{
+		::QueryPerformanceFrequency(&frequency);
+	}
+
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		LARGE_INTEGER now;
+		::QueryPerformanceCounter(&now);
+		if (!bytes) {
+			first = now;
+		}
+		last = now;
+
+		bytes += len;
+		stats.cachedBytes += len;
+		*pdwBytes = len;
+
+		if (!finished && (bytes >= budgetBytes || seconds() * 1000 >= budgetMillis)) {
+			finished = true;
+			done();
+		}
+
+		return TRUE;
+	}
+
+	double seconds() const
+	{
+		return static_cast<double>(last.QuadPart - first.QuadPart) / frequency.QuadPart;
+	}
+
+	double bytesPerSecond() const
+	{
+		double s = seconds();
+		return s > 0 ? bytes / s : 0;
+	}
+
+	// the budget ran out, so the abort that follows is expected
+	std::atomic<bool> finished;
+	unsigned __int64 bytes = 0;
+
+protected:
+	std::function<void()> done;
+	unsigned __int64 budgetBytes = 0;
+	DWORD budgetMillis = 0;
+	LARGE_INTEGER frequency = {};
+	LARGE_INTEGER first = {};
+	LARGE_INTEGER last = {};
+};
+
+// what one trial measured: the bytes SQL Server sent, what reached the null
+// sink after the pipeline, if the trial had one, and the time they took
+struct trialresult
+{
+	unsigned __int64 rawBytes = 0;
+	unsigned __int64 storedBytes = 0;
+	double seconds = 0;
+
+	// the geometry the device reported taking, which can differ from what
+	// the trial asked for
+	DWORD maxTransferSize = 0;
+	DWORD blockSize = 0;
+
+	double rate() const
+	{
+		return seconds > 0 ? rawBytes / seconds : 0;
+	}
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+inline uint64_t rotl64(uint64_t h, int n)
+{
+	return (h << n) | (h >> (64 - n));
+}
+
+// the strong hash of a block, a word at a time. The delta and analyze both
+// use it, and analyze builds without Windows, so it stays portable.
+inline uint64_t blockhash(const uint8_t* buf, uint32_t len)
+{
+	uint64_t h = 0x27D4EB2F165667C5ull ^ len;
+	uint32_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, buf + i, 8);
+		h = rotl64(h + w * 0xC2B2AE3D27D4EB4Full, 31) * 0x9E3779B185EBCA87ull;
+	}
+	for (; i < len; ++i) {
+		h = rotl64(h + buf[i] * 0x165667B19E3779F9ull, 11) * 0x9E3779B185EBCA87ull;
+	}
+	h ^= h >> 33;
+	h *= 0xC2B2AE3D27D4EB4Full;
+	h ^= h >> 29;
+	return h;
+}
@@ -0,0 +1,630 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <condition_variable>
+#include <cmath>
+#include <random>
+
+// the Compression API from Windows 8, loaded from cabinet.dll when it is
+// there so the program still starts on older systems
+struct compressapi
+{
+	typedef BOOL(WINAPI* CreateFn)(DWORD algorithm, void* allocationRoutines, HANDLE* handle);
+	typedef BOOL(WINAPI* CodecFn)(HANDLE handle, const void* data, SIZE_T dataSize, void* buffer, SIZE_T bufferSize, SIZE_T* resultSize);
+	typedef BOOL(WINAPI* CloseFn)(HANDLE handle);
+
+	CreateFn createCompressor = nullptr;
+	CodecFn compress = nullptr;
+	CloseFn closeCompressor = nullptr;
+	CreateFn createDecompressor = nullptr;
+	CodecFn decompress = nullptr;
+	CloseFn closeDecompressor = nullptr;
+
+	static const compressapi& get()
+	{
+		static compressapi api;
+		return api;
+	}
+
+	bool available() const
+	{
+		return createCompressor && compress && closeCompressor && createDecompressor && decompress && closeDecompressor;
+	}
+
+protected:
+	compressapi()
+	{
+		HMODULE hModule = ::LoadLibrary(L"cabinet.dll");
+		if (!hModule) {
+			return;
+		}
+
+		createCompressor = reinterpret_cast<CreateFn>(::GetProcAddress(hModule, "CreateCompressor"));
+		compress = reinterpret_cast<CodecFn>(::GetProcAddress(hModule, "Compress"));
+		closeCompressor = reinterpret_cast<CloseFn>(::GetProcAddress(hModule, "CloseCompressor"));
+		createDecompressor = reinterpret_cast<CreateFn>(::GetProcAddress(hModule, "CreateDecompressor"));
+		decompress = reinterpret_cast<CodecFn>(::GetProcAddress(hModule, "Decompress"));
+		closeDecompressor = reinterpret_cast<CloseFn>(::GetProcAddress(hModule, "CloseDecompressor"));
+	}
+};
+
+// the levels a compressing sink moves between, fastest first. The algorithm
+// is what goes in the stream; 0 is a frame stored as it came.
+struct compresslevel
+{
+	const char* name;
+	DWORD algorithm;
+};
+
+static const compresslevel compressLevels[] = {
+	{ "stored", 0 },
+	{ "xpress", 3 },
+	{ "xpress_huff", 4 },
+	{ "mszip", 2 },
+	{ "lzms", 5 },
+};
+
+static constexpr size_t compressLevelCount = _countof(compressLevels);
+
+inline bool compressLevelFromName(const std::string& name, size_t& level)
+{
+	for (size_t i = 0; i < compressLevelCount; ++i) {
+		if (iequals(name, compressLevels[i].name)) {
+			level = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// ahead of every frame of a compressed stream
+struct compressframe
+{
+	static constexpr DWORD signature = 0x5a50534d; // MSPZ
+	static constexpr DWORD maxSize = 0x4000000;
+
+	DWORD magic;
+	DWORD algorithm;
+	DWORD rawSize;
+	DWORD packedSize;
+};
+
+// TDE and SQL Server's own backup compression leave nothing to compress, and
+// trying costs a full pass of the compressor for no gain. A sample of 256
+// bytes from every 4KB tells: past about 7.98 bits per byte the frame is
+// noise to any of the codecs here. Samples start 512 bytes into each 4KB,
+// clear of the 96 byte page headers TDE leaves in plain text.
+inline bool incompressible(const BYTE* buf, DWORD len)
+{
+	static constexpr DWORD stride = 0x1000;
+	static constexpr DWORD offset = 0x200;
+	static constexpr DWORD sample = 0x100;
+	static constexpr double threshold = 7.98;
+
+	DWORD counts[256] = {};
+	DWORD n = 0;
+	for (DWORD block = offset; block < len; block += stride) {
+		DWORD end = min(block + sample, len);
+		for (DWORD i = block; i < end; ++i) {
+			++counts[buf[i]];
+		}
+		n += end - block;
+	}
+
+	// too little to judge; let the compressor decide
+	if (n < 0x4000) {
+		return false;
+	}
+
+	double bits = 0;
+	for (DWORD c : counts) {
+		if (c) {
+			double p = static_cast<double>(c) / n;
+			bits -= p * std::log2(p);
+		}
+	}
+	return bits >= threshold;
+}
+
+#ifdef _DEBUG
+// a frame of 8KB pages with plain headers and random bodies, as TDE writes
+// them, is noise; the same pages with text bodies are not
+inline bool TestIncompressible()
+{
+	static constexpr DWORD pageSize = 0x2000;
+	static constexpr DWORD headerSize = 96;
+	static constexpr DWORD frameSize = 0x100000;
+
+	std::vector<BYTE> frame(frameSize);
+	std::mt19937 random(1);
+	for (DWORD page = 0; page < frameSize; page += pageSize) {
+		for (DWORD i = 0; i < headerSize; ++i) {
+			frame[page + i] = i == 0 ? 1 : 0;
+		}
+		for (DWORD i = headerSize; i < pageSize; ++i) {
+			frame[page + i] = static_cast<BYTE>(random());
+		}
+	}
+	if (!incompressible(&frame[0], frameSize)) {
+		return false;
+	}
+
+	for (DWORD page = 0; page < frameSize; page += pageSize) {
+		for (DWORD i = headerSize; i < pageSize; ++i) {
+			frame[page + i] = static_cast<BYTE>('a' + i % 26);
+		}
+	}
+	return !incompressible(&frame[0], frameSize);
+}
+#endif
+
+/****/
+
+// compresses a backup on its way to the sink, a frame at a time. The pump
+// fills frames, one thread compresses them and another writes them out, so
+// all three overlap. An adaptive sink picks the level per frame: when frames
+// pile up waiting to be compressed the pump is about to wait on us, and the
+// level goes down; when they pile up waiting for the sink there is cpu to
+// spare, and the level goes up. Memory stays at frameCount frames.
+struct compresssink : public bytesink
+{
+	static constexpr DWORD frameSize = 0x100000;
+	static constexpr size_t frameCount = 8;
+	static constexpr size_t backlog = 3;
+
+	// level is where an adaptive sink starts, and where a fixed one stays
+	compresssink(std::unique_ptr<bytesink> sink, size_t level, bool adaptive)
+		: sink(std::move(sink))
+		, level(level)
+		, adaptive(adaptive)
+		, levelFrames(compressLevelCount)
+	{
+		const compressapi& api = compressapi::get();
+		for (size_t i = 0; i < compressLevelCount; ++i) {
+			if (compressLevels[i].algorithm && api.available()) {
+				api.createCompressor(compressLevels[i].algorithm, nullptr, &compressors[i]);
+			}
+		}
+
+		frames.resize(frameCount);
+		for (auto&& f : frames) {
+			f.raw.reset(new BYTE[frameSize]);
+			f.packed.reset(new BYTE[frameSize]);
+			freeList.push_back(&f);
+		}
+
+		compressor = std::thread([this] { compressLoop(); });
+		writer = std::thread([this] { writeLoop(); });
+	}
+
+	~compresssink()
+	{
+		stop();
+
+		for (auto&& c : compressors) {
+			if (c) {
+				compressapi::get().closeCompressor(c);
+			}
+		}
+	}
+
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		*pdwBytes = 0;
+
+		while (len > 0) {
+			if (!current) {
+				current = takeFree();
+				if (!current) {
+					::SetLastError(lastError);
+					return FALSE;
+				}
+			}
+
+			DWORD n = min(len, frameSize - current->rawLen);
+			memcpy(current->raw.get() + current->rawLen, buf, n);
+			current->rawLen += n;
+			buf += n;
+			len -= n;
+			*pdwBytes += n;
+
+			if (current->rawLen == frameSize) {
+				submit();
+			}
+		}
+
+		return TRUE;
+	}
+
+	// sends the partial frame too, then waits until the sink has everything
+	virtual BOOL flush() override
+	{
+		if (current && current->rawLen) {
+			submit();
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this] { return (rawList.empty() && packedList.empty() && !busy) || failed; });
+			updateStats();
+			if (failed) {
+				::SetLastError(lastError);
+				return FALSE;
+			}
+		}
+
+		return sink->flush();
+	}
+
+	virtual BOOL close() override
+	{
+		if (!flush()) {
+			return FALSE;
+		}
+
+		stop();
+
+		BOOL ret = sink->close();
+		std::unique_lock<std::mutex> lock(mutex);
+		updateStats();
+		return ret;
+	}
+
+protected:
+	struct frame
+	{
+		std::unique_ptr<BYTE[]> raw;
+		std::unique_ptr<BYTE[]> packed;
+		DWORD rawLen = 0;
+		DWORD packedLen = 0;
+		size_t level = 0;
+	};
+
+	frame* takeFree()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] { return !freeList.empty() || failed; });
+		if (failed) {
+			return nullptr;
+		}
+		frame* f = freeList.front();
+		freeList.pop_front();
+		f->rawLen = 0;
+		return f;
+	}
+
+	void submit()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			rawList.push_back(current);
+		}
+		cv.notify_all();
+
+		current = nullptr;
+	}
+
+	frame* pop(std::deque<frame*>& list)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this, &list] { return !list.empty() || stopping || failed; });
+		if (list.empty() || failed) {
+			return nullptr;
+		}
+		frame* f = list.front();
+		list.pop_front();
+		++busy;
+
+		if (adaptive && &list == &rawList) {
+			if (rawList.size() >= backlog && level > 0) {
+				--level;
+			}
+			else if (packedList.size() >= backlog && level + 1 < compressLevelCount) {
+				++level;
+			}
+		}
+
+		return f;
+	}
+
+	void push(std::deque<frame*>& list, frame* f)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			list.push_back(f);
+			--busy;
+		}
+		cv.notify_all();
+	}
+
+	void compressLoop()
+	{
+		for (;;) {
+			frame* f = pop(rawList);
+			if (!f) {
+				return;
+			}
+
+			f->level = level;
+			f->packedLen = 0;
+
+			// a frame that looks like noise, or does not get smaller, is stored instead
+			HANDLE c = compressors[f->level];
+			SIZE_T packedLen = 0;
+			if (c && !incompressible(f->raw.get(), f->rawLen) && compressapi::get().compress(c, f->raw.get(), f->rawLen, f->packed.get(), f->rawLen, &packedLen) && packedLen < f->rawLen) {
+				f->packedLen = static_cast<DWORD>(packedLen);
+			}
+			else {
+				f->level = 0;
+			}
+
+			push(packedList, f);
+		}
+	}
+
+	void writeLoop()
+	{
+		for (;;) {
+			frame* f = pop(packedList);
+			if (!f) {
+				return;
+			}
+
+			compressframe header = { compressframe::signature, compressLevels[f->level].algorithm, f->rawLen, f->level ? f->packedLen : f->rawLen };
+			const BYTE* payload = f->level ? f->packed.get() : f->raw.get();
+
+			if (!writeAll(reinterpret_cast<const BYTE*>(&header), sizeof(header)) || !writeAll(payload, header.packedSize)) {
+				DWORD err = ::GetLastError();
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					failed = true;
+					lastError = err ? err : ERROR_WRITE_FAULT;
+					--busy;
+				}
+				cv.notify_all();
+				return;
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				rawBytes += f->rawLen;
+				packedBytes += sizeof(header) + header.packedSize;
+				++levelFrames[f->level];
+			}
+
+			push(freeList, f);
+		}
+	}
+
+	bool writeAll(const BYTE* buf, DWORD len)
+	{
+		while (len > 0) {
+			DWORD dwBytes = 0;
+			BOOL ret = sink->write(buf, len, &dwBytes);
+			buf += dwBytes;
+			len -= dwBytes;
+			if (!ret || !dwBytes) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// with the lock held
+	void updateStats()
+	{
+		stats = sink->stats;
+		stats.rawBytes = rawBytes;
+		stats.packedBytes = packedBytes;
+		stats.levelFrames = levelFrames;
+	}
+
+	void stop()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cv.notify_all();
+
+		if (compressor.joinable()) {
+			compressor.join();
+		}
+		if (writer.joinable()) {
+			writer.join();
+		}
+	}
+
+	std::unique_ptr<bytesink> sink;
+	size_t level = 0;
+	bool adaptive = false;
+	std::array<HANDLE, compressLevelCount> compressors = {};
+
+	std::vector<frame> frames;
+	frame* current = nullptr;
+
+	std::thread compressor;
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<frame*> freeList;
+	std::deque<frame*> rawList;
+	std::deque<frame*> packedList;
+	size_t busy = 0;
+	bool stopping = false;
+	bool failed = false;
+	DWORD lastError = 0;
+
+	unsigned __int64 rawBytes = 0;
+	unsigned __int64 packedBytes = 0;
+	std::vector<unsigned __int64> levelFrames;
+};
+
+// reads a stream written by compresssink a frame at a time. Stored frames
+// are read straight into the caller's buffer, with no decoding or copy.
+// Anything else, such as a plain backup, passes through untouched, so
+// restores can always read through one.
+struct decompresssource : public bytesource
+{
+	explicit decompresssource(std::unique_ptr<bytesource> source)
+		: source(std::move(source))
+	{
+	}
+
+	~decompresssource()
+	{
+		for (auto&& d : decompressors) {
+			compressapi::get().closeDecompressor(d.second);
+		}
+	}
+
+	virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		*pdwBytes = 0;
+
+		if (!started) {
+			started = true;
+
+			// a stream shorter than one header can not be compressed
+			DWORD peeked = 0;
+			if (!readAll(reinterpret_cast<BYTE*>(&header), sizeof(header), peeked)) {
+				return FALSE;
+			}
+			compressed = peeked == sizeof(header) && header.magic == compressframe::signature;
+			if (!compressed) {
+				out.assign(reinterpret_cast<BYTE*>(&header), reinterpret_cast<BYTE*>(&header) + peeked);
+			}
+			else if (!readFrame(true)) {
+				return FALSE;
+			}
+		}
+
+		while (outPos == out.size() && !storedLeft) {
+			if (!compressed) {
+				BOOL ret = source->read(buf, len, pdwBytes);
+				stats = source->stats;
+				return ret;
+			}
+			if (ended) {
+				return TRUE;
+			}
+			if (!readFrame(false)) {
+				return FALSE;
+			}
+		}
+
+		if (storedLeft) {
+			BOOL ret = source->read(buf, min(len, storedLeft), pdwBytes);
+			stats = source->stats;
+			if (ret && !*pdwBytes) {
+				return fail(ERROR_INVALID_DATA);
+			}
+			storedLeft -= *pdwBytes;
+			return ret;
+		}
+
+		DWORD n = static_cast<DWORD>(min(static_cast<size_t>(len), out.size() - outPos));
+		memcpy(buf, out.data() + outPos, n);
+		outPos += n;
+		*pdwBytes = n;
+		return TRUE;
+	}
+
+protected:
+	bool readAll(BYTE* buf, DWORD len, DWORD& got)
+	{
+		got = 0;
+		while (got < len) {
+			DWORD dwBytes = 0;
+			BOOL ret = source->read(buf + got, len - got, &dwBytes);
+			got += dwBytes;
+			if (!ret) {
+				return false;
+			}
+			if (!dwBytes) {
+				break;
+			}
+		}
+		stats = source->stats;
+		return true;
+	}
+
+	bool fail(DWORD err)
+	{
+		::SetLastError(err);
+		return false;
+	}
+
+	// the next frame into out; haveHeader when its header was read already
+	bool readFrame(bool haveHeader)
+	{
+		DWORD got = 0;
+		if (!haveHeader) {
+			if (!readAll(reinterpret_cast<BYTE*>(&header), sizeof(header), got)) {
+				return false;
+			}
+			if (!got) {
+				ended = true;
+				out.clear();
+				outPos = 0;
+				return true;
+			}
+			if (got != sizeof(header)) {
+				return fail(ERROR_INVALID_DATA);
+			}
+		}
+
+		if (header.magic != compressframe::signature || header.rawSize > compressframe::maxSize || header.packedSize > compressframe::maxSize) {
+			return fail(ERROR_INVALID_DATA);
+		}
+
+		if (!header.algorithm) {
+			if (header.packedSize != header.rawSize) {
+				return fail(ERROR_INVALID_DATA);
+			}
+			out.clear();
+			outPos = 0;
+			storedLeft = header.rawSize;
+			return true;
+		}
+
+		out.resize(header.rawSize);
+		outPos = 0;
+
+		packed.resize(header.packedSize);
+		if (!readAll(packed.data(), header.packedSize, got)) {
+			return false;
+		}
+		if (got != header.packedSize) {
+			return fail(ERROR_INVALID_DATA);
+		}
+
+		const compressapi& api = compressapi::get();
+		if (!api.available()) {
+			return fail(ERROR_NOT_SUPPORTED);
+		}
+
+		HANDLE& d = decompressors[header.algorithm];
+		if (!d && !api.createDecompressor(header.algorithm, nullptr, &d)) {
+			return false;
+		}
+
+		SIZE_T rawLen = 0;
+		if (!api.decompress(d, packed.data(), packed.size(), out.data(), out.size(), &rawLen)) {
+			return false;
+		}
+		return rawLen == header.rawSize ? true : fail(ERROR_INVALID_DATA);
+	}
+
+	std::unique_ptr<bytesource> source;
+	bool started = false;
+	bool compressed = false;
+	bool ended = false;
+	compressframe header = {};
+	std::vector<BYTE> packed;
+	std::vector<BYTE> out;
+	size_t outPos = 0;
+	DWORD storedLeft = 0;
+	std::map<DWORD, HANDLE> decompressors;
+};
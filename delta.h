@@ -0,0 +1,652 @@
+#pragma once
+
+#include "blockhash.h"
+
+// a backup as the difference from an earlier one, for shipping over a thin
+// link. Blocks of the base found anywhere in the new stream go as block
+// numbers, rsync style, and everything else as literal bytes. A delta is a
+// header and then ops, each op header followed by its literal bytes or by
+// the hash of every block it copies.
+struct delta
+{
+	static constexpr DWORD signature = 0x4450534d; // MSPD
+	static constexpr DWORD version = 1;
+	static constexpr DWORD blockSize = 0x8000;
+
+	// how much of each end of the base goes into its id
+	static constexpr DWORD idSpan = 0x10000;
+
+	enum : DWORD
+	{
+		literal = 'L',
+		copy = 'C',
+		end = 'E',
+	};
+
+	struct header
+	{
+		DWORD magic;
+		DWORD version;
+		DWORD blockSize;
+		DWORD reserved;
+		unsigned __int64 baseSize;
+		unsigned __int64 baseId;
+	};
+
+	// literal: count bytes follow. copy: count blocks from block first, with
+	// count block hashes following. end: first is the length of the stream.
+	struct op
+	{
+		DWORD kind;
+		DWORD count;
+		unsigned __int64 first;
+	};
+
+	static unsigned __int64 rotl(unsigned __int64 h, int n)
+	{
+		return rotl64(h, n);
+	}
+
+	// the strong hash of a block
+	static unsigned __int64 hash(const BYTE* buf, DWORD len)
+	{
+		return blockhash(buf, len);
+	}
+
+	// the rolling checksum of rsync: a is the sum of the bytes and b the sum
+	// weighted by distance from the end, both mod 2^16
+	struct weak
+	{
+		DWORD a = 0;
+		DWORD b = 0;
+
+		void reset(const BYTE* buf, DWORD len)
+		{
+			a = 0;
+			b = 0;
+			for (DWORD i = 0; i < len; ++i) {
+				a += buf[i];
+				b += (len - i) * buf[i];
+			}
+			a &= 0xffff;
+			b &= 0xffff;
+		}
+
+		void roll(BYTE out, BYTE in, DWORD len)
+		{
+			a = (a - out + in) & 0xffff;
+			b = (b - len * out + a) & 0xffff;
+		}
+
+		DWORD value() const
+		{
+			return a | (b << 16);
+		}
+	};
+
+	static BOOL readAt(HANDLE hFile, unsigned __int64 offset, BYTE* buf, DWORD len, DWORD* pdwBytes)
+	{
+		*pdwBytes = 0;
+		while (*pdwBytes < len) {
+			OVERLAPPED ov = {};
+			ov.Offset = static_cast<DWORD>(offset + *pdwBytes);
+			ov.OffsetHigh = static_cast<DWORD>((offset + *pdwBytes) >> 32);
+
+			DWORD dwBytes = 0;
+			if (!::ReadFile(hFile, buf + *pdwBytes, len - *pdwBytes, &dwBytes, &ov)) {
+				return ::GetLastError() == ERROR_HANDLE_EOF;
+			}
+			if (!dwBytes) {
+				break;
+			}
+			*pdwBytes += dwBytes;
+		}
+		return TRUE;
+	}
+
+	// tells a base apart from another by its size and both of its ends,
+	// where a backup keeps its set and media headers
+	static bool baseId(HANDLE hBase, unsigned __int64& size, unsigned __int64& id)
+	{
+		LARGE_INTEGER li = {};
+		if (!::GetFileSizeEx(hBase, &li)) {
+			return false;
+		}
+		size = li.QuadPart;
+
+		std::vector<BYTE> buf(idSpan);
+		DWORD head = 0;
+		DWORD tail = 0;
+		if (!readAt(hBase, 0, buf.data(), static_cast<DWORD>(min(size, static_cast<unsigned __int64>(idSpan))), &head)) {
+			return false;
+		}
+		id = hash(buf.data(), head) ^ size;
+
+		if (!readAt(hBase, size - min(size, static_cast<unsigned __int64>(idSpan)), buf.data(), static_cast<DWORD>(min(size, static_cast<unsigned __int64>(idSpan))), &tail)) {
+			return false;
+		}
+		id ^= rotl(hash(buf.data(), tail), 1);
+		return true;
+	}
+};
+
+// makes the delta as the backup streams through. The base is indexed up
+// front; then a window of one block rolls over the stream a byte at a time
+// until its weak checksum and then its strong hash match a base block. The
+// block after the last match is tried first, so unchanged stretches go
+// quickly and merge into one copy. Bytes still being matched stay here
+// until close, which sends them and ends the delta.
+struct deltasink : public bytesink
+{
+	static constexpr DWORD maxLiteral = 0x100000;
+	static constexpr DWORD maxCopy = 0x10000;
+	static constexpr int filterBits = 24;
+
+	explicit deltasink(std::unique_ptr<bytesink> sink)
+		: sink(std::move(sink))
+		, filter(static_cast<size_t>(1) << filterBits)
+	{
+	}
+
+	// reads the whole base, hashing every full block
+	HRESULT index(HANDLE hBase)
+	{
+		if (!delta::baseId(hBase, baseSize, baseId)) {
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		const DWORD chunk = delta::blockSize * 128;
+		std::vector<BYTE> buf(chunk);
+		for (unsigned __int64 offset = 0; offset + delta::blockSize <= baseSize; offset += chunk) {
+			DWORD got = 0;
+			if (!delta::readAt(hBase, offset, buf.data(), chunk, &got)) {
+				return HRESULT_FROM_WIN32(::GetLastError());
+			}
+
+			for (DWORD i = 0; i + delta::blockSize <= got; i += delta::blockSize) {
+				delta::weak w;
+				w.reset(buf.data() + i, delta::blockSize);
+				weakOf.push_back(w.value());
+				strongOf.push_back(delta::hash(buf.data() + i, delta::blockSize));
+			}
+		}
+
+		// one entry per distinct block, sorted by weak checksum
+		for (DWORD block = 0; block < weakOf.size(); ++block) {
+			entries.push_back({ weakOf[block], block });
+		}
+		std::sort(entries.begin(), entries.end(), [this](const entry& a, const entry& b) {
+			return a.weak != b.weak ? a.weak < b.weak : strongOf[a.block] != strongOf[b.block] ? strongOf[a.block] < strongOf[b.block] : a.block < b.block;
+		});
+		entries.erase(std::unique(entries.begin(), entries.end(), [this](const entry& a, const entry& b) {
+			return a.weak == b.weak && strongOf[a.block] == strongOf[b.block];
+		}), entries.end());
+
+		for (auto&& e : entries) {
+			filter[slot(e.weak)] = true;
+		}
+
+		delta::header h = { delta::signature, delta::version, delta::blockSize, 0, baseSize, baseId };
+		if (!writeAll(&h, sizeof(h))) {
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		return S_OK;
+	}
+
+	size_t blockCount() const
+	{
+		return weakOf.size();
+	}
+
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		*pdwBytes = 0;
+		pending.insert(pending.end(), buf, buf + len);
+		if (!scan()) {
+			return FALSE;
+		}
+		total += len;
+		*pdwBytes = len;
+		updateStats();
+		return TRUE;
+	}
+
+	virtual BOOL flush() override
+	{
+		return sink->flush();
+	}
+
+	// what is left can not fill a block, so it goes as it is
+	virtual BOOL close() override
+	{
+		if (!sendLiteral(pending.size()) || !sendCopy()) {
+			return FALSE;
+		}
+
+		delta::op e = { delta::end, 0, total };
+		if (!writeAll(&e, sizeof(e))) {
+			return FALSE;
+		}
+
+		BOOL ret = sink->close();
+		updateStats();
+		return ret;
+	}
+
+protected:
+	struct entry
+	{
+		DWORD weak;
+		DWORD block;
+	};
+
+	static size_t slot(DWORD weak)
+	{
+		return static_cast<size_t>((weak * 0x9E3779B1u) >> (32 - filterBits));
+	}
+
+	// the base block matching the window at pos, if any
+	bool match(const BYTE* window, DWORD weak, DWORD& block)
+	{
+		unsigned __int64 strong = 0;
+		bool hashed = false;
+
+		DWORD next = copyCount ? copyFirst + copyCount : static_cast<DWORD>(-1);
+		if (next < weakOf.size() && weakOf[next] == weak) {
+			strong = delta::hash(window, delta::blockSize);
+			hashed = true;
+			if (strongOf[next] == strong) {
+				block = next;
+				return true;
+			}
+		}
+
+		if (!filter[slot(weak)]) {
+			return false;
+		}
+
+		auto range = std::equal_range(entries.begin(), entries.end(), entry{ weak, 0 }, [](const entry& a, const entry& b) {
+			return a.weak < b.weak;
+		});
+		for (auto e = range.first; e != range.second; ++e) {
+			if (!hashed) {
+				strong = delta::hash(window, delta::blockSize);
+				hashed = true;
+			}
+			if (strongOf[e->block] == strong) {
+				block = e->block;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool scan()
+	{
+		while (pending.size() - pos >= delta::blockSize) {
+			const BYTE* window = pending.data() + pos;
+			if (!rolling) {
+				checksum.reset(window, delta::blockSize);
+				rolling = true;
+			}
+
+			DWORD block = 0;
+			if (match(window, checksum.value(), block)) {
+				if (!sendLiteral(pos)) {
+					return false;
+				}
+				if (copyCount && (block != copyFirst + copyCount || copyCount == maxCopy) && !sendCopy()) {
+					return false;
+				}
+				if (!copyCount) {
+					copyFirst = block;
+				}
+				++copyCount;
+
+				pos += delta::blockSize;
+				literalStart = pos;
+				rolling = false;
+				continue;
+			}
+
+			// the next byte has not arrived yet
+			if (pending.size() - pos == delta::blockSize) {
+				break;
+			}
+
+			checksum.roll(pending[pos], pending[pos + delta::blockSize], delta::blockSize);
+			++pos;
+
+			if (pos - literalStart >= maxLiteral && !sendLiteral(pos)) {
+				return false;
+			}
+		}
+
+		// drop what has been sent once it is worth the move
+		if (literalStart >= maxLiteral) {
+			pending.erase(pending.begin(), pending.begin() + literalStart);
+			pos -= literalStart;
+			literalStart = 0;
+		}
+
+		return true;
+	}
+
+	// the bytes from literalStart up to end
+	bool sendLiteral(size_t end)
+	{
+		if (end <= literalStart) {
+			return true;
+		}
+		if (!sendCopy()) {
+			return false;
+		}
+
+		DWORD count = static_cast<DWORD>(end - literalStart);
+		delta::op l = { delta::literal, count, 0 };
+		if (!writeAll(&l, sizeof(l)) || !writeAll(pending.data() + literalStart, count)) {
+			return false;
+		}
+
+		literalBytes += count;
+		literalStart = end;
+		return true;
+	}
+
+	bool sendCopy()
+	{
+		if (!copyCount) {
+			return true;
+		}
+
+		delta::op c = { delta::copy, copyCount, copyFirst };
+		if (!writeAll(&c, sizeof(c)) || !writeAll(&strongOf[copyFirst], copyCount * sizeof(unsigned __int64))) {
+			return false;
+		}
+
+		matchedBytes += static_cast<unsigned __int64>(copyCount) * delta::blockSize;
+		copyCount = 0;
+		return true;
+	}
+
+	bool writeAll(const void* data, DWORD len)
+	{
+		const BYTE* buf = static_cast<const BYTE*>(data);
+		while (len > 0) {
+			DWORD dwBytes = 0;
+			BOOL ret = sink->write(buf, len, &dwBytes);
+			buf += dwBytes;
+			len -= dwBytes;
+			if (!ret || !dwBytes) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void updateStats()
+	{
+		iostats inner = sink->stats;
+		stats = inner;
+		stats.literalBytes = literalBytes;
+		stats.matchedBytes = matchedBytes;
+	}
+
+	std::unique_ptr<bytesink> sink;
+
+	unsigned __int64 baseSize = 0;
+	unsigned __int64 baseId = 0;
+	std::vector<DWORD> weakOf;
+	std::vector<unsigned __int64> strongOf;
+	std::vector<entry> entries;
+	std::vector<bool> filter;
+
+	std::vector<BYTE> pending;
+	size_t pos = 0;
+	size_t literalStart = 0;
+	delta::weak checksum;
+	bool rolling = false;
+
+	DWORD copyFirst = 0;
+	DWORD copyCount = 0;
+
+	unsigned __int64 total = 0;
+	unsigned __int64 literalBytes = 0;
+	unsigned __int64 matchedBytes = 0;
+};
+
+// rebuilds the stream from a delta and its base as the restore reads it.
+// Literals are read from the delta and copied blocks from the base, each
+// straight into the caller's buffer; a copied block whose hash is not the
+// one recorded fails the read, so a wrong base can not slip through. A
+// stream that is not a delta passes through untouched.
+struct deltasource : public bytesource
+{
+	// takes hBase over, closing it when done
+	deltasource(std::unique_ptr<bytesource> source, HANDLE hBase)
+		: source(std::move(source))
+		, hBase(hBase)
+	{
+	}
+
+	virtual ~deltasource()
+	{
+		::CloseHandle(hBase);
+	}
+
+	virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		*pdwBytes = 0;
+
+		if (!started) {
+			started = true;
+
+			DWORD peeked = 0;
+			if (!readAll(&header, sizeof(header), peeked)) {
+				return FALSE;
+			}
+			isDelta = peeked == sizeof(header) && header.magic == delta::signature;
+			if (!isDelta) {
+				peek.assign(reinterpret_cast<BYTE*>(&header), reinterpret_cast<BYTE*>(&header) + peeked);
+			}
+			else if (!checkBase()) {
+				return FALSE;
+			}
+		}
+
+		if (!isDelta) {
+			if (peekPos < peek.size()) {
+				DWORD n = static_cast<DWORD>(min(static_cast<size_t>(len), peek.size() - peekPos));
+				memcpy(buf, peek.data() + peekPos, n);
+				peekPos += n;
+				*pdwBytes = n;
+				return TRUE;
+			}
+			BOOL ret = source->read(buf, len, pdwBytes);
+			stats = source->stats;
+			return ret;
+		}
+
+		while (!literalLeft && !copyLeft) {
+			if (ended) {
+				return TRUE;
+			}
+			if (!readOp()) {
+				return FALSE;
+			}
+		}
+
+		if (literalLeft) {
+			BOOL ret = source->read(buf, min(len, literalLeft), pdwBytes);
+			stats = source->stats;
+			if (ret && !*pdwBytes) {
+				return fail(ERROR_INVALID_DATA);
+			}
+			literalLeft -= *pdwBytes;
+			produced += *pdwBytes;
+			return ret;
+		}
+
+		// whole blocks go straight into the caller's buffer, a part of one through staged
+		if (!stagedLen && len >= delta::blockSize) {
+			DWORD blocks = min(len / delta::blockSize, copyLeft);
+			DWORD got = 0;
+			if (!delta::readAt(hBase, copyNext * delta::blockSize, buf, blocks * delta::blockSize, &got)) {
+				return FALSE;
+			}
+			if (got != blocks * delta::blockSize) {
+				return fail(ERROR_INVALID_DATA);
+			}
+			for (DWORD i = 0; i < blocks; ++i) {
+				if (!checkBlock(buf + i * delta::blockSize)) {
+					return FALSE;
+				}
+			}
+			copyLeft -= blocks;
+			*pdwBytes = got;
+			produced += got;
+			return TRUE;
+		}
+
+		if (!stagedLen) {
+			staged.resize(delta::blockSize);
+			DWORD got = 0;
+			if (!delta::readAt(hBase, copyNext * delta::blockSize, staged.data(), delta::blockSize, &got)) {
+				return FALSE;
+			}
+			if (got != delta::blockSize) {
+				return fail(ERROR_INVALID_DATA);
+			}
+			if (!checkBlock(staged.data())) {
+				return FALSE;
+			}
+			stagedLen = delta::blockSize;
+			stagedPos = 0;
+		}
+
+		DWORD n = min(len, stagedLen - stagedPos);
+		memcpy(buf, staged.data() + stagedPos, n);
+		stagedPos += n;
+		if (stagedPos == stagedLen) {
+			stagedLen = 0;
+			--copyLeft;
+		}
+		*pdwBytes = n;
+		produced += n;
+		return TRUE;
+	}
+
+protected:
+	bool fail(DWORD err)
+	{
+		::SetLastError(err);
+		return false;
+	}
+
+	bool readAll(void* data, DWORD len, DWORD& got)
+	{
+		BYTE* buf = static_cast<BYTE*>(data);
+		got = 0;
+		while (got < len) {
+			DWORD dwBytes = 0;
+			BOOL ret = source->read(buf + got, len - got, &dwBytes);
+			got += dwBytes;
+			if (!ret) {
+				return false;
+			}
+			if (!dwBytes) {
+				break;
+			}
+		}
+		stats = source->stats;
+		return true;
+	}
+
+	bool checkBase()
+	{
+		unsigned __int64 size = 0;
+		unsigned __int64 id = 0;
+		if (header.version != delta::version || header.blockSize != delta::blockSize) {
+			return fail(ERROR_NOT_SUPPORTED);
+		}
+		if (!delta::baseId(hBase, size, id)) {
+			return false;
+		}
+		if (size != header.baseSize || id != header.baseId) {
+			return fail(ERROR_FILE_INVALID);
+		}
+		return true;
+	}
+
+	// the block just read from the base is copyNext; moves on to the next
+	bool checkBlock(const BYTE* block)
+	{
+		if (delta::hash(block, delta::blockSize) != hashes[static_cast<size_t>(copyNext - copyFirst)]) {
+			return fail(ERROR_FILE_INVALID);
+		}
+		++copyNext;
+		return true;
+	}
+
+	bool readOp()
+	{
+		delta::op o = {};
+		DWORD got = 0;
+		if (!readAll(&o, sizeof(o), got)) {
+			return false;
+		}
+		if (got != sizeof(o)) {
+			return fail(ERROR_INVALID_DATA);
+		}
+
+		switch (o.kind) {
+		case delta::literal:
+			literalLeft = o.count;
+			return true;
+		case delta::copy:
+			if (o.count > deltasink::maxCopy || (o.first + o.count) * delta::blockSize > header.baseSize) {
+				return fail(ERROR_INVALID_DATA);
+			}
+			hashes.resize(o.count);
+			if (!readAll(hashes.data(), o.count * sizeof(unsigned __int64), got)) {
+				return false;
+			}
+			if (got != o.count * sizeof(unsigned __int64)) {
+				return fail(ERROR_INVALID_DATA);
+			}
+			copyFirst = o.first;
+			copyNext = o.first;
+			copyLeft = o.count;
+			return true;
+		case delta::end:
+			if (o.first != produced) {
+				return fail(ERROR_INVALID_DATA);
+			}
+			ended = true;
+			return true;
+		default:
+			return fail(ERROR_INVALID_DATA);
+		}
+	}
+
+	std::unique_ptr<bytesource> source;
+	HANDLE hBase = nullptr;
+
+	bool started = false;
+	bool isDelta = false;
+	bool ended = false;
+	delta::header header = {};
+	std::vector<BYTE> peek;
+	size_t peekPos = 0;
+
+	DWORD literalLeft = 0;
+	unsigned __int64 copyFirst = 0;
+	unsigned __int64 copyNext = 0;
+	DWORD copyLeft = 0;
+	std::vector<unsigned __int64> hashes;
+	std::vector<BYTE> staged;
+	DWORD stagedLen = 0;
+	DWORD stagedPos = 0;
+	unsigned __int64 produced = 0;
+};
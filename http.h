@@ -0,0 +1,495 @@
+#pragma once
+
+#include <winhttp.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+
+// the parts of an http(s) url WinHTTP needs
+struct httpurl
+{
+	bool secure = false;
+	std::string host;
+	INTERNET_PORT port = 0;
+	std::string path;
+
+	static bool isHttp(const std::string& url)
+	{
+		std::string scheme = ToLower(url.substr(0, url.find("://")));
+		return url.find("://") != std::string::npos && (scheme == "http" || scheme == "https");
+	}
+
+	bool parse(const std::string& url)
+	{
+		if (!isHttp(url)) {
+			return false;
+		}
+
+		size_t schemeEnd = url.find("://");
+		secure = ToLower(url.substr(0, schemeEnd)) == "https";
+
+		size_t hostStart = schemeEnd + 3;
+		size_t pathStart = url.find('/', hostStart);
+		std::string authority = url.substr(hostStart, pathStart == std::string::npos ? std::string::npos : pathStart - hostStart);
+		path = pathStart == std::string::npos ? "/" : url.substr(pathStart);
+
+		size_t colon = authority.rfind(':');
+		if (colon != std::string::npos && authority.find(']', colon) == std::string::npos) {
+			port = static_cast<INTERNET_PORT>(strtoul(authority.c_str() + colon + 1, nullptr, 10));
+			host = authority.substr(0, colon);
+		}
+		else {
+			port = secure ? INTERNET_DEFAULT_HTTPS_PORT : INTERNET_DEFAULT_HTTP_PORT;
+			host = authority;
+		}
+
+		return !host.empty() && port;
+	}
+
+	// the Host header, which carries the port when it is not the default
+	std::string hostHeader() const
+	{
+		if (port == (secure ? INTERNET_DEFAULT_HTTPS_PORT : INTERNET_DEFAULT_HTTP_PORT)) {
+			return host;
+		}
+		return host + ":" + std::to_string(port);
+	}
+};
+
+struct httpresponse
+{
+	DWORD status = 0;
+	std::string headers;
+	std::string body;
+	DWORD bodyBytes = 0;
+
+	bool ok() const
+	{
+		return status >= 200 && status < 300;
+	}
+
+	// the value of a response header, or empty
+	std::string header(const char* name) const
+	{
+		std::istringstream i(headers);
+		std::string line;
+		size_t nameLen = strlen(name);
+		while (std::getline(i, line)) {
+			if (line.size() > nameLen && line[nameLen] == ':' && iequals(line.substr(0, nameLen), name)) {
+				size_t start = line.find_first_not_of(' ', nameLen + 1);
+				size_t end = line.find_last_not_of("\r ");
+				return start == std::string::npos ? std::string() : line.substr(start, end + 1 - start);
+			}
+		}
+		return std::string();
+	}
+};
+
+// a WinHTTP session and connection to one host. WinHTTP handles are safe to
+// share, so several threads may send on it at once, each over its own
+// pooled connection.
+struct httpclient
+{
+	~httpclient()
+	{
+		if (hConnect) {
+			::WinHttpCloseHandle(hConnect);
+		}
+		if (hSession) {
+			::WinHttpCloseHandle(hSession);
+		}
+	}
+
+	HRESULT open(const httpurl& url, DWORD maxConnections)
+	{
+		secure = url.secure;
+
+		hSession = ::WinHttpOpen(L"mssqlPipe", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+		if (!hSession) {
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		if (maxConnections) {
+			::WinHttpSetOption(hSession, WINHTTP_OPTION_MAX_CONNS_PER_SERVER, &maxConnections, sizeof(maxConnections));
+		}
+
+		// a part upload can take a while on a slow link
+		::WinHttpSetTimeouts(hSession, 0, 60 * 1000, 5 * 60 * 1000, 5 * 60 * 1000);
+
+		hConnect = ::WinHttpConnect(hSession, widen(url.host).c_str(), url.port, 0);
+		if (!hConnect) {
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		return S_OK;
+	}
+
+	// sends one request, headers given as "Name: value". The response body
+	// goes to out if given, otherwise to response.body. path must already
+	// be escaped; it is sent as is, since it may have been signed.
+	HRESULT send(const std::string& verb, const std::string& path, const std::vector<std::string>& headers, const void* body, DWORD bodyLen, httpresponse& response, BYTE* out = nullptr, DWORD outLen = 0)
+	{
+		HINTERNET hRequest = nullptr;
+		HRESULT hr = request(verb, path, headers, body, bodyLen, response, hRequest);
+		if (SUCCEEDED(hr)) {
+			hr = readBody(hRequest, response, out, outLen);
+		}
+
+		if (hRequest) {
+			::WinHttpCloseHandle(hRequest);
+		}
+
+		return hr;
+	}
+
+	// sends one request and receives the response headers, leaving the body
+	// to be read from hRequest, which the caller closes
+	HRESULT request(const std::string& verb, const std::string& path, const std::vector<std::string>& headers, const void* body, DWORD bodyLen, httpresponse& response, HINTERNET& hRequest)
+	{
+		response = httpresponse();
+
+		hRequest = ::WinHttpOpenRequest(hConnect, widen(verb).c_str(), widen(path).c_str(), nullptr, WINHTTP_NO_REFERER, WINHTTP_DEFAULT_ACCEPT_TYPES
+			, (secure ? WINHTTP_FLAG_SECURE : 0) | WINHTTP_FLAG_ESCAPE_DISABLE | WINHTTP_FLAG_ESCAPE_DISABLE_QUERY);
+		if (!hRequest) {
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		std::wstring allHeaders;
+		for (auto&& h : headers) {
+			allHeaders += widen(h);
+			allHeaders += L"\r\n";
+		}
+
+		if (!::WinHttpSendRequest(hRequest, allHeaders.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : allHeaders.c_str(), static_cast<DWORD>(-1L)
+			, const_cast<void*>(body), bodyLen, bodyLen, 0)) {
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		if (!::WinHttpReceiveResponse(hRequest, nullptr)) {
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		DWORD size = sizeof(response.status);
+		::WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &response.status, &size, WINHTTP_NO_HEADER_INDEX);
+
+		size = 0;
+		::WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, WINHTTP_NO_OUTPUT_BUFFER, &size, WINHTTP_NO_HEADER_INDEX);
+		if (size) {
+			std::wstring raw(size / sizeof(wchar_t), L'\0');
+			if (::WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, &raw[0], &size, WINHTTP_NO_HEADER_INDEX)) {
+				raw.resize(size / sizeof(wchar_t));
+				response.headers = narrow(raw);
+			}
+		}
+
+		return S_OK;
+	}
+
+protected:
+	HRESULT readBody(HINTERNET hRequest, httpresponse& response, BYTE* out, DWORD outLen)
+	{
+		// an error body always goes to response.body, so it can be reported
+		bool toOut = out && response.ok();
+
+		for (;;) {
+			char chunk[0x4000];
+			BYTE* dest = toOut ? out + response.bodyBytes : reinterpret_cast<BYTE*>(chunk);
+			DWORD destLen = toOut ? outLen - response.bodyBytes : sizeof(chunk);
+			if (toOut && !destLen) {
+				// more than we asked for; read into the chunk to tell
+				dest = reinterpret_cast<BYTE*>(chunk);
+				destLen = sizeof(chunk);
+			}
+
+			DWORD dwBytes = 0;
+			if (!::WinHttpReadData(hRequest, dest, destLen, &dwBytes)) {
+				return HRESULT_FROM_WIN32(::GetLastError());
+			}
+			if (!dwBytes) {
+				break;
+			}
+
+			if (toOut && dest == out + response.bodyBytes) {
+				response.bodyBytes += dwBytes;
+			}
+			else if (toOut) {
+				return HRESULT_FROM_WIN32(ERROR_MORE_DATA);
+			}
+			else {
+				response.body.append(chunk, dwBytes);
+				response.bodyBytes += dwBytes;
+			}
+		}
+
+		return S_OK;
+	}
+
+	HINTERNET hSession = nullptr;
+	HINTERNET hConnect = nullptr;
+	bool secure = false;
+};
+
+/****/
+
+// reads a remote object of known size with several ranged requests in
+// flight at once. Chunks land in a window of buffers in whatever order they
+// complete, and read hands them to the pump strictly in order.
+struct rangedsource : public bytesource
+{
+	// fetches [offset, offset + len) into buf, setting the bytes received
+	typedef std::function<HRESULT(unsigned __int64 offset, DWORD len, BYTE* buf, DWORD& received)> fetcher;
+
+	static constexpr DWORD defaultChunkSize = 0x800000;
+	static constexpr DWORD defaultConnections = 4;
+	static constexpr int attempts = 3;
+
+	// startOffset skips what an earlier, failed read already delivered
+	rangedsource(fetcher fetch, unsigned __int64 totalBytes, DWORD connections = defaultConnections, DWORD chunkSize = defaultChunkSize, unsigned __int64 startOffset = 0)
+		: fetch(fetch)
+		, totalBytes(totalBytes)
+		, chunkSize(chunkSize ? chunkSize : defaultChunkSize)
+		, startOffset(min(startOffset, totalBytes))
+	{
+		if (!connections) {
+			connections = defaultConnections;
+		}
+
+		chunkCount = (totalBytes - this->startOffset + this->chunkSize - 1) / this->chunkSize;
+
+		// twice as many buffers as connections, so the pump never waits on a refill
+		slots.resize(connections * 2);
+		for (auto&& s : slots) {
+			s.buffer.reset(new BYTE[this->chunkSize]);
+		}
+
+		for (DWORD i = 0; i < connections; ++i) {
+			workers.emplace_back([this] { fetchLoop(); });
+		}
+	}
+
+	~rangedsource()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cv.notify_all();
+
+		for (auto&& t : workers) {
+			t.join();
+		}
+	}
+
+	virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		*pdwBytes = 0;
+
+		while (len > 0 && nextRead < chunkCount) {
+			slot& s = slots[nextRead % slots.size()];
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this, &s] { return (s.ready && s.index == nextRead) || failed; });
+				if (failed && !(s.ready && s.index == nextRead)) {
+					::SetLastError(lastError);
+					return *pdwBytes ? TRUE : FALSE;
+				}
+			}
+
+			DWORD n = min(len, s.len - s.pos);
+			memcpy(buf, s.buffer.get() + s.pos, n);
+			s.pos += n;
+			buf += n;
+			len -= n;
+			*pdwBytes += n;
+
+			if (s.pos == s.len) {
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					s.ready = false;
+					++nextRead;
+				}
+				cv.notify_all();
+			}
+		}
+
+		return TRUE;
+	}
+
+protected:
+	struct slot
+	{
+		std::unique_ptr<BYTE[]> buffer;
+		unsigned __int64 index = 0;
+		DWORD len = 0;
+		DWORD pos = 0;
+		bool ready = false;
+	};
+
+	void fetchLoop()
+	{
+		for (;;) {
+			unsigned __int64 index = 0;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this] { return stopping || failed || nextFetch >= chunkCount || nextFetch < nextRead + slots.size(); });
+				if (stopping || failed || nextFetch >= chunkCount) {
+					return;
+				}
+				index = nextFetch++;
+			}
+
+			// the slot was last used for index - slots.size(), which has been read
+			slot& s = slots[index % slots.size()];
+
+			unsigned __int64 offset = startOffset + index * chunkSize;
+			DWORD len = static_cast<DWORD>(min(static_cast<unsigned __int64>(chunkSize), totalBytes - offset));
+
+			// a dropped connection costs one chunk, not the whole restore
+			HRESULT hr = S_OK;
+			DWORD received = 0;
+			for (int attempt = 0; attempt < attempts; ++attempt) {
+				if (attempt) {
+					::Sleep(1000 << attempt);
+				}
+				received = 0;
+				hr = fetch(offset, len, s.buffer.get(), received);
+				if (SUCCEEDED(hr) && received != len) {
+					hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+				}
+				if (SUCCEEDED(hr)) {
+					break;
+				}
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (SUCCEEDED(hr)) {
+					s.index = index;
+					s.len = received;
+					s.pos = 0;
+					s.ready = true;
+				}
+				else if (!failed) {
+					failed = true;
+					lastError = HRESULT_FACILITY(hr) == FACILITY_WIN32 ? HRESULT_CODE(hr) : ERROR_READ_FAULT;
+				}
+			}
+			cv.notify_all();
+		}
+	}
+
+	fetcher fetch;
+	unsigned __int64 totalBytes = 0;
+	DWORD chunkSize = 0;
+	unsigned __int64 startOffset = 0;
+	unsigned __int64 chunkCount = 0;
+
+	std::vector<slot> slots;
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	unsigned __int64 nextFetch = 0;
+	unsigned __int64 nextRead = 0;
+	bool stopping = false;
+	bool failed = false;
+	DWORD lastError = 0;
+};
+
+// a plain GET of an http(s) url. Servers that report the size and take
+// byte ranges are read in parallel chunks, others as a single stream.
+struct httpsource : public rangedsource
+{
+	httpsource(std::shared_ptr<httpclient> client, const std::string& path, unsigned __int64 totalBytes, DWORD connections, unsigned __int64 offset)
+		: rangedsource([client, path](unsigned __int64 offset, DWORD len, BYTE* buf, DWORD& received) {
+			std::ostringstream range;
+			range << "Range: bytes=" << offset << "-" << (offset + len - 1);
+
+			httpresponse response;
+			HRESULT hr = client->send("GET", path, { range.str() }, nullptr, 0, response, buf, len);
+			received = response.bodyBytes;
+			if (SUCCEEDED(hr) && response.status != 206) {
+				// a whole 200 body is not the range we asked for
+				hr = HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+			}
+			return hr;
+		}, totalBytes, connections, defaultChunkSize, offset)
+	{
+	}
+
+	static HRESULT open(const std::string& url, DWORD connections, std::unique_ptr<bytesource>& source, unsigned __int64 offset = 0)
+	{
+		httpurl location;
+		if (!location.parse(url)) {
+			return E_INVALIDARG;
+		}
+
+		auto client = std::make_shared<httpclient>();
+		HRESULT hr = client->open(location, connections ? connections : defaultConnections);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+
+		httpresponse response;
+		hr = client->send("HEAD", location.path, {}, nullptr, 0, response);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+
+		std::string length = response.header("Content-Length");
+		if (response.ok() && !length.empty() && iequals(response.header("Accept-Ranges"), "bytes")) {
+			source = std::make_unique<httpsource>(client, location.path, _strtoui64(length.c_str(), nullptr, 10), connections, offset);
+			return S_OK;
+		}
+
+		if (offset) {
+			// without ranges there is no starting part way through
+			return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+		}
+
+		auto stream = std::make_unique<httpstream>(client);
+		hr = stream->open(location.path);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+
+		source = std::move(stream);
+		return S_OK;
+	}
+
+protected:
+	// the fallback: one request, read as it arrives
+	struct httpstream : public bytesource
+	{
+		explicit httpstream(std::shared_ptr<httpclient> client)
+			: client(client)
+		{
+		}
+
+		~httpstream()
+		{
+			if (hRequest) {
+				::WinHttpCloseHandle(hRequest);
+			}
+		}
+
+		HRESULT open(const std::string& path)
+		{
+			httpresponse response;
+			HRESULT hr = client->request("GET", path, {}, nullptr, 0, response, hRequest);
+			if (SUCCEEDED(hr) && !response.ok()) {
+				hr = HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+			}
+			return hr;
+		}
+
+		virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) override
+		{
+			return ::WinHttpReadData(hRequest, buf, len, pdwBytes);
+		}
+
+		std::shared_ptr<httpclient> client;
+		HINTERNET hRequest = nullptr;
+	};
+};
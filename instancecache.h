@@ -0,0 +1,232 @@
+#pragma once
+
+// what planning a restore needs to know about an instance
+struct instanceinfo
+{
+	std::string dataPath;
+	std::string logPath;
+	std::string version;
+
+	// volume mount point and the bytes free on it
+	std::vector<std::pair<std::string, unsigned __int64>> volumes;
+
+	// the mount point of the volume holding path, or empty when not known
+	std::string volumeOf(std::string path) const
+	{
+		std::replace(path.begin(), path.end(), '/', '\\');
+
+		std::string best;
+		for (auto&& v : volumes) {
+			if (v.first.size() > best.size() && v.first.size() <= path.size() && iequals(path.substr(0, v.first.size()), v.first)) {
+				best = v.first;
+			}
+		}
+		return best;
+	}
+
+	// free bytes on the volume holding path, or -1 when not known
+	unsigned __int64 freeBytes(const std::string& path) const
+	{
+		std::string volume = volumeOf(path);
+		for (auto&& v : volumes) {
+			if (!volume.empty() && v.first == volume) {
+				return v.second;
+			}
+		}
+		return static_cast<unsigned __int64>(-1);
+	}
+};
+
+// the bytes a batch has already given to each volume, taken off the free
+// space the later jobs plan with, so they do not count on the same space
+struct volumereservations
+{
+	std::map<std::string, unsigned __int64, iless_predicate> bytes;
+
+	void apply(instanceinfo& info) const
+	{
+		for (auto&& v : info.volumes) {
+			auto it = bytes.find(v.first);
+			if (it != bytes.end()) {
+				v.second -= min(v.second, it->second);
+			}
+		}
+	}
+
+	void reserve(const instanceinfo& info, const std::string& path, unsigned __int64 size)
+	{
+		std::string volume = info.volumeOf(path);
+		if (!volume.empty()) {
+			bytes[volume] += size;
+		}
+	}
+};
+
+// instanceinfo kept between runs in %LOCALAPPDATA%\mssqlPipe\instances.ini,
+// one section per instance, so repeated and batch restores skip the query
+// over sys.master_files. Entries older than ttl seconds are ignored, and a
+// ttl of 0 turns the cache off. Autotune results go in a section of their own.
+struct instancecache
+{
+	explicit instancecache(DWORD ttl)
+		: ttl(ttl)
+	{
+		wchar_t path[MAX_PATH] = {};
+		if (ttl && SUCCEEDED(::SHGetFolderPath(nullptr, CSIDL_LOCAL_APPDATA, nullptr, SHGFP_TYPE_CURRENT, path))) {
+			fileName = path;
+			fileName += L"\\mssqlPipe";
+			::CreateDirectory(fileName.c_str(), nullptr);
+			fileName += L"\\instances.ini";
+		}
+	}
+
+	bool load(const std::string& instance, instanceinfo& info) const
+	{
+		if (fileName.empty()) {
+			return false;
+		}
+
+		std::wstring s = section(instance);
+
+		unsigned __int64 cached = _wcstoui64(read(s, L"Cached").c_str(), nullptr, 10);
+		if (!cached || now() < cached || (now() - cached) / 10000000 > ttl) {
+			return false;
+		}
+
+		info.dataPath = narrow(read(s, L"DefaultData"));
+		info.logPath = narrow(read(s, L"DefaultLog"));
+		info.version = narrow(read(s, L"Version"));
+
+		// mount point|free bytes, separated by ;
+		info.volumes.clear();
+		std::istringstream volumes(narrow(read(s, L"Volumes")));
+		std::string volume;
+		while (std::getline(volumes, volume, ';')) {
+			size_t bar = volume.rfind('|');
+			if (bar != std::string::npos) {
+				info.volumes.emplace_back(volume.substr(0, bar), _strtoui64(volume.c_str() + bar + 1, nullptr, 10));
+			}
+		}
+
+		return !info.dataPath.empty() && !info.logPath.empty();
+	}
+
+	void store(const std::string& instance, const instanceinfo& info) const
+	{
+		if (fileName.empty()) {
+			return;
+		}
+
+		std::ostringstream volumes;
+		for (auto&& v : info.volumes) {
+			volumes << v.first << "|" << v.second << ";";
+		}
+
+		std::wstring s = section(instance);
+		write(s, L"DefaultData", widen(info.dataPath));
+		write(s, L"DefaultLog", widen(info.logPath));
+		write(s, L"Version", widen(info.version));
+		write(s, L"Volumes", widen(volumes.str()));
+		write(s, L"Cached", std::to_wstring(now()));
+	}
+
+	// the buffercount and maxtransfersize autotune picked for a database.
+	// These are kept until it is tuned again, whatever the ttl.
+	bool loadTuning(const std::string& instance, const std::string& database, tuning& tune) const
+	{
+		if (fileName.empty()) {
+			return false;
+		}
+
+		std::string value = narrow(read(tuningSection(instance), widen(ToLower(database)).c_str()));
+		size_t bar = value.find('|');
+		if (bar == std::string::npos) {
+			return false;
+		}
+
+		DWORD bufferCount = strtoul(value.c_str(), nullptr, 10);
+		DWORD maxTransferSize = strtoul(value.c_str() + bar + 1, nullptr, 10);
+		if (!bufferCount || !maxTransferSize) {
+			return false;
+		}
+
+		tune.bufferCount = bufferCount;
+		tune.maxTransferSize = maxTransferSize;
+		return true;
+	}
+
+	void storeTuning(const std::string& instance, const std::string& database, const tuning& tune) const
+	{
+		if (!fileName.empty()) {
+			write(tuningSection(instance), widen(ToLower(database)).c_str(), std::to_wstring(tune.bufferCount) + L"|" + std::to_wstring(tune.maxTransferSize));
+		}
+	}
+
+	// forgets the instance, after a restore planned from the cache failed
+	void invalidate(const std::string& instance) const
+	{
+		if (!fileName.empty()) {
+			::WritePrivateProfileString(section(instance).c_str(), nullptr, nullptr, fileName.c_str());
+		}
+	}
+
+protected:
+	static std::wstring section(const std::string& instance)
+	{
+		return widen(normalize(instance));
+	}
+
+	// one name for each way of writing the local server: ., (local),
+	// localhost and this machine's name, with or without a protocol prefix
+	static std::string normalize(const std::string& instance)
+	{
+		std::string name = ToLower(instance);
+		for (const char* protocol : { "tcp:", "np:", "lpc:" }) {
+			if (0 == name.find(protocol)) {
+				name = name.substr(strlen(protocol));
+				break;
+			}
+		}
+
+		size_t slash = name.find('\\');
+		std::string host = name.substr(0, slash);
+		std::string rest = slash == std::string::npos ? std::string() : name.substr(slash);
+
+		wchar_t computer[MAX_COMPUTERNAME_LENGTH + 1] = {};
+		DWORD computerLen = _countof(computer);
+		::GetComputerName(computer, &computerLen);
+
+		if (host.empty() || host == "." || host == "(local)" || host == "localhost" || host == "127.0.0.1" || iequals(host, narrow(computer))) {
+			host = "(local)";
+		}
+		return host + rest;
+	}
+
+	static std::wstring tuningSection(const std::string& instance)
+	{
+		return section(instance) + L" tuning";
+	}
+
+	// 100ns intervals since 1601
+	static unsigned __int64 now()
+	{
+		FILETIME ft;
+		::GetSystemTimeAsFileTime(&ft);
+		return (static_cast<unsigned __int64>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+	}
+
+	std::wstring read(const std::wstring& s, const wchar_t* key) const
+	{
+		wchar_t value[4096] = {};
+		::GetPrivateProfileString(s.c_str(), key, L"", value, _countof(value), fileName.c_str());
+		return value;
+	}
+
+	void write(const std::wstring& s, const wchar_t* key, const std::wstring& value) const
+	{
+		::WritePrivateProfileString(s.c_str(), key, value.c_str(), fileName.c_str());
+	}
+
+	std::wstring fileName;
+	DWORD ttl = 0;
+};
@@ -0,0 +1,710 @@
+#pragma once
+
+#include <functional>
+
+// bytes that went between the VDI buffer and the disk without passing
+// through the system cache, and those that did
+struct iostats
+{
+	unsigned __int64 directBytes = 0;
+	unsigned __int64 cachedBytes = 0;
+
+	// what a compressing sink took in and put out, and the frames it packed at each level
+	unsigned __int64 rawBytes = 0;
+	unsigned __int64 packedBytes = 0;
+	std::vector<unsigned __int64> levelFrames;
+
+	// what a delta sent as literal bytes and as blocks of its base
+	unsigned __int64 literalBytes = 0;
+	unsigned __int64 matchedBytes = 0;
+};
+
+// where InputFile gets its bytes from. read follows ReadFile: FALSE with
+// the last error set on failure, TRUE with 0 bytes at the end of the stream.
+struct bytesource
+{
+	virtual ~bytesource() {}
+	virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) = 0;
+
+	iostats stats;
+};
+
+// where OutputFile puts its bytes; flush waits until everything written so
+// far has reached the handle, and reports any error that happened meanwhile.
+// close ends a successful stream, for sinks that have to finish it somehow.
+struct bytesink
+{
+	virtual ~bytesink() {}
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) = 0;
+	virtual BOOL flush() { return TRUE; }
+	virtual BOOL close() { return flush(); }
+
+	iostats stats;
+};
+
+/****/
+
+// blocking ReadFile/WriteFile on any handle; the handle stays with the caller
+struct handlesource : public bytesource
+{
+	explicit handlesource(HANDLE hFile)
+		: hFile(hFile)
+	{
+	}
+
+	virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		return ::ReadFile(hFile, buf, len, pdwBytes, nullptr);
+	}
+
+protected:
+	HANDLE hFile = nullptr;
+};
+
+struct handlesink : public bytesink
+{
+	explicit handlesink(HANDLE hFile)
+		: hFile(hFile)
+	{
+	}
+
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		return ::WriteFile(hFile, buf, len, pdwBytes, nullptr);
+	}
+
+protected:
+	HANDLE hFile = nullptr;
+};
+
+/****/
+
+// the shared memory ring to or from the parent process
+struct ringsource : public bytesource
+{
+	explicit ringsource(shmring& ring)
+		: ring(ring)
+	{
+	}
+
+	virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		*pdwBytes = ring.read(buf, len);
+		return TRUE;
+	}
+
+protected:
+	shmring& ring;
+};
+
+struct ringsink : public bytesink
+{
+	explicit ringsink(shmring& ring)
+		: ring(ring)
+	{
+	}
+
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		*pdwBytes = ring.write(buf, len);
+		return TRUE;
+	}
+
+protected:
+	shmring& ring;
+};
+
+/****/
+
+// shared by the overlapped source and sink: a few page aligned buffers, each
+// with its own OVERLAPPED, cycled in order so several transfers are in flight
+// while the pump works on the one at the front
+struct overlappedqueue
+{
+	static constexpr DWORD defaultBufferSize = 0x100000;
+	static constexpr DWORD defaultDepth = 4;
+
+	// takes ownership of hFile, which must have been opened with FILE_FLAG_OVERLAPPED
+	overlappedqueue(HANDLE hFile, unsigned __int64 offset, DWORD bufferSize, DWORD depth)
+		: hFile(hFile)
+		, offset(offset)
+		, bufferSize(bufferSize ? bufferSize : defaultBufferSize)
+	{
+		requests.resize(depth ? depth : defaultDepth);
+		for (auto&& r : requests) {
+			r.buffer = static_cast<BYTE*>(::VirtualAlloc(nullptr, this->bufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+			r.ov.hEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		}
+	}
+
+	~overlappedqueue()
+	{
+		::CancelIoEx(hFile, nullptr);
+		for (auto&& r : requests) {
+			if (r.pending) {
+				DWORD dwBytes = 0;
+				::GetOverlappedResult(hFile, &r.ov, &dwBytes, TRUE);
+			}
+			::CloseHandle(r.ov.hEvent);
+			::VirtualFree(r.buffer, 0, MEM_RELEASE);
+		}
+		::CloseHandle(hFile);
+	}
+
+protected:
+	struct request
+	{
+		OVERLAPPED ov = {};
+		BYTE* buffer = nullptr;
+		DWORD len = 0;
+		DWORD pos = 0;
+		DWORD err = 0;
+		bool pending = false;
+	};
+
+	void prepare(request& r)
+	{
+		HANDLE hEvent = r.ov.hEvent;
+		r.ov = {};
+		r.ov.hEvent = hEvent;
+		r.ov.Offset = static_cast<DWORD>(offset);
+		r.ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		r.err = 0;
+	}
+
+	// waits for the request; returns the bytes it moved
+	DWORD await(request& r)
+	{
+		DWORD dwBytes = 0;
+		if (r.pending) {
+			if (!::GetOverlappedResult(hFile, &r.ov, &dwBytes, TRUE)) {
+				r.err = ::GetLastError();
+			}
+			r.pending = false;
+		}
+		return dwBytes;
+	}
+
+	request& front()
+	{
+		return requests[current];
+	}
+
+	void next()
+	{
+		current = (current + 1) % requests.size();
+	}
+
+	HANDLE hFile = nullptr;
+	unsigned __int64 offset = 0;
+	DWORD bufferSize = 0;
+	std::vector<request> requests;
+	size_t current = 0;
+};
+
+// reads ahead: every buffer has a read outstanding, and the pump copies out
+// of the oldest one, which is then sent for the next chunk of the file
+struct overlappedsource : public bytesource, protected overlappedqueue
+{
+	overlappedsource(HANDLE hFile, unsigned __int64 offset, DWORD bufferSize = defaultBufferSize, DWORD depth = defaultDepth)
+		: overlappedqueue(hFile, offset, bufferSize, depth)
+	{
+	}
+
+	virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		*pdwBytes = 0;
+
+		if (!started) {
+			for (auto&& r : requests) {
+				issue(r);
+			}
+			started = true;
+		}
+
+		while (len > 0) {
+			request& r = front();
+			if (r.pending) {
+				r.len = await(r);
+				if (r.err == ERROR_HANDLE_EOF) {
+					r.err = 0;
+				}
+				if (r.err || r.len < bufferSize) {
+					ended = true;
+				}
+			}
+
+			if (r.err) {
+				// hand over what we have, the error comes with the next read
+				::SetLastError(r.err);
+				return *pdwBytes ? TRUE : FALSE;
+			}
+
+			if (r.pos == r.len) {
+				if (r.len == 0) {
+					// end of the file
+					return TRUE;
+				}
+				issue(r);
+				next();
+				continue;
+			}
+
+			DWORD n = min(len, r.len - r.pos);
+			memcpy(buf, r.buffer + r.pos, n);
+			r.pos += n;
+			buf += n;
+			len -= n;
+			*pdwBytes += n;
+		}
+
+		return TRUE;
+	}
+
+protected:
+	void issue(request& r)
+	{
+		r.len = 0;
+		r.pos = 0;
+
+		if (ended) {
+			return;
+		}
+
+		prepare(r);
+		offset += bufferSize;
+
+		if (!::ReadFile(hFile, r.buffer, bufferSize, nullptr, &r.ov)) {
+			DWORD err = ::GetLastError();
+			if (err != ERROR_IO_PENDING) {
+				r.err = (err == ERROR_HANDLE_EOF) ? 0 : err;
+				ended = true;
+				return;
+			}
+		}
+		r.pending = true;
+	}
+
+	bool started = false;
+	bool ended = false;
+};
+
+// writes behind: the pump fills the front buffer, which is sent off whole
+// while the pump moves on to the next one, only waiting when all are in flight
+struct overlappedsink : public bytesink, protected overlappedqueue
+{
+	overlappedsink(HANDLE hFile, unsigned __int64 offset, DWORD bufferSize = defaultBufferSize, DWORD depth = defaultDepth)
+		: overlappedqueue(hFile, offset, bufferSize, depth)
+	{
+	}
+
+	~overlappedsink()
+	{
+		flush();
+	}
+
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		*pdwBytes = 0;
+
+		while (len > 0) {
+			request& r = front();
+			if (!complete(r)) {
+				return FALSE;
+			}
+
+			DWORD n = min(len, bufferSize - r.len);
+			memcpy(r.buffer + r.len, buf, n);
+			r.len += n;
+			buf += n;
+			len -= n;
+			*pdwBytes += n;
+
+			if (r.len == bufferSize) {
+				if (!issue(r)) {
+					return FALSE;
+				}
+				next();
+			}
+		}
+
+		return TRUE;
+	}
+
+	virtual BOOL flush() override
+	{
+		request& last = front();
+		if (!lastError && !last.pending && last.len) {
+			issue(last);
+			next();
+		}
+
+		for (auto&& r : requests) {
+			complete(r);
+		}
+
+		if (lastError) {
+			::SetLastError(lastError);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+protected:
+	bool issue(request& r)
+	{
+		prepare(r);
+		offset += r.len;
+
+		if (!::WriteFile(hFile, r.buffer, r.len, nullptr, &r.ov)) {
+			DWORD err = ::GetLastError();
+			if (err != ERROR_IO_PENDING) {
+				lastError = err;
+				::SetLastError(err);
+				return false;
+			}
+		}
+		r.pending = true;
+		return true;
+	}
+
+	// waits for the buffer's last write, after which it can be filled again
+	bool complete(request& r)
+	{
+		if (r.pending) {
+			DWORD dwBytes = await(r);
+			if (!lastError && (r.err || dwBytes != r.len)) {
+				lastError = r.err ? r.err : ERROR_WRITE_FAULT;
+			}
+			r.len = 0;
+		}
+
+		if (lastError) {
+			::SetLastError(lastError);
+			return false;
+		}
+		return true;
+	}
+
+	DWORD lastError = 0;
+};
+
+/****/
+
+// moves data straight between the caller's buffer and the disk with
+// unbuffered I/O whenever the buffer, the length and the file offset are
+// aligned, as the VDI buffers and transfers normally are. Whatever is not,
+// such as the tail of the stream, goes through the cached handle instead.
+struct directfile
+{
+	static constexpr DWORD alignment = 0x1000;
+
+	// takes ownership of hDirect, opened with FILE_FLAG_NO_BUFFERING; hCached stays with the caller
+	directfile(HANDLE hCached, HANDLE hDirect, unsigned __int64 offset)
+		: hCached(hCached)
+		, hDirect(hDirect)
+		, offset(offset)
+	{
+	}
+
+	~directfile()
+	{
+		::CloseHandle(hDirect);
+	}
+
+protected:
+	BOOL transfer(BYTE* buf, DWORD len, DWORD* pdwBytes, bool write, iostats& stats)
+	{
+		*pdwBytes = 0;
+
+		// the aligned bulk goes direct, the caller comes back for the rest
+		DWORD bulk = len - (len % alignment);
+		bool direct = bulk && 0 == (reinterpret_cast<ULONG_PTR>(buf) % alignment) && 0 == (offset % alignment);
+		if (direct) {
+			len = bulk;
+		}
+
+		OVERLAPPED ov = {};
+		ov.Offset = static_cast<DWORD>(offset);
+		ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+		HANDLE h = direct ? hDirect : hCached;
+		BOOL ret = write ? ::WriteFile(h, buf, len, pdwBytes, &ov) : ::ReadFile(h, buf, len, pdwBytes, &ov);
+		if (!ret && ::GetLastError() == ERROR_HANDLE_EOF) {
+			ret = TRUE;
+		}
+
+		offset += *pdwBytes;
+		(direct ? stats.directBytes : stats.cachedBytes) += *pdwBytes;
+
+		return ret;
+	}
+
+	HANDLE hCached = nullptr;
+	HANDLE hDirect = nullptr;
+	unsigned __int64 offset = 0;
+};
+
+struct directsource : public bytesource, protected directfile
+{
+	directsource(HANDLE hCached, HANDLE hDirect, unsigned __int64 offset)
+		: directfile(hCached, hDirect, offset)
+	{
+	}
+
+	virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		return transfer(buf, len, pdwBytes, false, stats);
+	}
+};
+
+struct directsink : public bytesink, protected directfile
+{
+	directsink(HANDLE hCached, HANDLE hDirect, unsigned __int64 offset)
+		: directfile(hCached, hDirect, offset)
+	{
+	}
+
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		return transfer(const_cast<BYTE*>(buf), len, pdwBytes, true, stats);
+	}
+};
+
+/****/
+
+// the overlapped and direct backends need a handle opened with other flags;
+// for a disk file we can get one without knowing its name, anything else
+// stays blocking
+inline HANDLE Reopen(HANDLE hFile, DWORD access, DWORD flags, unsigned __int64& offset)
+{
+	if (!hFile || FILE_TYPE_DISK != ::GetFileType(hFile)) {
+		return nullptr;
+	}
+
+	LARGE_INTEGER zero = {};
+	LARGE_INTEGER pos = {};
+	if (!::SetFilePointerEx(hFile, zero, &pos, FILE_CURRENT)) {
+		return nullptr;
+	}
+
+	HANDLE hReopened = ::ReOpenFile(hFile, access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, flags);
+	if (INVALID_HANDLE_VALUE == hReopened) {
+		return nullptr;
+	}
+
+	offset = pos.QuadPart;
+	return hReopened;
+}
+
+// io is the --io backend: "overlapped", "direct", or blocking otherwise
+inline std::unique_ptr<bytesource> MakeSource(HANDLE hFile, shmring* ring, const std::string& io)
+{
+	if (ring) {
+		return std::make_unique<ringsource>(*ring);
+	}
+
+	unsigned __int64 offset = 0;
+	if (iequals(io, "overlapped")) {
+		HANDLE hOverlapped = Reopen(hFile, GENERIC_READ, FILE_FLAG_OVERLAPPED, offset);
+		if (hOverlapped) {
+			return std::make_unique<overlappedsource>(hOverlapped, offset);
+		}
+	}
+	else if (iequals(io, "direct")) {
+		HANDLE hDirect = Reopen(hFile, GENERIC_READ, FILE_FLAG_NO_BUFFERING, offset);
+		if (hDirect) {
+			return std::make_unique<directsource>(hFile, hDirect, offset);
+		}
+	}
+
+	return std::make_unique<handlesource>(hFile);
+}
+
+inline std::unique_ptr<bytesink> MakeSink(HANDLE hFile, shmring* ring, const std::string& io)
+{
+	if (ring) {
+		return std::make_unique<ringsink>(*ring);
+	}
+
+	unsigned __int64 offset = 0;
+	if (iequals(io, "overlapped")) {
+		HANDLE hOverlapped = Reopen(hFile, GENERIC_WRITE, FILE_FLAG_OVERLAPPED, offset);
+		if (hOverlapped) {
+			return std::make_unique<overlappedsink>(hOverlapped, offset);
+		}
+	}
+	else if (iequals(io, "direct")) {
+		HANDLE hDirect = Reopen(hFile, GENERIC_WRITE, FILE_FLAG_NO_BUFFERING, offset);
+		if (hDirect) {
+			return std::make_unique<directsink>(hFile, hDirect, offset);
+		}
+	}
+
+	return std::make_unique<handlesink>(hFile);
+}
+
+/****/
+
+// a disk file opened by name at an offset, for picking a read up again
+struct filesource : public handlesource
+{
+	filesource()
+		: handlesource(nullptr)
+	{
+	}
+
+	~filesource()
+	{
+		if (hFile) {
+			::CloseHandle(hFile);
+		}
+	}
+
+	HRESULT open(const std::string& fileName, unsigned __int64 offset)
+	{
+		hFile = ::CreateFile(widen(fileName).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (INVALID_HANDLE_VALUE == hFile) {
+			hFile = nullptr;
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		LARGE_INTEGER pos;
+		pos.QuadPart = offset;
+		if (!::SetFilePointerEx(hFile, pos, nullptr, FILE_BEGIN)) {
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		return S_OK;
+	}
+};
+
+// keeps a restore going through a failed read by opening the source again
+// where the last good read ended, so the server never sees the failure and
+// nothing it already has is sent twice. position is the checkpoint; it only
+// moves once bytes have been handed on.
+struct resumablesource : public bytesource
+{
+	// opens the stream again, starting offset bytes in
+	typedef std::function<HRESULT(unsigned __int64 offset, std::unique_ptr<bytesource>& source)> opener;
+
+	resumablesource(std::unique_ptr<bytesource> source, opener reopen, DWORD retries)
+		: source(std::move(source))
+		, reopen(reopen)
+		, retries(retries)
+	{
+	}
+
+	virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		DWORD attempt = 0;
+		for (;;) {
+			*pdwBytes = 0;
+			BOOL ret = source ? source->read(buf, len, pdwBytes) : FALSE;
+			position += *pdwBytes;
+			if (source) {
+				stats.directBytes = earlier.directBytes + source->stats.directBytes;
+				stats.cachedBytes = earlier.cachedBytes + source->stats.cachedBytes;
+			}
+
+			// a short read still counts; the failure comes back on the next one
+			if (ret || *pdwBytes) {
+				return TRUE;
+			}
+
+			DWORD lastError = source ? ::GetLastError() : this->lastError;
+			if (attempt >= retries) {
+				::SetLastError(lastError);
+				return FALSE;
+			}
+			++attempt;
+
+			if (source) {
+				earlier = stats;
+				source.reset();
+				this->lastError = lastError;
+			}
+
+			::Sleep(1000 << min(attempt, 5UL));
+
+			// the opener can still tell why
+			::SetLastError(lastError);
+			HRESULT hr = reopen(position, source);
+			if (!SUCCEEDED(hr)) {
+				source.reset();
+				this->lastError = HRESULT_FACILITY(hr) == FACILITY_WIN32 ? HRESULT_CODE(hr) : ERROR_READ_FAULT;
+			}
+		}
+	}
+
+	unsigned __int64 position = 0;
+
+protected:
+	std::unique_ptr<bytesource> source;
+	opener reopen;
+	DWORD retries = 0;
+	DWORD lastError = 0;
+	iostats earlier;
+};
+
+/****/
+
+// copies a handle into a sink, or a source into a handle, until the end of
+// the stream; used to relay the elevated process' pipe to a remote store.
+// The sink is left open: the end of the pipe does not say the backup worked,
+// so the caller closes it only once the process has exited cleanly.
+inline HRESULT CopyToSink(HANDLE hInput, bytesink& sink, __int64& totalBytes)
+{
+	std::unique_ptr<BYTE[]> buf(new BYTE[overlappedqueue::defaultBufferSize]);
+
+	for (;;) {
+		DWORD dwBytesRead = 0;
+		BOOL ret = ::ReadFile(hInput, buf.get(), overlappedqueue::defaultBufferSize, &dwBytesRead, nullptr);
+		DWORD err = ret ? 0 : ::GetLastError();
+
+		DWORD dwBytesWritten = 0;
+		while (dwBytesWritten < dwBytesRead) {
+			DWORD dwBytes = 0;
+			if (!sink.write(buf.get() + dwBytesWritten, dwBytesRead - dwBytesWritten, &dwBytes) || !dwBytes) {
+				DWORD writeErr = ::GetLastError();
+				return HRESULT_FROM_WIN32(writeErr ? writeErr : ERROR_WRITE_FAULT);
+			}
+			dwBytesWritten += dwBytes;
+		}
+		totalBytes += dwBytesRead;
+
+		if (!ret || !dwBytesRead) {
+			if (err && err != ERROR_BROKEN_PIPE && err != ERROR_HANDLE_EOF) {
+				return HRESULT_FROM_WIN32(err);
+			}
+			return S_OK;
+		}
+	}
+}
+
+inline HRESULT CopyFromSource(bytesource& source, HANDLE hOutput, __int64& totalBytes)
+{
+	std::unique_ptr<BYTE[]> buf(new BYTE[overlappedqueue::defaultBufferSize]);
+
+	for (;;) {
+		DWORD dwBytesRead = 0;
+		if (!source.read(buf.get(), overlappedqueue::defaultBufferSize, &dwBytesRead)) {
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+		if (!dwBytesRead) {
+			return S_OK;
+		}
+
+		DWORD dwBytesWritten = 0;
+		while (dwBytesWritten < dwBytesRead) {
+			DWORD dwBytes = 0;
+			if (!::WriteFile(hOutput, buf.get() + dwBytesWritten, dwBytesRead - dwBytesWritten, &dwBytes, nullptr) || !dwBytes) {
+				DWORD err = ::GetLastError();
+				// the elevated process stops reading once the restore has what it needs
+				return (err == ERROR_BROKEN_PIPE || err == ERROR_NO_DATA) ? S_OK : HRESULT_FROM_WIN32(err ? err : ERROR_WRITE_FAULT);
+			}
+			dwBytesWritten += dwBytes;
+		}
+		totalBytes += dwBytesRead;
+	}
+}
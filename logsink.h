@@ -0,0 +1,224 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+
+struct logsink;
+
+// collects one preformatted record and hands it to the sink when destroyed
+struct logline
+{
+	explicit logline(logsink& sink)
+		: sink(&sink)
+	{
+	}
+
+	logline(logline&& other)
+		: sink(other.sink)
+		, o(std::move(other.o))
+	{
+		other.sink = nullptr;
+	}
+
+	~logline();
+
+	template<typename T>
+	logline& operator<<(T&& value)
+	{
+		o << std::forward<T>(value);
+		return *this;
+	}
+
+	logline& operator<<(std::ostream& (*manip)(std::ostream&))
+	{
+		o << manip;
+		return *this;
+	}
+
+protected:
+	logsink* sink = nullptr;
+	std::ostringstream o;
+};
+
+// multi producer, single consumer log queue. Producing threads only push
+// finished records, without taking a lock; a background thread writes them
+// to nowide::cerr and flushes once per batch.
+struct logsink
+{
+	logsink()
+		: head(&stub)
+		, tail(&stub)
+	{
+		writer = std::thread([this] { writeLoop(); });
+	}
+
+	~logsink()
+	{
+		stop();
+	}
+
+	logline line()
+	{
+		return logline(*this);
+	}
+
+	void push(std::string text)
+	{
+		if (text.empty()) {
+			return;
+		}
+
+		record* r = new record;
+		r->text = std::move(text);
+
+		record* prev = head.exchange(r);
+		prev->next.store(r, std::memory_order_release);
+
+		pushed.fetch_add(1);
+
+		if (sleeping.load()) {
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeCv.notify_one();
+		}
+	}
+
+	// waits until everything pushed so far has been written
+	void flush()
+	{
+		unsigned __int64 ticket = pushed.load();
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeCv.notify_one();
+			flushedCv.wait(lock, [this, ticket] { return written >= ticket || !running; });
+		}
+	}
+
+	void stop()
+	{
+		if (!writer.joinable()) {
+			return;
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+			wakeCv.notify_one();
+		}
+
+		writer.join();
+	}
+
+protected:
+	struct record
+	{
+		std::atomic<record*> next{ nullptr };
+		std::string text;
+	};
+
+	bool pending() const
+	{
+		return tail != &stub || stub.next.load(std::memory_order_acquire) || head.load() != &stub;
+	}
+
+	// consumer side only; returns null when empty or while a push is half done
+	record* pop()
+	{
+		record* t = tail;
+		record* next = t->next.load(std::memory_order_acquire);
+
+		if (t == &stub) {
+			if (!next) {
+				return nullptr;
+			}
+			tail = next;
+			t = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+
+		if (next) {
+			tail = next;
+			return t;
+		}
+
+		if (t != head.load()) {
+			return nullptr;
+		}
+
+		stub.next.store(nullptr, std::memory_order_relaxed);
+		record* prev = head.exchange(&stub);
+		prev->next.store(&stub, std::memory_order_release);
+
+		next = t->next.load(std::memory_order_acquire);
+		if (next) {
+			tail = next;
+			return t;
+		}
+
+		return nullptr;
+	}
+
+	void writeLoop()
+	{
+		for (;;) {
+			unsigned __int64 count = 0;
+
+			while (record* r = pop()) {
+				nowide::cerr.write(r->text.data(), r->text.size());
+				delete r;
+				++count;
+			}
+
+			if (count) {
+				nowide::cerr.flush();
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+
+			written += count;
+			flushedCv.notify_all();
+
+			if (pending()) {
+				continue;
+			}
+
+			if (stopping) {
+				break;
+			}
+
+			sleeping = true;
+			if (!pending()) {
+				wakeCv.wait_for(lock, std::chrono::milliseconds(100));
+			}
+			sleeping = false;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		running = false;
+		flushedCv.notify_all();
+	}
+
+	std::atomic<record*> head;
+	record* tail = nullptr;
+	record stub;
+
+	std::atomic<unsigned __int64> pushed{ 0 };
+	unsigned __int64 written = 0;
+
+	std::atomic<bool> sleeping{ false };
+	bool stopping = false;
+	bool running = true;
+
+	std::mutex mutex;
+	std::condition_variable wakeCv;
+	std::condition_variable flushedCv;
+
+	std::thread writer;
+};
+
+inline logline::~logline()
+{
+	if (sink) {
+		sink->push(o.str());
+	}
+}
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <deque>
+#include <condition_variable>
+
+#include "sha256.h"
+
+// a Merkle tree over fixed size leaves of a backup file. Each leaf can be
+// checked on its own, so a file is verified by all cores at once, a range
+// of it by reading just that range, and a mismatch names the leaf that is
+// bad. The root covers the list of leaves, so the list can not be edited
+// to match a damaged file. Leaves and nodes are hashed with a different
+// first byte, so neither can pass for the other.
+struct merkle
+{
+	static constexpr DWORD defaultLeafSize = 0x400000;
+
+	static std::string leafHash(const BYTE* buf, size_t len)
+	{
+		BYTE tag = 0;
+		sha256 h;
+		h.update(&tag, 1);
+		h.update(buf, len);
+		return h.finish();
+	}
+
+	static std::string nodeHash(const std::string& left, const std::string& right)
+	{
+		BYTE tag = 1;
+		sha256 h;
+		h.update(&tag, 1);
+		h.update(left);
+		h.update(right);
+		return h.finish();
+	}
+
+	// pairs up each level until one hash is left; an odd one out goes up as it is
+	static std::string root(std::vector<std::string> level)
+	{
+		if (level.empty()) {
+			return leafHash(nullptr, 0);
+		}
+
+		while (level.size() > 1) {
+			std::vector<std::string> up;
+			up.reserve((level.size() + 1) / 2);
+			for (size_t i = 0; i + 1 < level.size(); i += 2) {
+				up.push_back(nodeHash(level[i], level[i + 1]));
+			}
+			if (level.size() % 2) {
+				up.push_back(level.back());
+			}
+			level.swap(up);
+		}
+
+		return level.front();
+	}
+};
+
+// the manifest file: a few header lines, then the hash of every leaf in hex
+//
+//   mssqlPipe manifest 1
+//   size <bytes>
+//   leafsize <bytes>
+//   root <hex>
+//   <hex>...
+struct manifest
+{
+	unsigned __int64 size = 0;
+	DWORD leafSize = merkle::defaultLeafSize;
+	std::vector<std::string> leaves;
+	std::string root;
+
+	size_t leafCount() const
+	{
+		return static_cast<size_t>((size + leafSize - 1) / leafSize);
+	}
+
+	bool save(const std::string& fileName) const
+	{
+		std::ofstream out(widen(fileName), std::ios::out | std::ios::trunc);
+		out << "mssqlPipe manifest 1\n";
+		out << "size " << size << "\n";
+		out << "leafsize " << leafSize << "\n";
+		out << "root " << sha256::hex(root) << "\n";
+		for (auto&& leaf : leaves) {
+			out << sha256::hex(leaf) << "\n";
+		}
+		out.close();
+		return !out.fail();
+	}
+
+	// false when the file is missing or malformed, or its leaves do not add up to its root
+	bool load(const std::string& fileName)
+	{
+		std::ifstream in(widen(fileName));
+		std::string line;
+		if (!std::getline(in, line) || line != "mssqlPipe manifest 1") {
+			return false;
+		}
+
+		std::string key;
+		std::string rootHex;
+		if (!(in >> key >> size) || key != "size" || !(in >> key >> leafSize) || key != "leafsize" || !leafSize || !(in >> key >> rootHex) || key != "root" || !unhex(rootHex, root)) {
+			return false;
+		}
+
+		leaves.clear();
+		while (in >> line) {
+			std::string leaf;
+			if (!unhex(line, leaf)) {
+				return false;
+			}
+			leaves.push_back(leaf);
+		}
+
+		return leaves.size() == leafCount() && merkle::root(leaves) == root;
+	}
+
+	static bool unhex(const std::string& hex, std::string& digest)
+	{
+		if (hex.size() != sha256::digestSize * 2) {
+			return false;
+		}
+
+		digest.assign(sha256::digestSize, '\0');
+		for (size_t i = 0; i < hex.size(); ++i) {
+			char c = hex[i];
+			int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+			if (v < 0) {
+				return false;
+			}
+			digest[i / 2] = static_cast<char>((digest[i / 2] << 4) | v);
+		}
+		return true;
+	}
+};
+
+// writes through to its sink and hashes what was written, a leaf per
+// thread, so hashing keeps up with the fastest device; memory stays at a
+// few leaves. close writes the manifest once the sink has closed cleanly.
+struct manifestsink : public bytesink
+{
+	manifestsink(std::unique_ptr<bytesink> sink, const std::string& fileName, DWORD leafSize = merkle::defaultLeafSize)
+		: sink(std::move(sink))
+		, fileName(fileName)
+	{
+		m.leafSize = leafSize;
+
+		size_t threads = max(1u, min(std::thread::hardware_concurrency(), 8u));
+		leafBuffers.resize(threads + 2);
+		for (auto&& b : leafBuffers) {
+			b.data.reset(new BYTE[leafSize]);
+			freeList.push_back(&b);
+		}
+
+		for (size_t i = 0; i < threads; ++i) {
+			hashers.emplace_back([this] { hashLoop(); });
+		}
+	}
+
+	~manifestsink()
+	{
+		stop();
+	}
+
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		BOOL ret = sink->write(buf, len, pdwBytes);
+		stats = sink->stats;
+
+		DWORD n = *pdwBytes;
+		while (n > 0) {
+			if (!current) {
+				current = takeFree();
+			}
+
+			DWORD part = min(n, m.leafSize - current->len);
+			memcpy(current->data.get() + current->len, buf, part);
+			current->len += part;
+			buf += part;
+			n -= part;
+
+			if (current->len == m.leafSize) {
+				submit();
+			}
+		}
+
+		return ret;
+	}
+
+	virtual BOOL flush() override
+	{
+		BOOL ret = sink->flush();
+		stats = sink->stats;
+		return ret;
+	}
+
+	virtual BOOL close() override
+	{
+		BOOL ret = sink->close();
+		stats = sink->stats;
+
+		if (current && current->len) {
+			submit();
+		}
+		stop();
+
+		if (!ret) {
+			return FALSE;
+		}
+
+		m.root = merkle::root(m.leaves);
+		if (!m.save(fileName)) {
+			::SetLastError(ERROR_WRITE_FAULT);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+protected:
+	struct leafbuffer
+	{
+		std::unique_ptr<BYTE[]> data;
+		DWORD len = 0;
+		size_t index = 0;
+	};
+
+	leafbuffer* takeFree()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] { return !freeList.empty(); });
+		leafbuffer* b = freeList.front();
+		freeList.pop_front();
+		b->len = 0;
+		return b;
+	}
+
+	void submit()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			current->index = m.leaves.size();
+			m.leaves.emplace_back();
+			m.size += current->len;
+			fullList.push_back(current);
+		}
+		cv.notify_all();
+
+		current = nullptr;
+	}
+
+	void hashLoop()
+	{
+		for (;;) {
+			leafbuffer* b = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this] { return !fullList.empty() || stopping; });
+				if (fullList.empty()) {
+					return;
+				}
+				b = fullList.front();
+				fullList.pop_front();
+			}
+
+			std::string hash = merkle::leafHash(b->data.get(), b->len);
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				m.leaves[b->index] = hash;
+				freeList.push_back(b);
+			}
+			cv.notify_all();
+		}
+	}
+
+	// the hashers finish every full leaf before they go
+	void stop()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cv.notify_all();
+
+		for (auto&& t : hashers) {
+			if (t.joinable()) {
+				t.join();
+			}
+		}
+		hashers.clear();
+	}
+
+	std::unique_ptr<bytesink> sink;
+	std::string fileName;
+	manifest m;
+
+	std::vector<leafbuffer> leafBuffers;
+	leafbuffer* current = nullptr;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<leafbuffer*> freeList;
+	std::deque<leafbuffer*> fullList;
+	std::vector<std::thread> hashers;
+	bool stopping = false;
+};
@@ -4,7 +4,22 @@
 #include "util.h"
 #include "params.h"
 
+#include "logsink.h"
 #include "pipestat.h"
+#include "relay.h"
+#include "shmring.h"
+#include "iobackend.h"
+#include "s3.h"
+#include "simvdi.h"
+#include "vditrace.h"
+#include "ratelimit.h"
+#include "instancecache.h"
+#include "autotune.h"
+#include "compress.h"
+#include "delta.h"
+#include "manifest.h"
+#include "pagecheck.h"
+#include "analyze.h"
 
 /****/
 
@@ -12,7 +27,7 @@ constexpr auto mssqlPipe_Version = "1.2.1";
 
 /****/
 
-std::mutex outputMutex_;
+logsink outputLog_;
 
 /****/
 
@@ -23,8 +38,13 @@ _COM_SMARTPTR_TYPEDEF(IClientVirtualDevice, __uuidof(IClientVirtualDevice));
 
 struct InputFile
 {
-	InputFile(HANDLE hFile, size_t buflen)
-		: hFile(hFile)
+	InputFile(HANDLE hFile, size_t buflen, shmring* ring = nullptr)
+		: InputFile(MakeSource(hFile, ring, std::string()), buflen)
+	{
+	}
+
+	InputFile(std::unique_ptr<bytesource> source, size_t buflen)
+		: source(std::move(source))
 		, membufReserved(buflen)
 	{
 		if (membufReserved) {			
@@ -42,7 +62,7 @@ struct InputFile
 
 		while (bytesRead < membufReserved) {
 			DWORD dwBytes = 0;
-			BOOL ret = ::ReadFile(hFile, membuf.get() + bytesRead, membufReserved - bytesRead, &dwBytes, nullptr);
+			BOOL ret = readFile(membuf.get() + bytesRead, membufReserved - bytesRead, &dwBytes);
 			bytesRead += dwBytes;
 			if (!ret || (dwBytes == 0)) {
 				break;
@@ -90,7 +110,7 @@ struct InputFile
 		
 		while (len > 0) {
 			DWORD dwBytes = 0;
-			BOOL ret = ::ReadFile(hFile, buf, len, &dwBytes, nullptr);
+			BOOL ret = readFile(buf, len, &dwBytes);
 			streamPos += dwBytes;
 			totalRead += dwBytes;
 			len -= dwBytes;
@@ -103,8 +123,18 @@ struct InputFile
 		return totalRead;
 	}
 
+	const iostats& stats() const
+	{
+		return source->stats;
+	}
+
 protected:
-	HANDLE hFile = nullptr;
+	BOOL readFile(BYTE* buf, DWORD len, DWORD* pdwBytes)
+	{
+		return source->read(buf, len, pdwBytes);
+	}
+
+	std::unique_ptr<bytesource> source;
 	std::unique_ptr<BYTE[]> membuf;
 	size_t membufReserved = 0;
 	size_t membufLen = 0;
@@ -113,8 +143,13 @@ protected:
 
 struct OutputFile
 {
-	explicit OutputFile(HANDLE hFile)
-		: hFile(hFile)
+	explicit OutputFile(HANDLE hFile, shmring* ring = nullptr)
+		: OutputFile(MakeSink(hFile, ring, std::string()))
+	{
+	}
+
+	explicit OutputFile(std::unique_ptr<bytesink> sink)
+		: sink(std::move(sink))
 	{		
 	}
 
@@ -123,7 +158,7 @@ struct OutputFile
 		DWORD dwBytesWritten = 0;
 		while (dwBytesWritten < len) {
 			DWORD dwBytes = 0;
-			BOOL ret = ::WriteFile(hFile, static_cast<BYTE*>(buf) + dwBytesWritten, len - dwBytesWritten, &dwBytes, nullptr);
+			BOOL ret = sink->write(static_cast<BYTE*>(buf) + dwBytesWritten, len - dwBytesWritten, &dwBytes);
 			dwBytesWritten += dwBytes;
 			if (!ret || (dwBytes == 0)) {
 				break;
@@ -132,30 +167,83 @@ struct OutputFile
 		return dwBytesWritten;
 	}
 
-	void flush()
+	// false, with the last error set, if anything written so far failed to land
+	bool flush()
+	{
+		return !!sink->flush();
+	}
+
+	// ends a successful stream
+	bool close()
 	{
-		// not necessary with the win32 streams
-		//fflush(file);
+		return !!sink->close();
+	}
+
+	const iostats& stats() const
+	{
+		return sink->stats;
 	}
 
 protected:
-	HANDLE hFile = nullptr;
+	std::unique_ptr<bytesink> sink;
 };
 
 /****/
 
-HRESULT processPipeRestore(IClientVirtualDevice* pDevice, InputFile& file, bool quiet = false)
+void traceIoStats(const iostats& stats)
+{
+	if (stats.directBytes) {
+		auto log = outputLog_.line();
+		log << (stats.directBytes >> 20) << " MB bypassed the system cache, " << (stats.cachedBytes >> 20) << " MB went through it" << std::endl;
+	}
+	if (stats.rawBytes) {
+		auto log = outputLog_.line();
+		log << "Compressed " << (stats.rawBytes >> 20) << " MB to " << (stats.packedBytes >> 20) << " MB; frames by level:";
+		for (size_t i = 0; i < stats.levelFrames.size(); ++i) {
+			if (stats.levelFrames[i]) {
+				log << " " << compressLevels[i].name << " " << stats.levelFrames[i];
+			}
+		}
+		log << std::endl;
+	}
+	if (stats.literalBytes || stats.matchedBytes) {
+		outputLog_.line() << "Delta sent " << (stats.literalBytes >> 20) << " MB as is and " << (stats.matchedBytes >> 20) << " MB as blocks of the base" << std::endl;
+	}
+}
+
+// waits for the page check to finish; bad pages were reported as they were
+// found, and fail the run as a failed verify does
+HRESULT tracePageCheck(pagecheck& check, bool quiet)
+{
+	check.finish();
+
+	if (!quiet || check.badPages) {
+		auto log = outputLog_.line();
+		log << "Checked " << check.pagesChecked << " pages, " << check.badPages << " bad";
+		if (check.skippedBytes) {
+			log << "; " << (check.skippedBytes >> 20) << " MB went by unchecked to keep up";
+		}
+		log << std::endl;
+	}
+
+	if (check.badPages) {
+		return HRESULT_FROM_WIN32(ERROR_CRC);
+	}
+	return S_OK;
+}
+
+HRESULT processPipeRestore(IClientVirtualDevice* pDevice, InputFile& file, bool quiet = false, vditrace* trace = nullptr, pagecheck* check = nullptr)
 {
 	if (!pDevice) {
 		return E_INVALIDARG;
 	}
 
 	if (!quiet) {			
-		std::unique_lock<std::mutex> lock(outputMutex_);
-		nowide::cerr << "\nProcessing... " << std::endl;
+		auto log = outputLog_.line();
+		log << "\nProcessing... " << std::endl;
 	}
 
-	pipestat ps(outputMutex_, quiet);
+	pipestat ps(outputLog_, quiet);
 
 	static const DWORD timeout = 10 * 60 * 1000;
 	HRESULT hr = S_OK;
@@ -170,6 +258,8 @@ HRESULT processPipeRestore(IClientVirtualDevice* pDevice, InputFile& file, bool
 		In this case, the operating system calls back to a completion routine set up by the client.*/
 		hr = pDevice->GetCommand(timeout, &pCmd);
 
+		DWORDLONG gotMicros = trace ? trace->now() : 0;
+
 		if (!SUCCEEDED(hr)) {
 			switch (hr) {
 				case VD_E_CLOSE:
@@ -211,6 +301,15 @@ HRESULT processPipeRestore(IClientVirtualDevice* pDevice, InputFile& file, bool
 			break;
 		}
 
+		if (trace) {
+			trace->record(pCmd, gotMicros, completionCode, bytesTransferred);
+		}
+
+		// the buffer goes back to SQL Server on completion, so the check takes its copy first
+		if (check && bytesTransferred) {
+			check->feed(pCmd->buffer, bytesTransferred);
+		}
+
 		HRESULT hrComplete = pDevice->CompleteCommand(pCmd, completionCode, bytesTransferred, 0);
 
 		if (!hr || bytesTransferred > 0) {
@@ -226,22 +325,33 @@ HRESULT processPipeRestore(IClientVirtualDevice* pDevice, InputFile& file, bool
 	}
 
 	ps.finalize();
+
+	if (!quiet) {
+		traceIoStats(file.stats());
+	}
+
+	if (check) {
+		HRESULT hrCheck = tracePageCheck(*check, quiet);
+		if (SUCCEEDED(hr)) {
+			hr = hrCheck;
+		}
+	}
 	
 	return hr;
 }
 
-HRESULT processPipeBackup(IClientVirtualDevice* pDevice, OutputFile& file, bool quiet = false)
+HRESULT processPipeBackup(IClientVirtualDevice* pDevice, OutputFile& file, bool quiet = false, vditrace* trace = nullptr, pagecheck* check = nullptr)
 {
 	if (!pDevice) {
 		return E_INVALIDARG;
 	}
 
 	if (!quiet) {			
-		std::unique_lock<std::mutex> lock(outputMutex_);
-		nowide::cerr << "\nProcessing... " << std::endl;
+		auto log = outputLog_.line();
+		log << "\nProcessing... " << std::endl;
 	}
 
-	pipestat ps(outputMutex_, quiet);
+	pipestat ps(outputLog_, quiet);
 
 	static const DWORD timeout = 10 * 60 * 1000;
 	HRESULT hr = S_OK;
@@ -256,6 +366,8 @@ HRESULT processPipeBackup(IClientVirtualDevice* pDevice, OutputFile& file, bool
 		In this case, the operating system calls back to a completion routine set up by the client.*/
 		hr = pDevice->GetCommand(timeout, &pCmd);
 
+		DWORDLONG gotMicros = trace ? trace->now() : 0;
+
 		if (!SUCCEEDED(hr)) {
 			switch (hr) {
 				case VD_E_CLOSE:
@@ -287,7 +399,9 @@ HRESULT processPipeBackup(IClientVirtualDevice* pDevice, OutputFile& file, bool
 			}
 			break;
 		case VDC_Flush:
-			file.flush();
+			if (!file.flush()) {
+				completionCode = ::GetLastError();
+			}
 			break;
 		case VDC_ClearError:
 			break;
@@ -296,6 +410,15 @@ HRESULT processPipeBackup(IClientVirtualDevice* pDevice, OutputFile& file, bool
 			break;
 		}
 
+		if (trace) {
+			trace->record(pCmd, gotMicros, completionCode, bytesTransferred);
+		}
+
+		// the buffer goes back to SQL Server on completion, so the check takes its copy first
+		if (check && bytesTransferred) {
+			check->feed(pCmd->buffer, bytesTransferred);
+		}
+
 		HRESULT hrComplete = pDevice->CompleteCommand(pCmd, completionCode, bytesTransferred, 0);
 		
 		if (!hr || bytesTransferred > 0) {
@@ -310,11 +433,247 @@ HRESULT processPipeBackup(IClientVirtualDevice* pDevice, OutputFile& file, bool
 		}
 	}
 
+	// a buffering sink may still hold the tail of the stream, and an upload has to be completed
+	if (SUCCEEDED(hr) && !file.close()) {
+		hr = HRESULT_FROM_WIN32(::GetLastError());
+	}
+
 	ps.finalize();
+
+	if (!quiet) {
+		traceIoStats(file.stats());
+	}
+
+	if (check) {
+		HRESULT hrCheck = tracePageCheck(*check, quiet);
+		if (SUCCEEDED(hr)) {
+			hr = hrCheck;
+		}
+	}
 	
 	return hr;
 }
 
+// the recorder for --record-trace, or null when not recording
+vditrace* StartTrace(const params& p, vditrace& trace)
+{
+	if (p.flags.recordTrace.empty()) {
+		return nullptr;
+	}
+
+	HRESULT hr = trace.create(p.flags.recordTrace);
+	if (!SUCCEEDED(hr)) {
+		auto log = outputLog_.line();
+		log << "Could not create trace " << p.flags.recordTrace << " (0x" << std::hex << hr << std::dec << ")" << std::endl;
+		return nullptr;
+	}
+
+	return &trace;
+}
+
+// the page checker for --pagecheck, or null when not checking
+pagecheck* StartPageCheck(const params& p, std::unique_ptr<pagecheck>& check)
+{
+	if (!p.flags.pageCheck) {
+		return nullptr;
+	}
+
+	std::string database = p.database;
+	check = std::make_unique<pagecheck>([database](const sqlpageheader& h, unsigned __int64 offset, const char* problem) {
+		outputLog_.line() << "Bad page (" << h.fileId << ":" << h.pageId << ")" << (database.empty() ? "" : " in ") << database << " at byte " << offset << " of the backup: " << problem << std::endl;
+	});
+	return check.get();
+}
+
+bool IsRemote(const std::string& name)
+{
+	return s3location::isS3(name) || httpurl::isHttp(name);
+}
+
+// opens from again, offset bytes in, when a read from it failed
+HRESULT ReopenSource(const params& p, unsigned __int64 offset, std::unique_ptr<bytesource>& source)
+{
+	if (httpurl::isHttp(p.from)) {
+		return httpsource::open(p.from, p.flags.connections, source, offset);
+	}
+
+	if (s3location::isS3(p.from)) {
+		s3location location;
+		if (!location.parse(p.from)) {
+			return E_INVALIDARG;
+		}
+		return s3source::open(location, p.flags.connections, source, offset);
+	}
+
+	auto file = std::make_unique<filesource>();
+	HRESULT hr = file->open(p.from, offset);
+	if (SUCCEEDED(hr)) {
+		source = std::move(file);
+	}
+	return hr;
+}
+
+// the source for a restore: an object store or web server when from names one, otherwise the opened file or ring
+std::unique_ptr<bytesource> OpenByteSource(const params& p, HANDLE hFile, shmring* ring)
+{
+	std::unique_ptr<bytesource> source;
+
+	if (!IsRemote(p.from)) {
+		source = MakeSource(hFile, ring, p.flags.io);
+
+		// a pipe can not be read again; only a named disk file can. A handed off
+		// handle may be a disk file, but from then names the pipe it came over.
+		if (ring || p.from.empty() || !p.flags.handoff.empty() || 0 == p.from.find(R"(\\.\pipe\)") || FILE_TYPE_DISK != ::GetFileType(hFile)) {
+			return source;
+		}
+	}
+	else {
+		HRESULT hr = S_OK;
+		if (httpurl::isHttp(p.from)) {
+			hr = httpsource::open(p.from, p.flags.connections, source);
+		}
+		else {
+			s3location location;
+			if (!location.parse(p.from)) {
+				outputLog_.line() << "Invalid s3 location or missing AWS_ACCESS_KEY_ID/AWS_SECRET_ACCESS_KEY: " << p.from << std::endl;
+				return nullptr;
+			}
+
+			hr = s3source::open(location, p.flags.connections, source);
+		}
+		if (!SUCCEEDED(hr)) {
+			outputLog_.line() << std::hex << hr << std::dec << ": Failed to open " << p.from << std::endl;
+			return nullptr;
+		}
+	}
+
+	if (!p.flags.retries) {
+		return source;
+	}
+
+	return std::make_unique<resumablesource>(std::move(source), [p](unsigned __int64 offset, std::unique_ptr<bytesource>& source) {
+		DWORD lastError = ::GetLastError();
+		outputLog_.line() << lastError << ": Read failed, resuming " << p.from << " at " << (offset >> 20) << " MB" << std::endl;
+
+		HRESULT hr = ReopenSource(p, offset, source);
+		if (!SUCCEEDED(hr)) {
+			outputLog_.line() << std::hex << hr << std::dec << ": Failed to reopen " << p.from << std::endl;
+		}
+		return hr;
+	}, p.flags.retries);
+}
+
+// what a restore reads, expanded on the way when it was written with --compress
+std::unique_ptr<bytesource> OpenSource(const params& p, HANDLE hFile, shmring* ring)
+{
+	auto source = OpenByteSource(p, hFile, ring);
+	if (!source) {
+		return nullptr;
+	}
+
+	source = std::make_unique<decompresssource>(std::move(source));
+	if (p.base.empty()) {
+		return source;
+	}
+
+	HANDLE hBase = ::CreateFile(widen(p.base).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (INVALID_HANDLE_VALUE == hBase) {
+		outputLog_.line() << ::GetLastError() << ": Failed to open base " << p.base << std::endl;
+		return nullptr;
+	}
+
+	return std::make_unique<deltasource>(std::move(source), hBase);
+}
+
+// the sink for a backup: an object store when to names one, otherwise the opened file or ring
+std::unique_ptr<bytesink> OpenSink(const params& p, HANDLE hFile, shmring* ring)
+{
+	if (!IsRemote(p.to)) {
+		return MakeSink(hFile, ring, p.flags.io);
+	}
+
+	if (httpurl::isHttp(p.to)) {
+		outputLog_.line() << "Backing up to an http url is not supported, use s3:// instead: " << p.to << std::endl;
+		return nullptr;
+	}
+
+	s3location location;
+	if (!location.parse(p.to)) {
+		outputLog_.line() << "Invalid s3 location or missing AWS_ACCESS_KEY_ID/AWS_SECRET_ACCESS_KEY: " << p.to << std::endl;
+		return nullptr;
+	}
+
+	auto sink = std::make_unique<s3sink>(location, p.flags.connections, p.flags.partSize);
+	HRESULT hr = sink->begin();
+	if (!SUCCEEDED(hr)) {
+		outputLog_.line() << std::hex << hr << std::dec << ": Failed to start upload to " << p.to << std::endl;
+		return nullptr;
+	}
+
+	return std::move(sink);
+}
+
+// with --compress, a backup is compressed on its way to the sink; auto picks
+// the level frame by frame, a level name fixes it
+std::unique_ptr<bytesink> CompressSink(const params& p, std::unique_ptr<bytesink> sink)
+{
+	if (p.flags.compress.empty() || !sink) {
+		return sink;
+	}
+
+	size_t level = 1;
+	bool adaptive = iequals(p.flags.compress, "auto");
+	if (!adaptive && !compressLevelFromName(p.flags.compress, level)) {
+		outputLog_.line() << "Unknown compression " << p.flags.compress << ", use auto, stored, xpress, xpress_huff, mszip or lzms" << std::endl;
+		return nullptr;
+	}
+
+	if (!compressapi::get().available()) {
+		outputLog_.line() << "--compress needs the Compression API of Windows 8 or later" << std::endl;
+		return nullptr;
+	}
+
+	return std::make_unique<compresssink>(std::move(sink), level, adaptive);
+}
+
+// with manifest, the bytes that reach the file are hashed into a Merkle tree on the way
+std::unique_ptr<bytesink> ManifestSink(const params& p, std::unique_ptr<bytesink> sink)
+{
+	if (p.manifest.empty() || !sink) {
+		return sink;
+	}
+
+	return std::make_unique<manifestsink>(std::move(sink), p.manifest);
+}
+
+// with base, a backup goes out as its difference from that earlier backup,
+// which is indexed up front; the delta is then compressed like any backup
+std::unique_ptr<bytesink> DeltaSink(const params& p, std::unique_ptr<bytesink> sink)
+{
+	if (p.base.empty() || !sink) {
+		return sink;
+	}
+
+	HANDLE hBase = ::CreateFile(widen(p.base).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (INVALID_HANDLE_VALUE == hBase) {
+		outputLog_.line() << ::GetLastError() << ": Failed to open base " << p.base << std::endl;
+		return nullptr;
+	}
+
+	outputLog_.line() << "Indexing base " << p.base << std::endl;
+
+	auto delta = std::make_unique<deltasink>(std::move(sink));
+	HRESULT hr = delta->index(hBase);
+	::CloseHandle(hBase);
+	if (!SUCCEEDED(hr)) {
+		outputLog_.line() << std::hex << hr << std::dec << ": Failed to index base " << p.base << std::endl;
+		return nullptr;
+	}
+
+	outputLog_.line() << "Indexed " << delta->blockCount() << " blocks of " << (delta::blockSize >> 10) << " KB" << std::endl;
+	return std::move(delta);
+}
+
 /****/
 
 struct VirtualDevice
@@ -363,8 +722,8 @@ struct VirtualDevice
 	
 		hr = pSet.CreateInstance(CLSID_MSSQL_ClientVirtualDeviceSet);
 		if (!SUCCEEDED(hr)) {
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			nowide::cerr << "Failed to cocreate device set: " << std::hex << hr << std::dec << std::endl;
+			auto log = outputLog_.line();
+			log << "Failed to cocreate device set: " << std::hex << hr << std::dec << std::endl;
 			return hr;
 		}
 
@@ -372,8 +731,8 @@ struct VirtualDevice
 
 		hr = pSet->CreateEx(wInstance, name.c_str(), &config);
 		if (!SUCCEEDED(hr)) {
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			nowide::cerr << "Failed to create device set: " << std::hex << hr << std::dec << std::endl;
+			auto log = outputLog_.line();
+			log << "Failed to create device set: " << std::hex << hr << std::dec << std::endl;
 			return hr;
 		}
 		else {			
@@ -389,16 +748,16 @@ struct VirtualDevice
 		hr = pSet->GetConfiguration(dwTimeout, &config);
 		if (!SUCCEEDED(hr)) {
 			pSet->Close();
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			nowide::cerr << "Failed to initialize backup operation: " << std::hex << hr << std::dec << std::endl;
+			auto log = outputLog_.line();
+			log << "Failed to initialize backup operation: " << std::hex << hr << std::dec << std::endl;
 			return hr;
 		}
 
 		hr = pSet->OpenDevice(name.c_str(), &pDevice);
 		if (!SUCCEEDED(hr)) {
 			pSet->Close();
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			nowide::cerr << "Failed to open backup device: " << std::hex << hr << std::dec << std::endl;
+			auto log = outputLog_.line();
+			log << "Failed to open backup device: " << std::hex << hr << std::dec << std::endl;
 			return hr;
 		}
 
@@ -406,6 +765,37 @@ struct VirtualDevice
 	}
 };
 
+// the with clauses for tuning options, each followed by a comma
+std::string TuningClauses(const tuning& tune)
+{
+	std::ostringstream o;
+	if (!tune.compression.empty()) {
+		o << tune.compression << ", ";
+	}
+	if (tune.bufferCount) {
+		o << "buffercount = " << tune.bufferCount << ", ";
+	}
+	if (tune.maxTransferSize) {
+		o << "maxtransfersize = " << tune.maxTransferSize << ", ";
+	}
+	if (tune.blockSize) {
+		o << "blocksize = " << tune.blockSize << ", ";
+	}
+	return o.str();
+}
+
+// SQL Server settles the transfer geometry itself and reports it through the
+// device configuration; say so when that is not what was asked for
+void CheckGeometry(const VDConfig& config, const tuning& tune)
+{
+	if (tune.maxTransferSize && config.maxTransferSize && tune.maxTransferSize != config.maxTransferSize) {
+		outputLog_.line() << "Warning: asked for maxtransfersize " << format_size(tune.maxTransferSize) << ", the device got " << format_size(config.maxTransferSize) << std::endl;
+	}
+	if (tune.blockSize && config.blockSize && tune.blockSize != config.blockSize) {
+		outputLog_.line() << "Warning: asked for blocksize " << format_size(tune.blockSize) << ", the device got " << format_size(config.blockSize) << std::endl;
+	}
+}
+
 /****/
 
 std::string EscapeConnectionStringValue(const std::string& val)
@@ -513,10 +903,10 @@ ADODB::_ConnectionPtr Connect(std::string connectionString)
 		return pCon;
 	}
 	catch (_com_error& e) {
-		std::unique_lock<std::mutex> lock(outputMutex_);
-		nowide::cerr << "Could not connect to " << connectionString << std::endl;
-		nowide::cerr << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
-		nowide::cerr << e.Description() << std::endl;
+		auto log = outputLog_.line();
+		log << "Could not connect to " << connectionString << std::endl;
+		log << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
+		log << e.Description() << std::endl;
 
 		return nullptr;
 	}
@@ -535,13 +925,12 @@ void traceAdoErrors(ADODB::_Connection* pCon)
 	}
 
 	{
-		std::unique_lock<std::mutex> lock(outputMutex_);
 		for (long i = 0; i < count; ++i) {
 			auto error = errors->Item[i];
 			if (!error) {
 				continue;
 			}
-			nowide::cerr
+			outputLog_.line()
 				<< error->Description
 				<< "\t" << std::hex << error->Number << std::dec
 				<< "\t" << error->NativeError
@@ -573,23 +962,26 @@ void traceAdoRecordset(ADODB::_Recordset* pRs)
 	}
 	long count = fields->Count;
 
-	std::unique_lock<std::mutex> lock(outputMutex_);
-	for (long x = 0; x < count; ++x) {
-		auto field = fields->Item[x];
-		if (!field) {
-			continue;
-		}
-		auto name = field->Name;
-		if (!name.length()) {
-			nowide::cerr << "\t[" << x << "]";
-		}
-		else {
-			nowide::cerr << "\t[" << field->Name << "]";
+	{
+		auto log = outputLog_.line();
+		for (long x = 0; x < count; ++x) {
+			auto field = fields->Item[x];
+			if (!field) {
+				continue;
+			}
+			auto name = field->Name;
+			if (!name.length()) {
+				log << "\t[" << x << "]";
+			}
+			else {
+				log << "\t[" << field->Name << "]";
+			}
 		}
+		log << std::endl;
 	}
-	nowide::cerr << std::endl;
 
 	while (!pRs->eof) {
+		auto log = outputLog_.line();
 		for (long x = 0; x < count; ++x) {
 			_variant_t var = pRs->Collect[x];
 			HRESULT hrChange = 0;
@@ -601,35 +993,137 @@ void traceAdoRecordset(ADODB::_Recordset* pRs)
 			}
 
 			if (SUCCEEDED(hrChange) && var.vt == VT_BSTR) {
-				nowide::cerr << "\t" << var.bstrVal;
+				log << "\t" << var.bstrVal;
 			}
 			else if (var.vt == VT_NULL) {
-				nowide::cerr << "\t";
+				log << "\t";
 			}
 			else {
-				nowide::cerr << "\t?";
+				log << "\t?";
 			}
 		}
-		nowide::cerr << std::endl;
+		log << std::endl;
 		pRs->MoveNext();
 	}
 }
 
 /****/
 
+// one connection shared by the phases of an operation, so a restore logs
+// in once instead of three times, and how long each phase took
+struct SqlSession
+{
+	explicit SqlSession(const params& p)
+		: connectionString(MakeConnectionString(p.instance, p.username, p.password))
+	{
+	}
+
+	~SqlSession()
+	{
+		reset();
+	}
+
+	SqlSession(const SqlSession&) = delete;
+	SqlSession& operator=(const SqlSession&) = delete;
+
+	// times whatever happens between construction and destruction
+	struct phase
+	{
+		phase(SqlSession& session, const char* name)
+			: session(session)
+			, name(name)
+			, ticksBegin(::GetTickCount())
+		{
+		}
+
+		~phase()
+		{
+			session.record(name, ::GetTickCount() - ticksBegin);
+		}
+
+		SqlSession& session;
+		const char* name;
+		DWORD ticksBegin;
+	};
+
+	// connects on first use; null if that failed
+	ADODB::_ConnectionPtr connection()
+	{
+		if (!pCon) {
+			phase timer(*this, "connect");
+			pCon = Connect(connectionString);
+		}
+		return pCon;
+	}
+
+	// drops a connection that a failed phase may have left mid command
+	void reset()
+	{
+		if (pCon) {
+			try {
+				pCon->Close();
+			}
+			catch (_com_error&) {
+			}
+			pCon = nullptr;
+		}
+	}
+
+	void record(const char* name, DWORD ticks)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (auto&& t : timings) {
+			if (t.first == name) {
+				t.second += ticks;
+				return;
+			}
+		}
+		timings.emplace_back(name, ticks);
+	}
+
+	// folds another session's timings into this one, for a batch total
+	void add(SqlSession& other)
+	{
+		std::unique_lock<std::mutex> lock(other.mutex);
+		for (auto&& t : other.timings) {
+			record(t.first.c_str(), t.second);
+		}
+	}
+
+	void traceTimings()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (timings.empty()) {
+			return;
+		}
+
+		auto log = outputLog_.line();
+		log << "Phases:";
+		for (auto&& t : timings) {
+			log << " " << t.first << " " << std::fixed << std::setprecision(2) << t.second / 1000.0 << "s;";
+		}
+		log << std::endl;
+	}
+
+protected:
+	std::string connectionString;
+	ADODB::_ConnectionPtr pCon;
+	std::mutex mutex;
+	std::vector<std::pair<std::string, DWORD>> timings;
+};
+
 struct DbFile
 {
 	std::string logicalName;
 	std::string physicalName;
 	std::string type;
+	unsigned __int64 size = 0;
 };
 
-HRESULT RunPrepareRestoreDatabase(VirtualDevice& vd, params p, InputFile& inputFile, std::string& dataPath, std::string& logPath, std::vector<DbFile>& fileList, bool quiet)
+HRESULT RunPrepareRestoreDatabase(VirtualDevice& vd, params p, InputFile& inputFile, instanceinfo& info, std::vector<DbFile>& fileList, bool quiet, SqlSession& session)
 {
 	HRESULT hr = 0;
 
-	std::string connectionString = MakeConnectionString(p.instance, p.username, p.password);
-
 	std::string sql;
 	{
 		std::ostringstream o;
@@ -644,54 +1138,25 @@ HRESULT RunPrepareRestoreDatabase(VirtualDevice& vd, params p, InputFile& inputF
 		return processPipeRestore(vd.pDevice, inputFile, quiet);
 	});
 
-	auto adoResult = std::async([&connectionString, &sql, &fileList]{
+	instancecache cache(p.flags.cacheTtl);
+	bool cached = cache.load(p.instance, info);
+
+	// the instance info goes first on the same session, unless it was cached;
+	// it is quick, and the device waits for the filelistonly that follows
+	auto adoResult = std::async([&session, &sql, &fileList, &info, &cache, &p, cached]{
 		CoInit comInit;
 		
 		try {
-			ADODB::_ConnectionPtr pCon = Connect(connectionString);
+			ADODB::_ConnectionPtr pCon = session.connection();
 			if (!pCon) {
 				return E_FAIL;
 			}
 
-			ADODB::_RecordsetPtr pRs(__uuidof(ADODB::Recordset));
-			pRs->CursorLocation = ADODB::adUseServer;
-			pRs->Open(sql.c_str(), (IDispatch*)pCon, ADODB::adOpenForwardOnly, ADODB::adLockReadOnly, ADODB::adCmdText);
-
-			traceAdoErrors(pCon);
-
-			for (; pRs && !pRs->eof; pRs->MoveNext()) {
-				DbFile f;
-				f.logicalName = narrow(pRs->Fields->Item["LogicalName"]->Value.bstrVal);
-				f.physicalName = narrow(pRs->Fields->Item["PhysicalName"]->Value.bstrVal);
-				f.type = narrow(pRs->Fields->Item["Type"]->Value.bstrVal);
+			if (!cached) {
+				SqlSession::phase timer(session, "instance info");
 
-				fileList.push_back(f);
-			}
-			traceAdoErrors(pCon);
-
-			pCon->Close();
-
-			return S_OK;
-		}
-		catch (_com_error& e) {			
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			nowide::cerr << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
-			nowide::cerr << e.Description() << std::endl;
-			return e.Error();
-		}
-	});
-	
-	auto adoPathsResult = std::async([&connectionString, &dataPath, &logPath]{
-		CoInit comInit;
-		
-		try {
-			ADODB::_ConnectionPtr pCon = Connect(connectionString);
-			if (!pCon) {
-				return E_FAIL;
-			}
-			
-			// InstanceDefaultDataPath and InstanceDefaultLogPath are SQL2012+
-			auto query = R"(
+				// InstanceDefaultDataPath and InstanceDefaultLogPath are SQL2012+
+				auto query = R"(
 ;with database_info as (
 select 
 	substring(physical_name, 1, len(physical_name) - charindex('\', reverse(physical_name))) as physical_path
@@ -713,44 +1178,78 @@ select
 		group by physical_path, is_system
 		order by is_system, count(*), physical_path
 	)) as DefaultLog
+	, convert(nvarchar(128), serverproperty('ProductVersion')) as Version
 ;
 )";
 
+				ADODB::_RecordsetPtr pRs(__uuidof(ADODB::Recordset));
+				pRs->CursorLocation = ADODB::adUseServer;
+				pRs->Open(query, (IDispatch*)pCon, ADODB::adOpenForwardOnly, ADODB::adLockReadOnly, ADODB::adCmdText);
+
+				traceAdoErrors(pCon);
+
+				if (!pRs->eof) {
+					
+					info.dataPath = narrow(pRs->Fields->Item["DefaultData"]->Value.bstrVal);
+					info.logPath = narrow(pRs->Fields->Item["DefaultLog"]->Value.bstrVal);
+					info.version = narrow(pRs->Fields->Item["Version"]->Value.bstrVal);
+
+					traceAdoErrors(pCon);
+				}
+
+				pRs->Close();
+
+				// sys.dm_os_volume_stats is SQL2008R2 SP1+ and needs VIEW SERVER STATE; without it the free space is just unknown
+				try {
+					pRs->Open("select distinct vs.volume_mount_point, vs.available_bytes from sys.master_files f cross apply sys.dm_os_volume_stats(f.database_id, f.file_id) vs;"
+						, (IDispatch*)pCon, ADODB::adOpenForwardOnly, ADODB::adLockReadOnly, ADODB::adCmdText);
+
+					for (; !pRs->eof; pRs->MoveNext()) {
+						info.volumes.emplace_back(narrow(pRs->Fields->Item["volume_mount_point"]->Value.bstrVal)
+							, static_cast<unsigned __int64>(static_cast<__int64>(pRs->Fields->Item["available_bytes"]->Value)));
+					}
+
+					pRs->Close();
+				}
+				catch (_com_error&) {
+					pCon->Errors->Clear();
+				}
+
+				cache.store(p.instance, info);
+			}
+
+			SqlSession::phase timer(session, "file list");
+
 			ADODB::_RecordsetPtr pRs(__uuidof(ADODB::Recordset));
 			pRs->CursorLocation = ADODB::adUseServer;
-			pRs->Open(query, (IDispatch*)pCon, ADODB::adOpenForwardOnly, ADODB::adLockReadOnly, ADODB::adCmdText);
+			pRs->Open(sql.c_str(), (IDispatch*)pCon, ADODB::adOpenForwardOnly, ADODB::adLockReadOnly, ADODB::adCmdText);
 
 			traceAdoErrors(pCon);
 
-			if (!pRs->eof) {
-				
-				dataPath = narrow(pRs->Fields->Item["DefaultData"]->Value.bstrVal);
-				logPath = narrow(pRs->Fields->Item["DefaultLog"]->Value.bstrVal);
+			for (; pRs && !pRs->eof; pRs->MoveNext()) {
+				DbFile f;
+				f.logicalName = narrow(pRs->Fields->Item["LogicalName"]->Value.bstrVal);
+				f.physicalName = narrow(pRs->Fields->Item["PhysicalName"]->Value.bstrVal);
+				f.type = narrow(pRs->Fields->Item["Type"]->Value.bstrVal);
+				f.size = static_cast<unsigned __int64>(static_cast<__int64>(pRs->Fields->Item["Size"]->Value));
 
-				traceAdoErrors(pCon);
+				fileList.push_back(f);
 			}
+			traceAdoErrors(pCon);
 
-			pCon->Close();
+			pRs->Close();
 
 			return S_OK;
 		}
 		catch (_com_error& e) {			
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			nowide::cerr << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
-			nowide::cerr << e.Description() << std::endl;
+			auto log = outputLog_.line();
+			log << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
+			log << e.Description() << std::endl;
+			session.reset();
 			return e.Error();
 		}
 	});
 
-	HRESULT hrAdoPaths = adoPathsResult.get();
-
-	if (!SUCCEEDED(hrAdoPaths)) {
-		if (!hr) {
-			hr = hrAdoPaths;
-		}
-		vd.Abort();
-	}
-
 	HRESULT hrAdo = adoResult.get();
 
 	if (!SUCCEEDED(hrAdo)) {
@@ -763,40 +1262,45 @@ select
 	HRESULT hrPipe = pipeResult.get();
 	if (!SUCCEEDED(hrPipe)) {
 		if (!hr) {
-			hr = hrAdo;
+			hr = hrPipe;
 		}
 	}
 
 	return hr;
 }
 
-HRESULT RunRestoreDatabase(VirtualDevice& vd, params p, std::string sql, InputFile& inputFile, bool quiet)
+HRESULT RunRestoreDatabase(VirtualDevice& vd, params p, std::string sql, InputFile& inputFile, bool quiet, SqlSession& session)
 {
 	HRESULT hr = 0;
 
-	std::string connectionString = MakeConnectionString(p.instance, p.username, p.password);
-
 	if (!quiet) {
-		std::unique_lock<std::mutex> lock(outputMutex_);
-		nowide::cerr << "Restoring via virtual device " << p.device << std::endl;
+		auto log = outputLog_.line();
+		log << "Restoring via virtual device " << p.device << std::endl;
 	}
 	
 	auto pipeResult = std::async([&vd, &inputFile, &p, quiet]{
 		CoInit comInit;
 
-		vd.Open(p.timeout);
-		return processPipeRestore(vd.pDevice, inputFile, quiet);
+		if (SUCCEEDED(vd.Open(p.timeout))) {
+			CheckGeometry(vd.config, p.tune);
+		}
+
+		vditrace trace;
+		std::unique_ptr<pagecheck> check;
+		return processPipeRestore(vd.pDevice, inputFile, quiet, StartTrace(p, trace), StartPageCheck(p, check));
 	});
 
-	auto adoResult = std::async([&connectionString, &sql]{
+	auto adoResult = std::async([&session, &sql]{
 		CoInit comInit;
 		
 		try {
-			ADODB::_ConnectionPtr pCon = Connect(connectionString);
+			ADODB::_ConnectionPtr pCon = session.connection();
 			if (!pCon) {
 				return E_FAIL;
 			}
 
+			SqlSession::phase timer(session, "restore");
+
 			ADODB::_RecordsetPtr pRs(__uuidof(ADODB::Recordset));
 			pRs->CursorLocation = ADODB::adUseServer;
 			pRs->Open(sql.c_str(), (IDispatch*)pCon, ADODB::adOpenForwardOnly, ADODB::adLockReadOnly, ADODB::adCmdText);
@@ -813,14 +1317,13 @@ HRESULT RunRestoreDatabase(VirtualDevice& vd, params p, std::string sql, InputFi
 				traceAdoErrors(pCon);
 			}
 
-			pCon->Close();
-
 			return S_OK;
 		}
 		catch (_com_error& e) {			
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			nowide::cerr << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
-			nowide::cerr << e.Description() << std::endl;
+			auto log = outputLog_.line();
+			log << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
+			log << e.Description() << std::endl;
+			session.reset();
 			return e.Error();
 		}
 	});
@@ -837,65 +1340,131 @@ HRESULT RunRestoreDatabase(VirtualDevice& vd, params p, std::string sql, InputFi
 	HRESULT hrPipe = pipeResult.get();
 	if (!SUCCEEDED(hrPipe)) {
 		if (!hr) {
-			hr = hrAdo;
+			hr = hrPipe;
 		}
 	}
 
 	return hr;
 }
 
-std::string BuildRestoreCommand(params p, std::string dataPath, std::string logPath, const std::vector<DbFile>& fileList)
+// a to list like d:/data;e:/data, each ending in a separator
+std::vector<std::string> SplitPaths(const std::string& paths)
+{
+	std::vector<std::string> result;
+	std::istringstream i(paths);
+	std::string path;
+	while (std::getline(i, path, ';')) {
+		if (path.empty()) {
+			continue;
+		}
+		if (path.back() != '\\' && path.back() != '/') {
+			path += '\\';
+		}
+		result.push_back(path);
+	}
+	return result;
+}
+
+// the full target name of each file in the backup. Data files are spread
+// over the to paths, biggest first onto whichever volume has the most room
+// left, or in turn when the free space is not known. Logs go to log to, or
+// with several data paths to the instance's log path, so they get a disk of
+// their own.
+std::vector<std::string> PlaceRestoreFiles(const params& p, const instanceinfo& info, const std::vector<DbFile>& fileList)
 {
-	if (!p.to.empty()) {
-		dataPath = p.to;
-		logPath = p.to;
+	std::vector<std::string> dataPaths = SplitPaths(p.to.empty() ? info.dataPath : p.to);
+	if (dataPaths.empty()) {
+		dataPaths.push_back(std::string());
 	}
 
-	if (!dataPath.empty() && dataPath.back() != '\\') {
-		dataPath += '\\';
+	std::string logPath = info.logPath;
+	if (!p.logTo.empty()) {
+		logPath = p.logTo;
 	}
-	if (!logPath.empty() && logPath.back() != '\\') {
+	else if (!p.to.empty() && dataPaths.size() == 1) {
+		logPath = dataPaths.front();
+	}
+	if (!logPath.empty() && logPath.back() != '\\' && logPath.back() != '/') {
 		logPath += '\\';
 	}
 
+	// room left per volume, shared by paths on the same one
+	std::map<std::string, unsigned __int64, iless_predicate> room;
+	bool roomKnown = dataPaths.size() > 1;
+	for (auto&& path : dataPaths) {
+		std::string volume = info.volumeOf(path);
+		if (volume.empty()) {
+			roomKnown = false;
+		}
+		room[volume] = info.freeBytes(path);
+	}
+
+	std::vector<size_t> order;
+	for (size_t i = 0; i < fileList.size(); ++i) {
+		order.push_back(i);
+	}
+	std::stable_sort(order.begin(), order.end(), [&fileList](size_t a, size_t b) {
+		return fileList[a].size > fileList[b].size;
+	});
+
+	std::vector<std::string> dirs(fileList.size());
+	size_t nextPath = 0;
+	for (size_t i : order) {
+		const DbFile& file = fileList[i];
+		if (!iequals(file.type, "D")) {
+			dirs[i] = logPath;
+			continue;
+		}
+
+		size_t pick = nextPath++ % dataPaths.size();
+		if (roomKnown) {
+			for (size_t candidate = 0; candidate < dataPaths.size(); ++candidate) {
+				if (room[info.volumeOf(dataPaths[candidate])] > room[info.volumeOf(dataPaths[pick])]) {
+					pick = candidate;
+				}
+			}
+			unsigned __int64& left = room[info.volumeOf(dataPaths[pick])];
+			left -= min(left, file.size);
+		}
+		dirs[i] = dataPaths[pick];
+	}
+
+	std::vector<std::string> targets;
+	std::set<std::string, iless_predicate> fileRoots;
+	for (size_t i = 0; i < fileList.size(); ++i) {
+		bool data = iequals(fileList[i].type, "D");
+
+		std::string target = dirs[i] + p.database + (data ? "_dat" : "_log");
+		size_t ordinal = 1;
+		while (fileRoots.count(target)) {
+			++ordinal;
+			std::ostringstream newTarget;
+			newTarget << target << ordinal;
+			target = newTarget.str();
+		}
+		fileRoots.insert(target);
+
+		targets.push_back(target + (data ? ".mdf" : ".ldf"));
+	}
+
+	return targets;
+}
+
+std::string BuildRestoreCommand(params p, const instanceinfo& info, const std::vector<DbFile>& fileList)
+{
 	std::ostringstream o;
-	o << "restore database [" << escape(p.database) << "] from virtual_device=N'" << escape(p.device) << "' with ";
+	o << "restore database " << bracket(p.database) << " from virtual_device=N'" << escape(p.device) << "' with ";
 	
 	if (iequals(p.subcommand, "replace")) {
 		o << "replace, ";
 	}
 
-	// build moves?
-	if (!fileList.empty()) {
-		std::set<std::string, iless_predicate> fileRoots;
-		for (auto file : fileList) {
-			std::string targetBase;
-			if (iequals(file.type, "D")) {
-				targetBase = dataPath + p.database + "_dat";
-			}
-			else {
-				targetBase = logPath + p.database + "_log";
-			}
-			
-			std::string target = targetBase;
-			size_t ordinal = 1;
-			while (fileRoots.count(target)) {
-				++ordinal;
-				std::ostringstream newTarget;
-				newTarget << target << ordinal;
-				target = newTarget.str();
-			}
-			fileRoots.insert(target);
-						
-			if (iequals(file.type, "D")) {
-				target += ".mdf";
-			}
-			else {
-				target += ".ldf";
-			}
+	o << TuningClauses(p.tune);
 
-			o << "move N'" << escape(file.logicalName) << "' to N'" << escape(target) << "', ";
-		}
+	// build moves?
+	auto targets = PlaceRestoreFiles(p, info, fileList);
+	for (size_t i = 0; i < fileList.size(); ++i) {
+		o << "move N'" << escape(fileList[i].logicalName) << "' to N'" << escape(targets[i]) << "', ";
 	}
 		
 	o << "nounload"; // noop basically, so i dont have to deal with trailing comma
@@ -905,31 +1474,36 @@ std::string BuildRestoreCommand(params p, std::string dataPath, std::string logP
 	return o.str();
 }
 
-HRESULT RunRestore(VirtualDevice& vd, params p, HANDLE hFile)
+// a heads up before a long restore that would run out of disk at the end;
+// only a warning, since the free space may be stale or the files may be replaced
+void WarnIfNoRoom(const params& p, const instanceinfo& info, const std::vector<DbFile>& fileList)
 {
-	HRESULT hr = S_OK;
-
-	InputFile inputFile(hFile, 0x10000);
-
-	if(iequals(p.subcommand, "filelistonly")) {
-		
-		std::ostringstream o;
-		o << "restore filelistonly from virtual_device=N'" << escape(p.device) << "';";
+	auto targets = PlaceRestoreFiles(p, info, fileList);
 
-		hr = RunRestoreDatabase(vd, p, o.str(), inputFile, true);
-	
-		if (!SUCCEEDED(hr)) {
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			nowide::cerr << "RunRestoreDatabase generic failed with " << std::hex << hr << std::dec << std::endl;
-			return hr;
+	std::map<std::string, unsigned __int64, iless_predicate> need;
+	for (size_t i = 0; i < fileList.size(); ++i) {
+		std::string volume = info.volumeOf(targets[i]);
+		if (!volume.empty()) {
+			need[volume] += fileList[i].size;
 		}
+	}
 
-		return hr;
+	for (auto&& v : need) {
+		unsigned __int64 free = info.freeBytes(v.first);
+		if (v.second > free) {
+			outputLog_.line() << "Warning: " << p.database << " needs " << (v.second >> 20) << " MB on " << v.first << " but only " << (free >> 20) << " MB were free" << std::endl;
+		}
 	}
+}
+
+// reads the backup's file list through a throwaway device, then rewinds
+// the input and builds the restore that moves those files into place
+HRESULT PrepareRestore(const params& p, InputFile& inputFile, std::string& sql, SqlSession& session, volumereservations* reserved = nullptr)
+{
+	HRESULT hr = S_OK;
 
 	std::vector<DbFile> fileList;
-	std::string dataPath;
-	std::string logPath;
+	instanceinfo info;
 
 	{
 		params altp = p;
@@ -941,71 +1515,140 @@ HRESULT RunRestore(VirtualDevice& vd, params p, HANDLE hFile)
 			return hr;
 		}
 
-		hr = RunPrepareRestoreDatabase(altvd, altp, inputFile, dataPath, logPath, fileList, true);
+		hr = RunPrepareRestoreDatabase(altvd, altp, inputFile, info, fileList, true, session);
 		if (!SUCCEEDED(hr)) {
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			nowide::cerr << "RunRestoreFileListOnly failed with " << std::hex << hr << std::dec << std::endl;
+			auto log = outputLog_.line();
+			log << "RunRestoreFileListOnly failed with " << std::hex << hr << std::dec << std::endl;
 			return hr;
 		}
 	}
 
 	hr = inputFile.resetPos();
 	if (!SUCCEEDED(hr)) {
-		std::unique_lock<std::mutex> lock(outputMutex_);
-		nowide::cerr << "RunRestore failed to reset buffered input pos with " << std::hex << hr << std::dec << std::endl;
+		auto log = outputLog_.line();
+		log << "RunRestore failed to reset buffered input pos with " << std::hex << hr << std::dec << std::endl;
 		return hr;
 	}
 	
-	auto sql = BuildRestoreCommand(p, dataPath, logPath, fileList);
+	// in a batch, what the earlier jobs will fill is not free for this one
+	if (reserved) {
+		reserved->apply(info);
+	}
+
+	WarnIfNoRoom(p, info, fileList);
+
+	sql = BuildRestoreCommand(p, info, fileList);
+
+	if (reserved) {
+		auto targets = PlaceRestoreFiles(p, info, fileList);
+		for (size_t i = 0; i < fileList.size(); ++i) {
+			reserved->reserve(info, targets[i], fileList[i].size);
+		}
+	}
+
+	return hr;
+}
+
+HRESULT RunRestore(VirtualDevice& vd, params p, HANDLE hFile, shmring* ring)
+{
+	HRESULT hr = S_OK;
+
+	auto source = OpenSource(p, hFile, ring);
+	if (!source) {
+		return E_FAIL;
+	}
+
+	InputFile inputFile(std::move(source), 0x10000);
+
+	SqlSession session(p);
+
+	if(iequals(p.subcommand, "filelistonly")) {
+		
+		std::ostringstream o;
+		o << "restore filelistonly from virtual_device=N'" << escape(p.device) << "';";
+
+		hr = RunRestoreDatabase(vd, p, o.str(), inputFile, true, session);
+	
+		if (!SUCCEEDED(hr)) {
+			auto log = outputLog_.line();
+			log << "RunRestoreDatabase generic failed with " << std::hex << hr << std::dec << std::endl;
+			return hr;
+		}
+
+		return hr;
+	}
+
+	std::string sql;
+	hr = PrepareRestore(p, inputFile, sql, session);
+	if (!SUCCEEDED(hr)) {
+		return hr;
+	}
 
-	hr = RunRestoreDatabase(vd, p, sql, inputFile, false);
+	hr = RunRestoreDatabase(vd, p, sql, inputFile, false, session);
 	
 	if (!SUCCEEDED(hr)) {
-		std::unique_lock<std::mutex> lock(outputMutex_);
-		nowide::cerr << "RunRestoreDatabase failed with " << std::hex << hr << std::dec << std::endl;
+		auto log = outputLog_.line();
+		log << "RunRestoreDatabase failed with " << std::hex << hr << std::dec << std::endl;
+
+		// the paths it was planned with may be what broke it
+		instancecache(p.flags.cacheTtl).invalidate(p.instance);
 		return hr;
 	}
 
+	session.traceTimings();
+
 	return hr;
 }
 
-HRESULT RunBackup(VirtualDevice& vd, params p, HANDLE hFile)
+std::string BuildBackupCommand(const params& p)
 {
-	HRESULT hr = 0;
+	std::ostringstream o;
+	// always do copy_only, could be an option in the future
+	o << "backup database " << bracket(p.database) << " to virtual_device=N'" << escape(p.device) << "' with " << TuningClauses(p.tune) << "copy_only;";
+	return o.str();
+}
 
-	std::string connectionString = MakeConnectionString(p.instance, p.username, p.password);
+HRESULT RunBackupTo(VirtualDevice& vd, params p, std::unique_ptr<bytesink> sink, bool quiet, SqlSession& session)
+{
+	HRESULT hr = 0;
 
-	std::string sql;
-	{
-		std::ostringstream o;
-		// always do copy_only, could be an option in the future
-		o << "backup database [" << escape(p.database) << "] to virtual_device=N'" << escape(p.device) << "' with copy_only;";
-		sql = o.str();
+	// what autotune picked for this database last time, unless told otherwise
+	if (!p.tune.bufferCount && !p.tune.maxTransferSize && instancecache(p.flags.cacheTtl).loadTuning(p.instance, p.database, p.tune) && !quiet) {
+		outputLog_.line() << "Using buffercount " << p.tune.bufferCount << ", maxtransfersize " << format_size(p.tune.maxTransferSize) << " from autotune" << std::endl;
 	}
 
-	{
-		std::unique_lock<std::mutex> lock(outputMutex_);
-		nowide::cerr << "Backing up via virtual device " << p.device << std::endl;
+	std::string sql = BuildBackupCommand(p);
+
+	if (!quiet) {
+		auto log = outputLog_.line();
+		log << "Backing up via virtual device " << p.device << std::endl;
 	}
 
-	OutputFile outputFile(hFile);
+	OutputFile outputFile(std::move(sink));
 
-	auto pipeResult = std::async([&vd, &outputFile, &p]{
+	auto pipeResult = std::async([&vd, &outputFile, &p, quiet]{
 		CoInit comInit;
 
-		vd.Open(p.timeout);
-		return processPipeBackup(vd.pDevice, outputFile);
+		if (SUCCEEDED(vd.Open(p.timeout))) {
+			CheckGeometry(vd.config, p.tune);
+		}
+
+		vditrace trace;
+		std::unique_ptr<pagecheck> check;
+		return processPipeBackup(vd.pDevice, outputFile, quiet, StartTrace(p, trace), StartPageCheck(p, check));
 	});
 
-	auto adoResult = std::async([&connectionString, &sql]{
+	auto adoResult = std::async([&session, &sql]{
 		CoInit comInit;
 		
 		try {
-			ADODB::_ConnectionPtr pCon = Connect(connectionString);
+			ADODB::_ConnectionPtr pCon = session.connection();
 			if (!pCon) {
 				return E_FAIL;
 			}
 
+			SqlSession::phase timer(session, "backup");
+
 			ADODB::_RecordsetPtr pRs(__uuidof(ADODB::Recordset));
 			pRs->CursorLocation = ADODB::adUseServer;
 			pRs->Open(sql.c_str(), (IDispatch*)pCon, ADODB::adOpenForwardOnly, ADODB::adLockReadOnly, ADODB::adCmdText);
@@ -1022,14 +1665,13 @@ HRESULT RunBackup(VirtualDevice& vd, params p, HANDLE hFile)
 				traceAdoErrors(pCon);
 			}
 
-			pCon->Close();
-
 			return S_OK;
 		}
 		catch (_com_error& e) {			
-			std::unique_lock<std::mutex> lock(outputMutex_);
-			nowide::cerr << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
-			nowide::cerr << e.Description() << std::endl;
+			auto log = outputLog_.line();
+			log << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
+			log << e.Description() << std::endl;
+			session.reset();
 			return e.Error();
 		}
 	});
@@ -1046,224 +1688,1469 @@ HRESULT RunBackup(VirtualDevice& vd, params p, HANDLE hFile)
 	HRESULT hrPipe = pipeResult.get();
 	if (!SUCCEEDED(hrPipe)) {
 		if (!hr) {
-			hr = hrAdo;
+			hr = hrPipe;
 		}
 	}
 
 	return hr;
 }
 
-HRESULT RunPipe(VirtualDevice& vd, params p, HANDLE hFile)
+// one short backup of p.database into a trialsink with the settings in
+// tune, aborted once the sink has seen enough. With pipeline the stream is
+// compressed on the way as --compress would, so the trial also measures
+// what the backup would store.
+HRESULT RunTrialBackup(params p, const tuning& tune, SqlSession& session, trialresult& result, bool pipeline = false)
 {
-	HRESULT hr = 0;
+	result = trialresult();
+	p.device = make_guid();
+	p.tune = tune;
+	p.flags.recordTrace.clear();
 
-	{
-		std::unique_lock<std::mutex> lock(outputMutex_);
-		nowide::cerr << "Piping " << p.subcommand << " virtual device " << p.device << std::endl;
+	VirtualDevice vd(p.instance, p.device);
+	HRESULT hr = vd.Create();
+	if (!SUCCEEDED(hr)) {
+		return hr;
 	}
 
-	// in pipe mode, use a much larger than the default timeout, say 5 minutes
-	DWORD pipeTimeout = 5 * 60 * 1000;
-
-	if (iequals(p.subcommand, "from")) {
-		OutputFile outputFile(hFile);
-
-		auto pipeResult = std::async([&vd, &outputFile, pipeTimeout]{
-			CoInit comInit;
-
-			vd.Open(pipeTimeout);
-			return processPipeBackup(vd.pDevice, outputFile);
-		});
+	auto trialSink = std::make_unique<trialsink>([&vd] { vd.Abort(); });
+	trialsink* trial = trialSink.get();
 
-		hr = pipeResult.get();
+	// counted above the compressor, whose own stats wait for a flush the abort never gives it
+	std::atomic<unsigned __int64> rawBytes(0);
+	std::unique_ptr<bytesink> sink = std::move(trialSink);
+	if (pipeline) {
+		sink = CompressSink(p, std::move(sink));
+		if (!sink) {
+			return E_FAIL;
+		}
+		sink = std::make_unique<meteredsink>(std::move(sink), rawBytes, nullptr);
 	}
-	else if (iequals(p.subcommand, "to")) {
-
-		InputFile inputFile(hFile, 0); // no buffering
 
-		auto pipeResult = std::async([&vd, &inputFile, pipeTimeout]{
-			CoInit comInit;
+	OutputFile outputFile(std::move(sink));
 
-			vd.Open(pipeTimeout);
-			return processPipeRestore(vd.pDevice, inputFile);
-		});
+	std::string sql = BuildBackupCommand(p);
 
-		hr = pipeResult.get();
-	}
+	auto pipeResult = std::async([&vd, &outputFile, &p]{
+		CoInit comInit;
 
-	return hr;
-}	
+		if (SUCCEEDED(vd.Open(p.timeout))) {
+			CheckGeometry(vd.config, p.tune);
+		}
 
-HRESULT Elevate(params p, HANDLE hInput, HANDLE hOutput, std::string namedPipe, std::string stderrPipe)
-{
-	if (!hInput && !hOutput) {
-		nowide::cerr << "Invalid command for elevation" << std::endl;
-		return E_FAIL;
-	}
-	
-	HANDLE hPipe = ::CreateNamedPipe(widen(namedPipe).c_str()
-		, (hOutput ? PIPE_ACCESS_INBOUND : PIPE_ACCESS_OUTBOUND) | FILE_FLAG_FIRST_PIPE_INSTANCE
-		, PIPE_TYPE_BYTE | PIPE_WAIT
-		, 1
-		, 0x10000
-		, 0x10000
-		, 10000
-		, nullptr
-	);
+		return processPipeBackup(vd.pDevice, outputFile, true);
+	});
 
-	HANDLE hStderrPipe = ::CreateNamedPipe(widen(stderrPipe).c_str()
-		, PIPE_ACCESS_INBOUND | FILE_FLAG_FIRST_PIPE_INSTANCE
-		, PIPE_TYPE_BYTE | PIPE_WAIT
-		, 1
-		, 0x4000
-		, 0x4000
-		, 10000
-		, nullptr
-	);
+	const char* phaseName = p.isEstimate() ? "estimate" : "autotune";
+	auto adoResult = std::async([&session, &sql, trial, phaseName]{
+		CoInit comInit;
 
-	// launch
-	HANDLE hProcess = nullptr;
-	{
-		std::wstring args = widen(MakeParams(p));
-		SHELLEXECUTEINFO sei = { sizeof(sei) };
+		try {
+			ADODB::_ConnectionPtr pCon = session.connection();
+			if (!pCon) {
+				return E_FAIL;
+			}
 
-		wchar_t thisModuleFileName[MAX_PATH];
-		::GetModuleFileName(nullptr, thisModuleFileName, _countof(thisModuleFileName));
+			SqlSession::phase timer(session, phaseName);
 
-		sei.fMask = 0 | SEE_MASK_NOCLOSEPROCESS | SEE_MASK_NOASYNC;
-		sei.hwnd = NULL;
-		sei.lpVerb = L"runas";
-		sei.lpFile = thisModuleFileName;
-		sei.lpParameters = args.c_str();
-		sei.lpDirectory = NULL;
-		sei.nShow = SW_SHOWNORMAL;
+			ADODB::_RecordsetPtr pRs(__uuidof(ADODB::Recordset));
+			pRs->CursorLocation = ADODB::adUseServer;
+			pRs->Open(sql.c_str(), (IDispatch*)pCon, ADODB::adOpenForwardOnly, ADODB::adLockReadOnly, ADODB::adCmdText);
 
-		::ShellExecuteEx(&sei);
+			while (pRs) {
+				_variant_t varAffected;
+				pRs = pRs->NextRecordset(&varAffected);
+			}
 
-		if ((int)sei.hInstApp <= 32) {
-			::CloseHandle(sei.hProcess);
-			::CloseHandle(hPipe);
-			::CloseHandle(hStderrPipe);
-			return E_FAIL;
+			return S_OK;
 		}
+		catch (_com_error& e) {
+			// the abort that ends a trial fails the backup, as it should
+			if (trial->finished) {
+				return S_OK;
+			}
 
-		hProcess = sei.hProcess;
+			auto log = outputLog_.line();
+			log << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
+			log << e.Description() << std::endl;
+			session.reset();
+			return e.Error();
+		}
+	});
+
+	HRESULT hrAdo = adoResult.get();
+	if (!SUCCEEDED(hrAdo)) {
+		hr = hrAdo;
+		vd.Abort();
+	}
+
+	HRESULT hrPipe = pipeResult.get();
+	if (!SUCCEEDED(hrPipe) && !trial->finished && SUCCEEDED(hr)) {
+		hr = hrPipe;
+	}
+
+	// the frames still in the compressor land too, so both counts cover the same bytes
+	if (pipeline) {
+		outputFile.flush();
+	}
+
+	if (SUCCEEDED(hr)) {
+		result.rawBytes = pipeline ? rawBytes.load() : trial->bytes;
+		result.storedBytes = trial->bytes;
+		result.seconds = trial->seconds();
+		result.maxTransferSize = vd.config.maxTransferSize;
+		result.blockSize = vd.config.blockSize;
+	}
+
+	return hr;
+}
+
+// with autotune: trial backups over AutotuneGrid, one at a time. The fastest
+// settings go into p.tune for the backup that follows, and are kept for the
+// backups after that. Sizes are what the device reported taking; once it
+// takes less than asked, larger sizes are not tried.
+HRESULT RunAutotune(params& p, SqlSession& session)
+{
+	outputLog_.line() << "Autotuning backup of " << p.database << std::endl;
+
+	tuning best;
+	double bestRate = 0;
+	DWORD transferLimit = 0;
+	for (auto tune : AutotuneGrid(p.tune)) {
+		if (transferLimit && tune.maxTransferSize > transferLimit) {
+			continue;
+		}
+
+		trialresult trial;
+		HRESULT hr = RunTrialBackup(p, tune, session, trial);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+		double rate = trial.rate();
+
+		if (trial.maxTransferSize && trial.maxTransferSize < tune.maxTransferSize) {
+			transferLimit = trial.maxTransferSize;
+			tune.maxTransferSize = trial.maxTransferSize;
+		}
+
+		outputLog_.line() << "buffercount " << tune.bufferCount << ", maxtransfersize " << format_size(tune.maxTransferSize) << ": " << static_cast<unsigned __int64>(rate / 1048576) << " MB/sec" << std::endl;
+
+		if (rate > bestRate) {
+			bestRate = rate;
+			best = tune;
+		}
+	}
+
+	if (!bestRate) {
+		outputLog_.line() << "Autotune could not measure " << p.database << ", leaving the settings to SQL Server" << std::endl;
+		p.tune.autotune = false;
+		return S_OK;
+	}
+
+	outputLog_.line() << "Autotune picked buffercount " << best.bufferCount << ", maxtransfersize " << format_size(best.maxTransferSize) << std::endl;
+
+	instancecache(p.flags.cacheTtl).storeTuning(p.instance, p.database, best);
+	p.tune = best;
+	return S_OK;
+}
+
+HRESULT RunBackup(VirtualDevice& vd, params p, HANDLE hFile, shmring* ring)
+{
+	auto sink = DeltaSink(p, CompressSink(p, ManifestSink(p, OpenSink(p, hFile, ring))));
+	if (!sink) {
+		return E_FAIL;
+	}
+
+	SqlSession session(p);
+
+	if (p.tune.autotune) {
+		HRESULT hr = RunAutotune(p, session);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+	}
+
+	HRESULT hr = RunBackupTo(vd, p, std::move(sink), false, session);
+	if (SUCCEEDED(hr)) {
+		session.traceTimings();
+	}
+
+	return hr;
+}
+
+HRESULT RunPipe(VirtualDevice& vd, params p, HANDLE hFile, shmring* ring)
+{
+	HRESULT hr = 0;
+
+	{
+		auto log = outputLog_.line();
+		log << "Piping " << p.subcommand << " virtual device " << p.device << std::endl;
+	}
+
+	// in pipe mode, use a much larger than the default timeout, say 5 minutes
+	DWORD pipeTimeout = 5 * 60 * 1000;
+
+	if (iequals(p.subcommand, "from")) {
+		auto sink = CompressSink(p, OpenSink(p, hFile, ring));
+		if (!sink) {
+			return E_FAIL;
+		}
+
+		OutputFile outputFile(std::move(sink));
+
+		auto pipeResult = std::async([&vd, &outputFile, &p, pipeTimeout]{
+			CoInit comInit;
+
+			vd.Open(pipeTimeout);
+
+			vditrace trace;
+			std::unique_ptr<pagecheck> check;
+			return processPipeBackup(vd.pDevice, outputFile, false, StartTrace(p, trace), StartPageCheck(p, check));
+		});
+
+		hr = pipeResult.get();
+	}
+	else if (iequals(p.subcommand, "to")) {
+
+		auto source = OpenSource(p, hFile, ring);
+		if (!source) {
+			return E_FAIL;
+		}
+
+		InputFile inputFile(std::move(source), 0); // no buffering
+
+		auto pipeResult = std::async([&vd, &inputFile, &p, pipeTimeout]{
+			CoInit comInit;
+
+			vd.Open(pipeTimeout);
+
+			vditrace trace;
+			std::unique_ptr<pagecheck> check;
+			return processPipeRestore(vd.pDevice, inputFile, false, StartTrace(p, trace), StartPageCheck(p, check));
+		});
+
+		hr = pipeResult.get();
+	}
+
+	return hr;
+}	
+
+constexpr BYTE handoffAccepted = 1;
+constexpr BYTE handoffDeclined = 0;
+
+// handles that can be shared with the elevated process; console handles cannot
+bool CanHandoff(HANDLE hFile)
+{
+	DWORD type = ::GetFileType(hFile);
+	return type == FILE_TYPE_DISK || type == FILE_TYPE_PIPE;
+}
+
+std::string MakeHandoff(HANDLE hFile)
+{
+	std::ostringstream o;
+	o << std::hex << ::GetCurrentProcessId() << ":" << reinterpret_cast<ULONG_PTR>(hFile);
+	return o.str();
+}
+
+// run in the elevated process: duplicates the parent's own file handle
+// and reports over the stdio pipe whether the parent still has to relay.
+// returns the handle to do io with, either the duplicate or the pipe.
+HANDLE AcceptHandoff(const std::string& handoff, const std::string& pipeName)
+{
+	HANDLE hDup = nullptr;
+
+	DWORD pid = 0;
+	ULONG_PTR value = 0;
+	{
+		std::istringstream i(handoff);
+		char sep = 0;
+		i >> std::hex >> pid >> sep >> value;
+	}
+
+	if (pid && value) {
+		HANDLE hParent = ::OpenProcess(PROCESS_DUP_HANDLE, FALSE, pid);
+		if (hParent) {
+			if (!::DuplicateHandle(hParent, reinterpret_cast<HANDLE>(value), ::GetCurrentProcess(), &hDup, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+				hDup = nullptr;
+			}
+			::CloseHandle(hParent);
+		}
+	}
+
+	HANDLE hPipe = ::CreateFile(widen(pipeName).c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (INVALID_HANDLE_VALUE == hPipe) {
+		if (hDup) {
+			::CloseHandle(hDup);
+		}
+		return nullptr;
+	}
+
+	BYTE status = hDup ? handoffAccepted : handoffDeclined;
+	DWORD dwBytesWritten = 0;
+	::WriteFile(hPipe, &status, 1, &dwBytesWritten, nullptr);
+
+	if (hDup) {
+		::CloseHandle(hPipe);
+		return hDup;
+	}
+
+	return hPipe;
+}
+
+// reruns p as an administrator, relaying its io through namedPipe and its
+// stderr through stderrPipe. Without namedPipe only stderr is relayed, for
+// commands like estimate that only report.
+HRESULT Elevate(params p, HANDLE hInput, HANDLE hOutput, std::string namedPipe, std::string stderrPipe, bytesource* source = nullptr, bytesink* sink = nullptr)
+{
+	bool reportOnly = namedPipe.empty();
+	if (!reportOnly && !hInput && !hOutput && !source && !sink) {
+		outputLog_.line() << "Invalid command for elevation" << std::endl;
+		return E_FAIL;
+	}
+
+	DWORD pipeBufferSize = p.flags.pipeBuffer ? p.flags.pipeBuffer : relay::defaultBufferSize;
+
+	// the elevated process starts in System32, so the files it opens by name need full paths
+	p.flags.recordTrace = FullPath(p.flags.recordTrace);
+	p.base = FullPath(p.base);
+	p.manifest = FullPath(p.manifest);
+
+	HANDLE hPipe = nullptr;
+	shmring ring;
+	bool useShm = shmring::isShm(namedPipe);
+
+	if (reportOnly) {
+		// nothing to relay but stderr
+	}
+	else if (useShm) {
+		ring.writer = hInput != nullptr;
+
+		HRESULT hr = ring.create(namedPipe, p.flags.pipeBuffer);
+		if (!SUCCEEDED(hr)) {
+			outputLog_.line() << "Failed to create shared memory ring: " << std::hex << hr << std::dec << std::endl;
+			return hr;
+		}
+	}
+	else {
+		// with a handoff the elevated process answers on the same pipe, so it must be duplex
+		DWORD dwOpenMode = ((hOutput || sink) ? PIPE_ACCESS_INBOUND : PIPE_ACCESS_OUTBOUND);
+		if (!p.flags.handoff.empty()) {
+			dwOpenMode = PIPE_ACCESS_DUPLEX;
+		}
+
+		hPipe = ::CreateNamedPipe(widen(namedPipe).c_str()
+			, dwOpenMode | FILE_FLAG_FIRST_PIPE_INSTANCE
+			, PIPE_TYPE_BYTE | PIPE_WAIT
+			, 1
+			, pipeBufferSize
+			, pipeBufferSize
+			, 10000
+			, nullptr
+		);
+	}
+
+	HANDLE hStderrPipe = ::CreateNamedPipe(widen(stderrPipe).c_str()
+		, PIPE_ACCESS_INBOUND | FILE_FLAG_FIRST_PIPE_INSTANCE
+		, PIPE_TYPE_BYTE | PIPE_WAIT
+		, 1
+		, 0x4000
+		, 0x4000
+		, 10000
+		, nullptr
+	);
+
+	// launch
+	HANDLE hProcess = nullptr;
+	{
+		std::wstring args = widen(MakeParams(p));
+		SHELLEXECUTEINFO sei = { sizeof(sei) };
+
+		wchar_t thisModuleFileName[MAX_PATH];
+		::GetModuleFileName(nullptr, thisModuleFileName, _countof(thisModuleFileName));
+
+		sei.fMask = 0 | SEE_MASK_NOCLOSEPROCESS | SEE_MASK_NOASYNC;
+		sei.hwnd = NULL;
+		sei.lpVerb = L"runas";
+		sei.lpFile = thisModuleFileName;
+		sei.lpParameters = args.c_str();
+		sei.lpDirectory = NULL;
+		sei.nShow = SW_SHOWNORMAL;
+
+		::ShellExecuteEx(&sei);
+
+		if ((int)sei.hInstApp <= 32) {
+			::CloseHandle(sei.hProcess);
+			if (hPipe) {
+				::CloseHandle(hPipe);
+			}
+			::CloseHandle(hStderrPipe);
+			return E_FAIL;
+		}
+
+		hProcess = sei.hProcess;
 	}
 	
-	BOOL connected = ::ConnectNamedPipe(hPipe, NULL) ? TRUE : (::GetLastError() == ERROR_PIPE_CONNECTED);
+	BOOL connected = FALSE;
+	if (reportOnly) {
+		connected = TRUE;
+	}
+	else if (useShm) {
+		connected = ring.waitAttached(hProcess);
+		if (!connected) {
+			::SetLastError(ERROR_PROCESS_ABORTED);
+		}
+	}
+	else {
+		connected = ::ConnectNamedPipe(hPipe, NULL) ? TRUE : (::GetLastError() == ERROR_PIPE_CONNECTED);
+	}
 
 	if (!connected) {
 		DWORD lastError = ::GetLastError();
 
-		::CloseHandle(hPipe);
+		if (hPipe) {
+			::CloseHandle(hPipe);
+		}
 		::CloseHandle(hStderrPipe);
+		::CloseHandle(hProcess);
 
 		return lastError ? lastError : E_FAIL;
 	}
 
-	BOOL connectedStderr = ::ConnectNamedPipe(hStderrPipe, NULL) ? TRUE : (::GetLastError() == ERROR_PIPE_CONNECTED);
-	if (!connectedStderr) {
-		DWORD lastError = ::GetLastError();
-		::CloseHandle(hStderrPipe);
+	BOOL connectedStderr = ::ConnectNamedPipe(hStderrPipe, NULL) ? TRUE : (::GetLastError() == ERROR_PIPE_CONNECTED);
+	if (!connectedStderr) {
+		DWORD lastError = ::GetLastError();
+		::CloseHandle(hStderrPipe);
+		hStderrPipe = nullptr;
+
+		outputLog_.line() << "Warning: failed to connect to stderr pipe: " << lastError << std::endl;
+	}
+
+	// the elevated process tells us first whether it took over our handle
+	bool handedOff = false;
+	if (!p.flags.handoff.empty()) {
+		BYTE status = 0;
+		DWORD dwBytesRead = 0;
+		if (::ReadFile(hPipe, &status, 1, &dwBytesRead, nullptr) && dwBytesRead == 1) {
+			handedOff = status == handoffAccepted;
+		}
+	}
+
+	if (reportOnly) {
+		outputLog_.line() << "Running as elevated process id " << ::GetProcessId(hProcess) << "!" << std::endl;
+	}
+	else if (handedOff) {
+		outputLog_.line() << "Handed off to elevated process id " << ::GetProcessId(hProcess) << "!" << std::endl;
+	}
+	else {
+		outputLog_.line() << "Piping with elevated process id " << ::GetProcessId(hProcess) << (useShm ? " through shared memory" : "") << "!" << std::endl;
+	}
+
+	if (hInput || source) {
+		hOutput = hPipe;
+	}
+	else {
+		hInput = hPipe;
+	}
+
+	// run!
+	HRESULT hrRelay = S_OK;
+	{
+		stderrforwarder forwarder(hStderrPipe, outputLog_);
+
+		__int64 totalBytes = 0;
+
+		if (reportOnly) {
+			::WaitForSingleObject(hProcess, INFINITE);
+		}
+		else if (handedOff) {
+			// nothing to relay; the elevated process does the io itself
+			::CloseHandle(hPipe);
+			hPipe = nullptr;
+
+			::WaitForSingleObject(hProcess, INFINITE);
+		}
+		else if (source || sink) {
+			hrRelay = source ? CopyFromSource(*source, hOutput, totalBytes) : CopyToSink(hInput, *sink, totalBytes);
+
+			::CloseHandle(hPipe);
+			hPipe = nullptr;
+		}
+		else if (useShm) {
+			hrRelay = ring.writer ? ring.fillFrom(hInput, totalBytes) : ring.drainTo(hOutput, totalBytes);
+			ring.close();
+		}
+		else {
+			relay r(pipeBufferSize);
+			hrRelay = r.run(hInput, hOutput);
+
+			// closing our end lets the elevated process see the end of its input
+			::CloseHandle(hPipe);
+			hPipe = nullptr;
+		}
+
+		// a remote sink is only completed for a backup that succeeded, so its exit code is needed
+		::WaitForSingleObject(hProcess, sink ? INFINITE : 5000);
+
+		forwarder.stop();
+
+		if (!SUCCEEDED(hrRelay)) {
+			auto log = outputLog_.line();
+			log << "Relay with elevated process failed with " << std::hex << hrRelay << std::dec << std::endl;
+		}
+	}
+
+	if (hStderrPipe) {
+		::CloseHandle(hStderrPipe);
+	}
+
+	DWORD dwExitCode = 0;
+	::GetExitCodeProcess(hProcess, &dwExitCode);
+
+	::CloseHandle(hProcess);
+
+	// anything short of a clean exit leaves the sink open, and destroying it aborts the upload
+	if (sink && !dwExitCode) {
+		if (!SUCCEEDED(hrRelay)) {
+			return hrRelay;
+		}
+		if (!sink->close()) {
+			DWORD ret = ::GetLastError();
+			outputLog_.line() << ret << ": Failed to complete " << p.to << std::endl;
+			return HRESULT_FROM_WIN32(ret ? ret : ERROR_WRITE_FAULT);
+		}
+	}
+
+	return dwExitCode;
+}
+
+/****/
+
+struct BatchDatabase
+{
+	std::string name;
+	unsigned __int64 sizeBytes = 0;
+	std::string file;
+	// what autotune picked for it; the job uses this over the cache
+	tuning tune;
+};
+
+// the online databases whose names match pattern, biggest first. all matches
+// every one but tempdb; * and ? work as they do for file names.
+HRESULT ListDatabases(const params& p, std::vector<BatchDatabase>& databases)
+{
+	std::ostringstream o;
+	o << "select d.name, sum(convert(bigint, f.size)) * 8192 as size_bytes"
+		<< " from sys.databases d join sys.master_files f on f.database_id = d.database_id"
+		<< " where d.state = 0 and d.name <> N'tempdb'";
+	if (!iequals(p.database, "all")) {
+		o << " and d.name like N'" << escape(like_pattern(p.database)) << "'";
+	}
+	o << " group by d.name order by size_bytes desc, d.name;";
+
+	try {
+		ADODB::_ConnectionPtr pCon = Connect(MakeConnectionString(p.instance, p.username, p.password));
+		if (!pCon) {
+			return E_FAIL;
+		}
+
+		ADODB::_RecordsetPtr pRs(__uuidof(ADODB::Recordset));
+		pRs->CursorLocation = ADODB::adUseServer;
+		pRs->Open(o.str().c_str(), (IDispatch*)pCon, ADODB::adOpenForwardOnly, ADODB::adLockReadOnly, ADODB::adCmdText);
+
+		traceAdoErrors(pCon);
+
+		while (!pRs->eof) {
+			BatchDatabase db;
+			db.name = narrow(pRs->Fields->Item["name"]->Value.bstrVal);
+			db.sizeBytes = static_cast<unsigned __int64>(static_cast<__int64>(pRs->Fields->Item["size_bytes"]->Value));
+			databases.push_back(db);
+
+			pRs->MoveNext();
+		}
+
+		pCon->Close();
+
+		return S_OK;
+	}
+	catch (_com_error& e) {
+		auto log = outputLog_.line();
+		log << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
+		log << e.Description() << std::endl;
+		return e.Error();
+	}
+}
+
+// a database name with anything a file name can not hold replaced
+std::string SafeFileName(const std::string& database)
+{
+	std::string name = database;
+	for (auto&& c : name) {
+		if (strchr("<>:\"/\\|?*", c) || static_cast<unsigned char>(c) < 32) {
+			c = '_';
+		}
+	}
+	return name;
+}
+
+// dir/name.bak
+std::string BatchFileName(const std::string& dir, const std::string& database)
+{
+	std::string name = SafeFileName(database);
+
+	std::string path = dir;
+	if (!path.empty() && path.back() != '/' && path.back() != '\\') {
+		path += '/';
+	}
+	return path + name + ".bak";
+}
+
+// batch jobs run side by side, so each records its own trace.name
+std::string BatchTraceName(const std::string& trace, const std::string& database)
+{
+	return trace.empty() ? trace : trace + "." + SafeFileName(database);
+}
+
+struct BatchJob
+{
+	std::atomic<unsigned __int64> bytes;
+	std::atomic<bool> running;
+	std::atomic<bool> finished;
+	HRESULT hr = S_OK;
+
+	BatchJob()
+		: bytes(0)
+		, running(false)
+		, finished(false)
+	{
+	}
+};
+
+// one merged progress line for the whole batch instead of one per job;
+// returns once every job has finished
+void WatchBatch(const std::vector<BatchDatabase>& databases, std::vector<BatchJob>& jobs, std::atomic<size_t>& finished)
+{
+	DWORD ticksBegin = ::GetTickCount();
+	DWORD ticksLastStatus = ticksBegin;
+	for (;;) {
+		bool done = finished == databases.size();
+		DWORD tick = ::GetTickCount();
+
+		if (done || tick - ticksLastStatus >= 5000) {
+			ticksLastStatus = tick;
+
+			unsigned __int64 totalBytes = 0;
+			size_t failed = 0;
+			std::ostringstream running;
+			for (size_t i = 0; i < jobs.size(); ++i) {
+				totalBytes += jobs[i].bytes;
+				if (jobs[i].finished && !SUCCEEDED(jobs[i].hr)) {
+					++failed;
+				}
+				if (jobs[i].running) {
+					running << " " << databases[i].name << " " << (jobs[i].bytes >> 20) << " MB;";
+				}
+			}
+
+			double seconds = max((tick - ticksBegin) / 1000.0, 0.1);
+
+			auto log = outputLog_.line();
+			log << (done ? "Total " : "Processing... ")
+				<< finished.load() << "/" << databases.size() << " done";
+			if (failed) {
+				log << ", " << failed << " failed";
+			}
+			log << ", " << (totalBytes >> 20) << " MB in " << static_cast<int>(seconds) << " seconds ("
+				<< static_cast<int>(totalBytes / 1048576.0 / seconds) << " MB/sec)" << running.str() << std::endl;
+		}
+
+		if (done) {
+			break;
+		}
+
+		::Sleep(250);
+	}
+}
+
+// backs up one database of a batch to its own file, quietly; the batch prints progress for all of them
+HRESULT RunBatchBackup(params p, const BatchDatabase& db, BatchJob& job, ratelimit* limit, SqlSession& session)
+{
+	p.subcommand.clear();
+	p.database = db.name;
+	p.device = make_guid();
+	p.to = BatchFileName(p.to, db.name);
+	p.flags.recordTrace = BatchTraceName(p.flags.recordTrace, db.name);
+	if (p.tune.autotune) {
+		p.tune = db.tune;
+	}
+
+	HANDLE hFile = nullptr;
+	if (!IsRemote(p.to)) {
+		hFile = ::CreateFile(widen(p.to).c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (INVALID_HANDLE_VALUE == hFile) {
+			DWORD ret = ::GetLastError();
+			outputLog_.line() << ret << ": Failed to open " << p.to << std::endl;
+			return HRESULT_FROM_WIN32(ret);
+		}
+	}
+
+	HRESULT hr = S_OK;
+	{
+		auto sink = CompressSink(p, OpenSink(p, hFile, nullptr));
+		if (!sink) {
+			hr = E_FAIL;
+		}
+		else {
+			VirtualDevice vd(p.instance, p.device);
+			hr = vd.Create();
+			if (SUCCEEDED(hr)) {
+				hr = RunBackupTo(vd, p, std::make_unique<meteredsink>(std::move(sink), job.bytes, limit), true, session);
+			}
+		}
+	}
+
+	if (hFile) {
+		::CloseHandle(hFile);
+	}
+
+	return hr;
+}
+
+// backup databases <pattern|all> to <dir>: up to --jobs backups at once in
+// this one process, biggest first so the long ones are not left for last,
+// all sharing one --maxrate budget
+HRESULT RunBackupDatabases(const params& p)
+{
+	std::vector<BatchDatabase> databases;
+	HRESULT hr = ListDatabases(p, databases);
+	if (!SUCCEEDED(hr)) {
+		return hr;
+	}
+
+	if (databases.empty()) {
+		outputLog_.line() << "No databases match " << p.database << std::endl;
+		return E_FAIL;
+	}
+
+	size_t jobCount = min(static_cast<size_t>(p.flags.jobs ? p.flags.jobs : paramflags::defaultJobs), databases.size());
+
+	{
+		unsigned __int64 totalSize = 0;
+		for (auto&& db : databases) {
+			totalSize += db.sizeBytes;
+		}
+
+		auto log = outputLog_.line();
+		log << "Backing up " << databases.size() << " databases (" << (totalSize >> 20) << " MB allocated) to " << p.to << ", " << jobCount << " at a time";
+		if (p.flags.maxRate) {
+			log << ", at most " << (p.flags.maxRate >> 20) << " MB/sec";
+		}
+		log << std::endl;
+	}
+
+	// trials one database at a time, before any backup competes with them;
+	// each job is handed its database's result, the cache only keeps it for
+	// later runs
+	if (p.tune.autotune) {
+		SqlSession session(p);
+		for (auto&& db : databases) {
+			params tuned = p;
+			tuned.database = db.name;
+			hr = RunAutotune(tuned, session);
+			db.tune = tuned.tune;
+			if (E_ACCESSDENIED == hr) {
+				return hr;
+			}
+			if (!SUCCEEDED(hr)) {
+				outputLog_.line() << std::hex << hr << std::dec << ": Autotune of " << db.name << " failed" << std::endl;
+			}
+		}
+	}
+
+	std::unique_ptr<ratelimit> limit;
+	if (p.flags.maxRate) {
+		limit = std::make_unique<ratelimit>(p.flags.maxRate);
+	}
+
+	std::vector<BatchJob> jobs(databases.size());
+	std::atomic<size_t> next(0);
+	std::atomic<size_t> finished(0);
+	std::atomic<bool> denied(false);
+
+	// each worker keeps its session from one job to the next
+	std::vector<std::unique_ptr<SqlSession>> sessions;
+	std::vector<std::thread> workers;
+	for (size_t w = 0; w < jobCount; ++w) {
+		sessions.push_back(std::make_unique<SqlSession>(p));
+		SqlSession* session = sessions.back().get();
+
+		workers.emplace_back([&, session] {
+			CoInit comInit;
+
+			for (;;) {
+				size_t i = next++;
+				if (i >= databases.size()) {
+					break;
+				}
+
+				BatchJob& job = jobs[i];
+				if (denied) {
+					// without the rights for a virtual device, none of the rest will work either
+					job.hr = E_ACCESSDENIED;
+				}
+				else {
+					job.running = true;
+					job.hr = RunBatchBackup(p, databases[i], job, limit.get(), *session);
+					job.running = false;
+
+					if (E_ACCESSDENIED == job.hr) {
+						denied = true;
+					}
+					else if (!SUCCEEDED(job.hr)) {
+						outputLog_.line() << std::hex << job.hr << std::dec << ": Backup of " << databases[i].name << " failed" << std::endl;
+					}
+				}
+
+				job.finished = true;
+				++finished;
+			}
+		});
+	}
+
+	WatchBatch(databases, jobs, finished);
+
+	for (auto&& t : workers) {
+		t.join();
+	}
+
+	for (auto&& session : sessions) {
+		if (session != sessions.front()) {
+			sessions.front()->add(*session);
+		}
+	}
+	sessions.front()->traceTimings();
+
+	if (denied) {
+		return E_ACCESSDENIED;
+	}
+
+	for (auto&& job : jobs) {
+		if (!SUCCEEDED(job.hr)) {
+			return job.hr;
+		}
+	}
+
+	return S_OK;
+}
+
+// the .bak files in dir, biggest first, each named for the database it restores
+HRESULT ListBackupFiles(const std::string& dir, std::vector<BatchDatabase>& backups)
+{
+	std::string path = dir;
+	if (!path.empty() && path.back() != '/' && path.back() != '\\') {
+		path += '\\';
+	}
+
+	WIN32_FIND_DATA fd = {};
+	HANDLE hFind = ::FindFirstFile(widen(path + "*.bak").c_str(), &fd);
+	if (INVALID_HANDLE_VALUE == hFind) {
+		DWORD ret = ::GetLastError();
+		return ERROR_FILE_NOT_FOUND == ret ? S_OK : HRESULT_FROM_WIN32(ret);
+	}
+
+	do {
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			continue;
+		}
+
+		std::string fileName = narrow(fd.cFileName);
+
+		BatchDatabase backup;
+		backup.name = fileName.substr(0, fileName.rfind('.'));
+		backup.sizeBytes = (static_cast<unsigned __int64>(fd.nFileSizeHigh) << 32) | fd.nFileSizeLow;
+		backup.file = path + fileName;
+		backups.push_back(backup);
+	} while (::FindNextFile(hFind, &fd));
+
+	::FindClose(hFind);
+
+	std::stable_sort(backups.begin(), backups.end(), [](const BatchDatabase& a, const BatchDatabase& b) {
+		return a.sizeBytes > b.sizeBytes;
+	});
+
+	return S_OK;
+}
+
+bool IsDirectory(const std::string& name)
+{
+	DWORD attributes = ::GetFileAttributes(widen(name).c_str());
+	return INVALID_FILE_ATTRIBUTES != attributes && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+// a restore whose file list has been read, waiting for a worker to stream it
+struct PreparedRestore
+{
+	size_t index = 0;
+	params p;
+	HANDLE hFile = nullptr;
+	std::unique_ptr<InputFile> inputFile;
+	std::string sql;
+};
+
+// creates each to and log to path that does not exist yet
+void CreateRestorePaths(const params& p)
+{
+	auto paths = SplitPaths(p.to + ";" + p.logTo);
+	for (auto&& path : paths) {
+		if (INVALID_FILE_ATTRIBUTES == ::GetFileAttributes(widen(path).c_str())) {
+			int ret = ::SHCreateDirectoryEx(nullptr, widen(path).c_str(), nullptr);
+			if (ret && ret != ERROR_FILE_EXISTS && ret != ERROR_ALREADY_EXISTS) {
+				outputLog_.line() << ret << ": Failed to create restore to path. Continuing (SQL Server may have access)... " << path << std::endl;
+			}
+		}
+	}
+}
+
+// restore all from <dir> [to <path>]: every .bak in the directory, restored
+// as the database its file is named for. One thread reads each backup's file
+// list ahead while up to --jobs workers stream the restores already prepared,
+// so the metadata pass of the next job overlaps the earlier ones.
+HRESULT RunRestoreAll(const params& p)
+{
+	std::vector<BatchDatabase> backups;
+	HRESULT hr = ListBackupFiles(p.from, backups);
+	if (!SUCCEEDED(hr)) {
+		outputLog_.line() << std::hex << hr << std::dec << ": Failed to list " << p.from << std::endl;
+		return hr;
+	}
+
+	if (backups.empty()) {
+		outputLog_.line() << "No .bak files in " << p.from << std::endl;
+		return E_FAIL;
+	}
+
+	CreateRestorePaths(p);
+
+	size_t jobCount = min(static_cast<size_t>(p.flags.jobs ? p.flags.jobs : paramflags::defaultJobs), backups.size());
+
+	outputLog_.line() << "Restoring " << backups.size() << " backups from " << p.from << ", " << jobCount << " at a time" << std::endl;
+
+	std::unique_ptr<ratelimit> limit;
+	if (p.flags.maxRate) {
+		limit = std::make_unique<ratelimit>(p.flags.maxRate);
+	}
+
+	std::vector<BatchJob> jobs(backups.size());
+	std::atomic<size_t> finished(0);
+	std::atomic<bool> denied(false);
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::unique_ptr<PreparedRestore>> prepared;
+	bool preparing = true;
+
+	// only the preparer plans, so the reservations need no lock
+	volumereservations reserved;
+
+	auto finish = [&](size_t i, HRESULT hrJob) {
+		jobs[i].hr = hrJob;
+		jobs[i].running = false;
+		jobs[i].finished = true;
+		if (E_ACCESSDENIED == hrJob) {
+			denied = true;
+		}
+		else if (!SUCCEEDED(hrJob)) {
+			outputLog_.line() << std::hex << hrJob << std::dec << ": Restore of " << backups[i].name << " from " << backups[i].file << " failed" << std::endl;
+			instancecache(p.flags.cacheTtl).invalidate(p.instance);
+		}
+		++finished;
+	};
+
+	// the preparer and each worker keep their sessions from one job to the next
+	std::vector<std::unique_ptr<SqlSession>> sessions;
+	sessions.push_back(std::make_unique<SqlSession>(p));
+	SqlSession& prepareSession = *sessions.back();
+
+	std::thread preparer([&] {
+		CoInit comInit;
+
+		for (size_t i = 0; i < backups.size(); ++i) {
+			if (denied) {
+				finish(i, E_ACCESSDENIED);
+				continue;
+			}
+
+			// stay only a few jobs ahead, so the open files and buffers stay bounded
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&] { return prepared.size() < jobCount; });
+			}
+
+			auto job = std::make_unique<PreparedRestore>();
+			job->index = i;
+			job->p = p;
+			job->p.database = backups[i].name;
+			job->p.from = backups[i].file;
+			job->p.device = make_guid();
+			job->p.flags.recordTrace = BatchTraceName(p.flags.recordTrace, backups[i].name);
+
+			job->hFile = ::CreateFile(widen(job->p.from).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (INVALID_HANDLE_VALUE == job->hFile) {
+				finish(i, HRESULT_FROM_WIN32(::GetLastError()));
+				continue;
+			}
+
+			auto source = OpenSource(job->p, job->hFile, nullptr);
+			HRESULT hrJob = E_FAIL;
+			if (source) {
+				job->inputFile = std::make_unique<InputFile>(std::make_unique<meteredsource>(std::move(source), jobs[i].bytes, limit.get()), 0x10000);
+				hrJob = PrepareRestore(job->p, *job->inputFile, job->sql, prepareSession, &reserved);
+			}
+
+			if (!SUCCEEDED(hrJob)) {
+				job->inputFile.reset();
+				::CloseHandle(job->hFile);
+				finish(i, hrJob);
+				continue;
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				prepared.push_back(std::move(job));
+			}
+			cv.notify_all();
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			preparing = false;
+		}
+		cv.notify_all();
+	});
+
+	std::vector<std::thread> workers;
+	for (size_t w = 0; w < jobCount; ++w) {
+		sessions.push_back(std::make_unique<SqlSession>(p));
+		SqlSession* session = sessions.back().get();
+
+		workers.emplace_back([&, session] {
+			CoInit comInit;
+
+			for (;;) {
+				std::unique_ptr<PreparedRestore> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cv.wait(lock, [&] { return !prepared.empty() || !preparing; });
+					if (prepared.empty()) {
+						break;
+					}
+					job = std::move(prepared.front());
+					prepared.pop_front();
+				}
+				cv.notify_all();
+
+				jobs[job->index].running = true;
+
+				HRESULT hrJob = E_ACCESSDENIED;
+				if (!denied) {
+					VirtualDevice vd(job->p.instance, job->p.device);
+					hrJob = vd.Create();
+					if (SUCCEEDED(hrJob)) {
+						hrJob = RunRestoreDatabase(vd, job->p, job->sql, *job->inputFile, true, *session);
+					}
+				}
+
+				job->inputFile.reset();
+				::CloseHandle(job->hFile);
+				finish(job->index, hrJob);
+			}
+		});
+	}
+
+	WatchBatch(backups, jobs, finished);
+
+	preparer.join();
+	for (auto&& t : workers) {
+		t.join();
+	}
+
+	for (auto&& session : sessions) {
+		if (session != sessions.front()) {
+			sessions.front()->add(*session);
+		}
+	}
+	sessions.front()->traceTimings();
+
+	if (denied) {
+		return E_ACCESSDENIED;
+	}
+
+	for (auto&& job : jobs) {
+		if (!SUCCEEDED(job.hr)) {
+			return job.hr;
+		}
+	}
+
+	return S_OK;
+}
+
+/****/
+
+// checks a backup file against its manifest, a leaf at a time on every core,
+// and names each leaf that does not match; a range checks only the leaves it touches
+HRESULT RunVerify(const params& p)
+{
+	std::string manifestName = p.manifest.empty() ? p.from + ".manifest" : p.manifest;
+
+	manifest m;
+	if (!m.load(manifestName)) {
+		outputLog_.line() << "Manifest is missing, malformed or does not add up to its root: " << manifestName << std::endl;
+		return HRESULT_FROM_WIN32(ERROR_FILE_INVALID);
+	}
+
+	HANDLE hFile = ::CreateFile(widen(p.from).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (INVALID_HANDLE_VALUE == hFile) {
+		DWORD ret = ::GetLastError();
+		outputLog_.line() << ret << ": Failed to open " << p.from << std::endl;
+		return HRESULT_FROM_WIN32(ret);
+	}
+
+	LARGE_INTEGER size = {};
+	::GetFileSizeEx(hFile, &size);
+	::CloseHandle(hFile);
+
+	bool sizeMatches = static_cast<unsigned __int64>(size.QuadPart) == m.size;
+	if (!sizeMatches) {
+		outputLog_.line() << p.from << " is " << size.QuadPart << " bytes, the manifest says " << m.size << std::endl;
+	}
+
+	size_t first = 0;
+	size_t last = m.leafCount();
+	if (p.rangeLength) {
+		if (p.rangeOffset >= m.size) {
+			outputLog_.line() << "Range starts past the end of the backup at " << m.size << " bytes" << std::endl;
+			return E_INVALIDARG;
+		}
+		first = static_cast<size_t>(p.rangeOffset / m.leafSize);
+		last = min(last, static_cast<size_t>((p.rangeOffset + p.rangeLength + m.leafSize - 1) / m.leafSize));
+	}
+
+	outputLog_.line() << "Verifying leaves " << first << " to " << (last ? last - 1 : 0) << " of " << m.leafCount() << " (" << (m.leafSize >> 10) << " KB each) against root " << sha256::hex(m.root) << std::endl;
+
+	DWORD ticksBegin = ::GetTickCount();
+
+	std::atomic<size_t> next(first);
+	std::atomic<unsigned __int64> bytes(0);
+	std::mutex mutex;
+	std::vector<size_t> bad;
+	DWORD lastError = 0;
+
+	auto verifyLoop = [&] {
+		// a handle of our own, so the reads of every thread overlap
+		HANDLE h = ::CreateFile(widen(p.from).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (INVALID_HANDLE_VALUE == h) {
+			std::unique_lock<std::mutex> lock(mutex);
+			lastError = ::GetLastError();
+			return;
+		}
+
+		std::unique_ptr<BYTE[]> buf(new BYTE[m.leafSize]);
+		for (size_t leaf = next++; leaf < last; leaf = next++) {
+			unsigned __int64 offset = static_cast<unsigned __int64>(leaf) * m.leafSize;
+			DWORD len = static_cast<DWORD>(min(static_cast<unsigned __int64>(m.leafSize), m.size - offset));
+
+			DWORD got = 0;
+			while (got < len) {
+				OVERLAPPED ov = {};
+				ov.Offset = static_cast<DWORD>(offset + got);
+				ov.OffsetHigh = static_cast<DWORD>((offset + got) >> 32);
+
+				DWORD dwBytes = 0;
+				if (!::ReadFile(h, buf.get() + got, len - got, &dwBytes, &ov) || !dwBytes) {
+					break;
+				}
+				got += dwBytes;
+			}
+			bytes += got;
+
+			if (got != len || merkle::leafHash(buf.get(), len) != m.leaves[leaf]) {
+				std::unique_lock<std::mutex> lock(mutex);
+				bad.push_back(leaf);
+			}
+		}
+
+		::CloseHandle(h);
+	};
+
+	std::vector<std::thread> threads;
+	size_t threadCount = min(max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1)), last - first);
+	for (size_t i = 0; i < threadCount; ++i) {
+		threads.emplace_back(verifyLoop);
+	}
+	for (auto&& t : threads) {
+		t.join();
+	}
+
+	if (lastError) {
+		outputLog_.line() << lastError << ": Failed to open " << p.from << std::endl;
+		return HRESULT_FROM_WIN32(lastError);
+	}
+
+	std::sort(bad.begin(), bad.end());
+	for (size_t leaf : bad) {
+		unsigned __int64 offset = static_cast<unsigned __int64>(leaf) * m.leafSize;
+		outputLog_.line() << "Leaf " << leaf << " at bytes " << offset << " to " << (min(offset + m.leafSize, m.size) - 1) << " does not match" << std::endl;
+	}
+
+	DWORD ticks = ::GetTickCount() - ticksBegin;
+	outputLog_.line() << "Verified " << (bytes >> 20) << " MB in " << ticks << " ms; " << bad.size() << " of " << (last - first) << " leaves bad" << std::endl;
+
+	if (!bad.empty() || !sizeMatches) {
+		return HRESULT_FROM_WIN32(ERROR_CRC);
+	}
+	return S_OK;
+}
+
+// reads a backup from a file, a url or stdin and reports what it is made
+// of, to choose codecs, stripes and dedupe by; no SQL Server is involved
+HRESULT RunAnalyze(const params& p)
+{
+	HANDLE hStdIn = ::GetStdHandle(STD_INPUT_HANDLE);
+	HANDLE hFile = nullptr;
+	if (p.from.empty()) {
+		hFile = hStdIn;
+	}
+	else if (!IsRemote(p.from)) {
+		hFile = ::CreateFile(widen(p.from).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (INVALID_HANDLE_VALUE == hFile) {
+			DWORD ret = ::GetLastError();
+			outputLog_.line() << ret << ": Failed to open " << p.from << std::endl;
+			return HRESULT_FROM_WIN32(ret);
+		}
+	}
+
+	HRESULT hr = S_OK;
+	streamanalysis a;
+	DWORD ticksBegin = ::GetTickCount();
+	{
+		auto source = OpenSource(p, hFile, nullptr);
+		if (!source) {
+			hr = E_FAIL;
+		}
+
+		std::vector<BYTE> buf(streamanalysis::frameSize);
+		while (source) {
+			DWORD got = 0;
+			if (!source->read(buf.data(), static_cast<DWORD>(buf.size()), &got)) {
+				DWORD ret = ::GetLastError();
+				outputLog_.line() << ret << ": Failed to read " << (p.from.empty() ? "stdin" : p.from) << std::endl;
+				hr = HRESULT_FROM_WIN32(ret);
+				break;
+			}
+			if (!got) {
+				break;
+			}
+			a.feed(buf.data(), got);
+		}
+	}
+	a.finish();
+	DWORD ticks = ::GetTickCount() - ticksBegin;
+
+	if (hFile && hFile != hStdIn) {
+		::CloseHandle(hFile);
+	}
+
+	if (!SUCCEEDED(hr)) {
+		return hr;
+	}
+
+	outputLog_.line() << "Analyzed " << (a.bytes >> 20) << " MB in " << ticks << " ms" << std::endl;
+
+	std::ostringstream report;
+	a.report(report);
+	outputLog_.push(report.str());
+
+	return S_OK;
+}
+
+// what a full backup of a database has to read: the pages allocated to
+// its objects, of which used hold rows, out of the size of its data files.
+// compressedRatio is what SQL Server's own compression made of its last
+// compressed full backup, or 0 if there is none in msdb.
+struct DatabaseSize
+{
+	unsigned __int64 fileBytes = 0;
+	unsigned __int64 allocatedBytes = 0;
+	unsigned __int64 usedBytes = 0;
+	double compressedRatio = 0;
+};
+
+HRESULT QueryDatabaseSize(const params& p, SqlSession& session, DatabaseSize& size)
+{
+	std::ostringstream o;
+	o << "select"
+		<< " isnull((select sum(convert(bigint, f.size)) from sys.master_files f where f.database_id = db_id(N'" << escape(p.database) << "') and f.type = 0), 0) * 8192 as file_bytes"
+		<< ", isnull((select sum(convert(bigint, a.total_pages)) from " << bracket(p.database) << ".sys.allocation_units a), 0) * 8192 as allocated_bytes"
+		<< ", isnull((select sum(convert(bigint, a.used_pages)) from " << bracket(p.database) << ".sys.allocation_units a), 0) * 8192 as used_bytes"
+		<< ", isnull((select top 1 convert(float, b.compressed_backup_size) / nullif(b.backup_size, 0) from msdb.dbo.backupset b"
+		<< " where b.database_name = N'" << escape(p.database) << "' and b.type = 'D' and b.compressed_backup_size < b.backup_size"
+		<< " order by b.backup_finish_date desc), 0) as compressed_ratio;";
+
+	try {
+		ADODB::_ConnectionPtr pCon = session.connection();
+		if (!pCon) {
+			return E_FAIL;
+		}
+
+		SqlSession::phase timer(session, "size");
 
-		nowide::cerr << "Warning: failed to connect to stderr pipe: " << lastError << std::endl;
-	}
+		ADODB::_RecordsetPtr pRs(__uuidof(ADODB::Recordset));
+		pRs->CursorLocation = ADODB::adUseServer;
+		pRs->Open(o.str().c_str(), (IDispatch*)pCon, ADODB::adOpenForwardOnly, ADODB::adLockReadOnly, ADODB::adCmdText);
 
-	nowide::cerr << "Piping with elevated process id " << ::GetProcessId(hProcess) << "!" << std::endl;
+		traceAdoErrors(pCon);
 
-	if (!hOutput) {
-		hOutput = hPipe;
+		if (!pRs->eof) {
+			size.fileBytes = static_cast<unsigned __int64>(static_cast<__int64>(pRs->Fields->Item["file_bytes"]->Value));
+			size.allocatedBytes = static_cast<unsigned __int64>(static_cast<__int64>(pRs->Fields->Item["allocated_bytes"]->Value));
+			size.usedBytes = static_cast<unsigned __int64>(static_cast<__int64>(pRs->Fields->Item["used_bytes"]->Value));
+			size.compressedRatio = static_cast<double>(pRs->Fields->Item["compressed_ratio"]->Value);
+		}
+
+		return S_OK;
 	}
-	else if (!hInput) {
-		hInput = hPipe;
+	catch (_com_error& e) {
+		auto log = outputLog_.line();
+		log << std::hex << e.Error() << std::dec << ": " << e.ErrorMessage() << std::endl;
+		log << e.Description() << std::endl;
+		session.reset();
+		return e.Error();
 	}
+}
 
-	// run!
-	{
-		constexpr size_t buflen = 0x10000;
-		std::unique_ptr<BYTE[]> buf(new BYTE[buflen]);
-
-		__int64 totalBytes = 0;
-		while (hInput && hOutput) {
-			DWORD dwBytesRead = 0;
-			if (hInput) {
-				BOOL ret = ::ReadFile(hInput, buf.get(), buflen, &dwBytesRead, nullptr);
-				if (!ret || (0 == dwBytesRead)) {
-					DWORD err = ::GetLastError();
-					hInput = nullptr;
-					hOutput = nullptr;
-				}
-			}
-			DWORD dwBytesWritten = 0;
-			if (dwBytesRead && hOutput) {
-				BOOL ret = ::WriteFile(hOutput, buf.get(), dwBytesRead, &dwBytesWritten, nullptr);
-				if (!ret || (0 == dwBytesWritten)) {
-					DWORD err = ::GetLastError();
-					hInput = nullptr;
-					hOutput = nullptr;
-				}
-			}
-			if (dwBytesRead != dwBytesWritten) {
-				DWORD err = ::GetLastError();
-				hInput = nullptr;
-				hOutput = nullptr;
+// how big a backup of p.database would be and how long it would take, with
+// the same options, from its allocated pages and a trial backup through the
+// same compression into a null sink. Nothing is written, and the trial is
+// thrown away like an autotune trial. The trial needs a virtual device, so
+// without one the whole estimate reruns elevated, with its report relayed.
+HRESULT RunEstimate(params p)
+{
+	if (!p.flags.noelevate) {
+		VirtualDevice probe(p.instance, make_guid());
+		if (E_ACCESSDENIED == probe.Create()) {
+			outputLog_.line() << "Run failed with E_ACCESSDENIED!" << std::endl;
+			outputLog_.line() << "Attempting to elevate and redirect stderr..." << std::endl;
+
+			std::ostringstream o;
+			o << R"(\\.\pipe\mssqlPipe_)" << "stderr_" << std::setfill('0') << std::setw(8) << std::hex << ::GetCurrentProcessId() << std::dec << "_" << make_guid().substr(1, 8);
+			std::string stderrPipe = o.str();
+
+			// the free space is read where the elevated process starts, in System32
+			if (!IsRemote(p.to)) {
+				p.to = FullPath(p.to);
 			}
-			totalBytes += dwBytesWritten;
+			p.flags.noelevate = true;
+			p.flags.tee = stderrPipe;
 
-			if (hStderrPipe) {
-				DWORD dwBytesRead = 0;
-				DWORD dwBytesAvail = 0;
-				DWORD dwBytesInMessage = 0;
-				do {
-					dwBytesRead = 0;
-					dwBytesAvail = 0;
-					dwBytesInMessage = 0;
+			return Elevate(p, nullptr, nullptr, std::string(), stderrPipe);
+		}
+	}
 
-					if (!::PeekNamedPipe(hStderrPipe, nullptr, 0, &dwBytesRead, &dwBytesAvail, &dwBytesInMessage)) {
-						break;
-					}
+	SqlSession session(p);
 
-					if (0 == dwBytesAvail) {
-						break;
-					}
+	DatabaseSize size;
+	HRESULT hr = QueryDatabaseSize(p, session, size);
+	if (!SUCCEEDED(hr)) {
+		return hr;
+	}
+	if (!size.fileBytes) {
+		outputLog_.line() << "Database " << p.database << " not found" << std::endl;
+		return E_FAIL;
+	}
 
-					dwBytesRead = 0;
-					if (!::ReadFile(hStderrPipe, buf.get(), min(dwBytesAvail, buflen - 1), &dwBytesRead, nullptr)) {
-						DWORD err = ::GetLastError();
-						::CloseHandle(hStderrPipe);
-						hStderrPipe = nullptr;
-						break;
-					}
+	outputLog_.line() << "Database " << p.database << ": " << (size.fileBytes >> 20) << " MB of data files, " << (size.allocatedBytes >> 20) << " MB allocated, " << (size.usedBytes >> 20) << " MB used" << std::endl;
 
-					if (dwBytesRead > 0) {
-						dwBytesAvail -= dwBytesRead;
+	// what autotune picked for this database last time, as the backup would use it
+	if (!p.tune.bufferCount && !p.tune.maxTransferSize && instancecache(p.flags.cacheTtl).loadTuning(p.instance, p.database, p.tune)) {
+		outputLog_.line() << "Using buffercount " << p.tune.bufferCount << ", maxtransfersize " << format_size(p.tune.maxTransferSize) << " from autotune" << std::endl;
+	}
 
-						*(buf.get() + dwBytesRead) = 0;
+	outputLog_.line() << "Sampling a backup of " << p.database << std::endl;
 
-						auto szErr = (const char*)buf.get();
+	trialresult trial;
+	hr = RunTrialBackup(p, p.tune, session, trial, true);
+	if (!SUCCEEDED(hr)) {
+		return hr;
+	}
+	if (!trial.rawBytes || trial.seconds <= 0) {
+		outputLog_.line() << "Could not sample a backup of " << p.database << std::endl;
+		return E_FAIL;
+	}
 
-						nowide::cerr << szErr << std::flush;
-					}
-				} while (dwBytesAvail > 0);
-			}
+	double stored = static_cast<double>(trial.storedBytes) / trial.rawBytes;
+	{
+		auto log = outputLog_.line();
+		log << "Sampled " << (trial.rawBytes >> 20) << " MB in " << std::fixed << std::setprecision(1) << trial.seconds << " s: " << static_cast<unsigned __int64>(trial.rate() / 1048576) << " MB/sec";
+		if (!p.flags.compress.empty()) {
+			log << ", stored as " << 100.0 * stored << "% with --compress " << p.flags.compress;
 		}
+		log << std::endl;
 	}
 
-	::CloseHandle(hPipe);
-	::CloseHandle(hStderrPipe);
-
-	::WaitForSingleObject(hProcess, 5000);
+	// the stream is the allocated pages, unless SQL Server compresses them first
+	double streamBytes = static_cast<double>(size.allocatedBytes);
+	if (iequals(p.tune.compression, "compression")) {
+		if (size.compressedRatio > 0) {
+			streamBytes *= size.compressedRatio;
+			outputLog_.line() << "SQL Server compressed the last full backup to " << std::fixed << std::setprecision(1) << 100.0 * size.compressedRatio << "%" << std::endl;
+		}
+		else {
+			outputLog_.line() << "Warning: no compressed full backup of " << p.database << " in msdb, so the estimate assumes compression saves nothing" << std::endl;
+		}
+	}
 
-	DWORD dwExitCode = 0;
-	::GetExitCodeProcess(hProcess, &dwExitCode);
+	auto storedBytes = static_cast<unsigned __int64>(streamBytes * stored);
+	auto seconds = static_cast<unsigned __int64>(streamBytes / trial.rate());
+	outputLog_.line() << "Estimated backup: " << (storedBytes >> 20) << " MB in " << seconds / 3600 << ":" << std::setfill('0') << std::setw(2) << seconds / 60 % 60 << ":" << std::setw(2) << seconds % 60
+		<< ", if the destination keeps up with " << static_cast<unsigned __int64>(trial.rate() / 1048576) << " MB/sec" << std::endl;
 
-	::CloseHandle(hProcess);
+	// the free space of the volume a local file would go to
+	if (!p.to.empty() && !IsRemote(p.to)) {
+		wchar_t volume[MAX_PATH + 1] = { 0 };
+		ULARGE_INTEGER freeBytes = {};
+		if (::GetVolumePathName(widen(p.to).c_str(), volume, _countof(volume)) && ::GetDiskFreeSpaceEx(volume, &freeBytes, nullptr, nullptr)) {
+			if (freeBytes.QuadPart < storedBytes) {
+				outputLog_.line() << "Warning: " << narrow(volume) << " has " << (freeBytes.QuadPart >> 20) << " MB free, short of the " << (storedBytes >> 20) << " MB the backup needs" << std::endl;
+			}
+			else {
+				outputLog_.line() << narrow(volume) << " has " << (freeBytes.QuadPart >> 20) << " MB free, enough for the " << (storedBytes >> 20) << " MB the backup needs" << std::endl;
+			}
+		}
+		else {
+			DWORD ret = ::GetLastError();
+			outputLog_.line() << ret << ": Failed to read the free space for " << p.to << std::endl;
+		}
+	}
 
-	return dwExitCode;
+	return S_OK;
 }
 
 HRESULT Run(params p)
 {
+	if (p.isVerify()) {
+		return RunVerify(p);
+	}
+	if (p.isAnalyze()) {
+		return RunAnalyze(p);
+	}
+	if (p.isEstimate()) {
+		return RunEstimate(p);
+	}
+	if (p.isBackup() && p.subcommand == "databases") {
+		return RunBackupDatabases(p);
+	}
+	if (p.isRestore() && iequals(p.database, "all") && IsDirectory(p.from)) {
+		return RunRestoreAll(p);
+	}
+
 	HANDLE hFile = nullptr;
 
 	HANDLE hStdIn = ::GetStdHandle(STD_INPUT_HANDLE);
@@ -1277,34 +3164,64 @@ HRESULT Run(params p)
 		::WaitNamedPipe(widen(p.from).c_str(), NMPWAIT_USE_DEFAULT_WAIT);
 	}
 
-	if (p.isBackup()) {
+	// the elevated process may be handed a shared memory ring instead of a pipe
+	std::unique_ptr<shmring> ring;
+	if (shmring::isShm(p.to) || shmring::isShm(p.from)) {
+		ring = std::make_unique<shmring>();
+		ring->writer = shmring::isShm(p.to);
+
+		const std::string& name = ring->writer ? p.to : p.from;
+		HRESULT hrRing = ring->open(name);
+		if (!SUCCEEDED(hrRing)) {
+			outputLog_.line() << std::hex << hrRing << std::dec << ": Failed to open " << name << std::endl;
+			return hrRing;
+		}
+	}
+
+	if (!ring && !p.flags.handoff.empty()) {
+		bool output = p.isBackup() || (p.isPipe() && iequals(p.subcommand, "from"));
+		const std::string& pipeName = output ? p.to : p.from;
+
+		hFile = AcceptHandoff(p.flags.handoff, pipeName);
+		if (!hFile) {
+			DWORD ret = ::GetLastError();
+			outputLog_.line() << ret << ": Failed to open " << pipeName << std::endl;
+			return E_FAIL;
+		}
+	}
+
+	if (ring || hFile) {
+		// no file to open
+	}
+	else if (p.isBackup()) {
 		if (p.to.empty()) {
 			hFile = hStdOut;
 		}
+		else if (IsRemote(p.to)) {
+			// opened by RunBackup
+		}
 		else {
 			hFile = ::CreateFile(widen(p.to).c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
 			if (!hFile || INVALID_HANDLE_VALUE == hFile) {
 				DWORD ret = ::GetLastError();
-				nowide::cerr << ret << ": Failed to open " << p.to << std::endl;
+				outputLog_.line() << ret << ": Failed to open " << p.to << std::endl;
 				return E_FAIL;
 			}
 		}
 	}
 	else if (p.isRestore()) {
-		if (!p.to.empty() && INVALID_FILE_ATTRIBUTES == ::GetFileAttributes(widen(p.to).c_str())) {
-			int ret = ::SHCreateDirectoryEx(nullptr, widen(p.to).c_str(), nullptr);
-			if (ret && ret != ERROR_FILE_EXISTS && ret != ERROR_ALREADY_EXISTS) {
-				nowide::cerr << ret << ": Failed to create restore to path. Continuing (SQL Server may have access)... " << p.from << std::endl;
-			}
-		}
+		CreateRestorePaths(p);
 		if (p.from.empty()) {
 			hFile = hStdIn;
 		}
+		else if (IsRemote(p.from)) {
+			// opened by RunRestore
+		}
 		else {
 			hFile = ::CreateFile(widen(p.from).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
 			if (!hFile || INVALID_HANDLE_VALUE == hFile) {
 				DWORD ret = ::GetLastError();
-				nowide::cerr << ret << ": Failed to open " << p.from << std::endl;
+				outputLog_.line() << ret << ": Failed to open " << p.from << std::endl;
 				return E_FAIL;
 			}
 		}
@@ -1314,11 +3231,14 @@ HRESULT Run(params p)
 			if (p.from.empty()) {
 				hFile = hStdIn;
 			}
+			else if (IsRemote(p.from)) {
+				// opened by RunPipe
+			}
 			else {
 				hFile = ::CreateFile(widen(p.from).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
 				if (!hFile || INVALID_HANDLE_VALUE == hFile) {
 					DWORD ret = ::GetLastError();
-					nowide::cerr << ret << ": Failed to open " << p.from << std::endl;
+					outputLog_.line() << ret << ": Failed to open " << p.from << std::endl;
 					return E_FAIL;
 				}
 			}
@@ -1327,19 +3247,24 @@ HRESULT Run(params p)
 			if (p.to.empty()) {
 				hFile = hStdOut;
 			}
+			else if (IsRemote(p.to)) {
+				// opened by RunPipe
+			}
 			else {
 				hFile = ::CreateFile(widen(p.to).c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
 				if (!hFile || INVALID_HANDLE_VALUE == hFile) {
 					DWORD ret = ::GetLastError();
-					nowide::cerr << ret << ": Failed to open " << p.to << std::endl;
+					outputLog_.line() << ret << ": Failed to open " << p.to << std::endl;
 					return E_FAIL;
 				}
 			}
 		}
 	}
 
-	if (!hFile) {
-		nowide::cerr << "missing file" << std::endl;
+	bool remote = IsRemote(p.to) || IsRemote(p.from);
+
+	if (!hFile && !ring && !remote) {
+		outputLog_.line() << "missing file" << std::endl;
 		return E_FAIL;
 	}
 
@@ -1349,13 +3274,18 @@ HRESULT Run(params p)
 	hr = vd.Create();
 	if (!SUCCEEDED(hr)) {
 		if (E_ACCESSDENIED == hr && !p.flags.noelevate) {
-			nowide::cerr << "Run failed with E_ACCESSDENIED!" << std::endl;
-			nowide::cerr << "Attempting to elevate and redirect io..." << std::endl;
+			outputLog_.line() << "Run failed with E_ACCESSDENIED!" << std::endl;
+			outputLog_.line() << "Attempting to elevate and redirect io..." << std::endl;
 
 			std::string unique = make_guid().substr(1, 8);
 
 			std::string namedPipe;
-			{
+			if (iequals(p.flags.transport, "shm") && !remote) {
+				std::ostringstream o;
+				o << shmring::prefix << R"(Local\mssqlPipe_)" << "shm_" << std::setfill('0') << std::setw(8) << std::hex << ::GetCurrentProcessId() << std::dec << "_" << unique;
+				namedPipe = o.str();
+			}
+			else {
 				std::ostringstream o;
 				o << R"(\\.\pipe\mssqlPipe_)" << "stdio_" << std::setfill('0') << std::setw(8) << std::hex << ::GetCurrentProcessId() << std::dec << "_" << unique;
 				namedPipe = o.str();
@@ -1371,8 +3301,29 @@ HRESULT Run(params p)
 			HANDLE hInput = nullptr;
 			HANDLE hOutput = nullptr;
 
+			// the elevated process does not get our environment, so the remote end stays with us
+			std::unique_ptr<bytesource> remoteSource;
+			std::unique_ptr<bytesink> remoteSink;
+			if (IsRemote(p.from)) {
+				remoteSource = OpenSource(p, nullptr, nullptr);
+				if (!remoteSource) {
+					return E_FAIL;
+				}
+			}
+			else if (IsRemote(p.to)) {
+				remoteSink = OpenSink(p, nullptr, nullptr);
+				if (!remoteSink) {
+					return E_FAIL;
+				}
+			}
+
 			p.flags.noelevate = true;
 			p.flags.tee = stderrPipe;
+
+			// by default the elevated process takes over our handle; any explicit transport relays instead
+			if (p.flags.transport.empty() && !remote && CanHandoff(hFile)) {
+				p.flags.handoff = MakeHandoff(hFile);
+			}
 			
 			if (p.isBackup()) {
 				hOutput = hFile;
@@ -1392,26 +3343,26 @@ HRESULT Run(params p)
 				}
 			}
 
-			hr = Elevate(p, hInput, hOutput, namedPipe, stderrPipe);
+			hr = Elevate(p, hInput, hOutput, namedPipe, stderrPipe, remoteSource.get(), remoteSink.get());
 			if (!SUCCEEDED(hr)) {
 				// oh no
 			}
 		}
 	} else if (p.isBackup()) {
-		hr = RunBackup(vd, p, hFile);
+		hr = RunBackup(vd, p, hFile, ring.get());
 	}
 	else if (p.isRestore()) {
-		hr = RunRestore(vd, p, hFile);
+		hr = RunRestore(vd, p, hFile, ring.get());
 	}
 	else if (p.isPipe()) {
-		hr = RunPipe(vd, p, hFile);
+		hr = RunPipe(vd, p, hFile, ring.get());
 	}
 	else {		
-		nowide::cerr << "unexpected command " << p.command << std::endl;
+		outputLog_.line() << "unexpected command " << p.command << std::endl;
 		hr = E_FAIL;
 	}
 	
-	if (hFile != hStdOut && hFile != hStdIn && hFile != hStdErr) {
+	if (hFile && hFile != hStdOut && hFile != hStdIn && hFile != hStdErr) {
 		::CloseHandle(hFile);
 		hFile = nullptr;
 	}
@@ -1420,6 +3371,410 @@ HRESULT Run(params p)
 }
 
 
+/****/
+
+double ProcessCpuSeconds()
+{
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	if (!::GetProcessTimes(::GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime)) {
+		return 0;
+	}
+
+	ULARGE_INTEGER kernel = { kernelTime.dwLowDateTime, kernelTime.dwHighDateTime };
+	ULARGE_INTEGER user = { userTime.dwLowDateTime, userTime.dwHighDateTime };
+
+	return (kernel.QuadPart + user.QuadPart) / 10000000.0;
+}
+
+// runs one pump against a simulated device and reports throughput, cpu and latency
+template<typename Pump>
+HRESULT Benchmark(const char* direction, const char* kind, simdevice& device, Pump pump)
+{
+	LARGE_INTEGER frequency, begin, end;
+	::QueryPerformanceFrequency(&frequency);
+
+	double cpuBegin = ProcessCpuSeconds();
+	::QueryPerformanceCounter(&begin);
+
+	HRESULT hr = pump(&device);
+
+	::QueryPerformanceCounter(&end);
+	double cpuSeconds = ProcessCpuSeconds() - cpuBegin;
+
+	double seconds = static_cast<double>(end.QuadPart - begin.QuadPart) / frequency.QuadPart;
+	double gigabytes = device.bytesCompleted / 1073741824.0;
+
+	auto log = outputLog_.line();
+	log << std::left << std::setw(8) << direction << std::setw(7) << kind << std::right
+		<< std::fixed << std::setprecision(2)
+		<< std::setw(8) << (seconds > 0 ? gigabytes / seconds : 0) << " GB/s"
+		<< std::setw(8) << (gigabytes > 0 ? cpuSeconds / gigabytes : 0) << " cpu s/GB"
+		<< std::setprecision(0)
+		<< "  p50 " << device.percentile(0.50)
+		<< "  p90 " << device.percentile(0.90)
+		<< "  p99 " << device.percentile(0.99)
+		<< "  max " << device.percentile(1.0) << " us";
+	if (!SUCCEEDED(hr) || device.errors || device.bytesCompleted < device.config.totalBytes) {
+		log << "  (incomplete: " << std::hex << hr << std::dec << ")";
+	}
+	log << std::endl;
+
+	return hr;
+}
+
+// drains the read end of a pipe on its own thread, like a downstream compressor would
+struct pipedrain
+{
+	HANDLE hRead = nullptr;
+	HANDLE hWrite = nullptr;
+	std::thread thread;
+
+	pipedrain()
+	{
+		::CreatePipe(&hRead, &hWrite, nullptr, relay::defaultBufferSize);
+		thread = std::thread([this] {
+			std::unique_ptr<BYTE[]> buf(new BYTE[relay::defaultBufferSize]);
+			DWORD dwBytes = 0;
+			while (::ReadFile(hRead, buf.get(), relay::defaultBufferSize, &dwBytes, nullptr) && dwBytes) {
+			}
+		});
+	}
+
+	~pipedrain()
+	{
+		::CloseHandle(hWrite);
+		thread.join();
+		::CloseHandle(hRead);
+	}
+};
+
+// feeds the write end of a pipe on its own thread, like an upstream decompressor would
+struct pipefeed
+{
+	HANDLE hRead = nullptr;
+	HANDLE hWrite = nullptr;
+	std::thread thread;
+
+	explicit pipefeed(unsigned __int64 totalBytes)
+	{
+		::CreatePipe(&hRead, &hWrite, nullptr, relay::defaultBufferSize);
+		thread = std::thread([this, totalBytes] {
+			std::unique_ptr<BYTE[]> buf(new BYTE[relay::defaultBufferSize]);
+			simdevice::fillBuffer(buf.get(), relay::defaultBufferSize);
+
+			unsigned __int64 remaining = totalBytes;
+			while (remaining) {
+				DWORD len = static_cast<DWORD>(min(remaining, static_cast<unsigned __int64>(relay::defaultBufferSize)));
+				DWORD dwBytes = 0;
+				if (!::WriteFile(hWrite, buf.get(), len, &dwBytes, nullptr) || !dwBytes) {
+					break;
+				}
+				remaining -= dwBytes;
+			}
+			::CloseHandle(hWrite);
+		});
+	}
+
+	~pipefeed()
+	{
+		::CloseHandle(hRead);
+		thread.join();
+	}
+};
+
+// makes sure the restore source file holds at least totalBytes
+void FillSourceFile(const wchar_t* fileName, unsigned __int64 totalBytes)
+{
+	HANDLE hFile = ::CreateFile(fileName, GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, nullptr);
+	if (INVALID_HANDLE_VALUE == hFile) {
+		return;
+	}
+
+	LARGE_INTEGER size = {};
+	::GetFileSizeEx(hFile, &size);
+
+	if (static_cast<unsigned __int64>(size.QuadPart) < totalBytes) {
+		std::unique_ptr<BYTE[]> buf(new BYTE[relay::defaultBufferSize]);
+		simdevice::fillBuffer(buf.get(), relay::defaultBufferSize);
+
+		unsigned __int64 remaining = totalBytes;
+		while (remaining) {
+			DWORD len = static_cast<DWORD>(min(remaining, static_cast<unsigned __int64>(relay::defaultBufferSize)));
+			DWORD dwBytes = 0;
+			if (!::WriteFile(hFile, buf.get(), len, &dwBytes, nullptr) || !dwBytes) {
+				break;
+			}
+			remaining -= dwBytes;
+		}
+	}
+
+	::CloseHandle(hFile);
+}
+
+// drives the backup pump into every sink, or the restore pump from every
+// source, each time on a fresh device from makeDevice
+template<typename MakeDevice>
+HRESULT BenchmarkMatrix(DWORD commandCode, unsigned __int64 totalBytes, const wchar_t* tempFile, MakeDevice makeDevice)
+{
+	HRESULT hr = S_OK;
+
+	if (commandCode == VDC_Write) {
+		// backup: the device writes, we sink
+		{
+			HANDLE hNul = ::CreateFile(L"NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			OutputFile outputFile(hNul);
+			auto device = makeDevice(commandCode);
+			Benchmark("backup", "null", *device, [&](IClientVirtualDevice* pDevice) {
+				return processPipeBackup(pDevice, outputFile, true);
+			});
+			::CloseHandle(hNul);
+		}
+		{
+			HANDLE hFile = ::CreateFile(tempFile, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, nullptr);
+			OutputFile outputFile(hFile);
+			auto device = makeDevice(commandCode);
+			hr = Benchmark("backup", "file", *device, [&](IClientVirtualDevice* pDevice) {
+				return processPipeBackup(pDevice, outputFile, true);
+			});
+			::CloseHandle(hFile);
+		}
+		{
+			HANDLE hFile = ::CreateFile(tempFile, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, nullptr);
+			OutputFile outputFile(MakeSink(hFile, nullptr, "direct"));
+			auto device = makeDevice(commandCode);
+			Benchmark("backup", "direct", *device, [&](IClientVirtualDevice* pDevice) {
+				return processPipeBackup(pDevice, outputFile, true);
+			});
+			::CloseHandle(hFile);
+		}
+		{
+			HANDLE hFile = ::CreateFile(tempFile, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_OVERLAPPED, nullptr);
+			OutputFile outputFile(std::make_unique<overlappedsink>(hFile, 0));
+			auto device = makeDevice(commandCode);
+			Benchmark("backup", "ovfile", *device, [&](IClientVirtualDevice* pDevice) {
+				return processPipeBackup(pDevice, outputFile, true);
+			});
+		}
+		{
+			pipedrain drain;
+			OutputFile outputFile(drain.hWrite);
+			auto device = makeDevice(commandCode);
+			Benchmark("backup", "pipe", *device, [&](IClientVirtualDevice* pDevice) {
+				return processPipeBackup(pDevice, outputFile, true);
+			});
+		}
+	}
+	else {
+		// restore: the device reads, we source
+		FillSourceFile(tempFile, totalBytes);
+		{
+			HANDLE hFile = ::CreateFile(tempFile, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			InputFile inputFile(hFile, 0);
+			auto device = makeDevice(commandCode);
+			hr = Benchmark("restore", "file", *device, [&](IClientVirtualDevice* pDevice) {
+				return processPipeRestore(pDevice, inputFile, true);
+			});
+			::CloseHandle(hFile);
+		}
+		{
+			HANDLE hFile = ::CreateFile(tempFile, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			InputFile inputFile(MakeSource(hFile, nullptr, "direct"), 0);
+			auto device = makeDevice(commandCode);
+			Benchmark("restore", "direct", *device, [&](IClientVirtualDevice* pDevice) {
+				return processPipeRestore(pDevice, inputFile, true);
+			});
+			::CloseHandle(hFile);
+		}
+		{
+			HANDLE hFile = ::CreateFile(tempFile, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, nullptr);
+			InputFile inputFile(std::make_unique<overlappedsource>(hFile, 0), 0);
+			auto device = makeDevice(commandCode);
+			Benchmark("restore", "ovfile", *device, [&](IClientVirtualDevice* pDevice) {
+				return processPipeRestore(pDevice, inputFile, true);
+			});
+		}
+		{
+			pipefeed feed(totalBytes);
+			InputFile inputFile(feed.hRead, 0);
+			auto device = makeDevice(commandCode);
+			Benchmark("restore", "pipe", *device, [&](IClientVirtualDevice* pDevice) {
+				return processPipeRestore(pDevice, inputFile, true);
+			});
+		}
+	}
+
+	return hr;
+}
+
+std::wstring MakeTempFileName()
+{
+	wchar_t tempPath[MAX_PATH] = { 0 };
+	wchar_t tempFile[MAX_PATH] = { 0 };
+	::GetTempPath(_countof(tempPath), tempPath);
+	::GetTempFileName(tempPath, L"msp", 0, tempFile);
+	return tempFile;
+}
+
+// the tee as it was before it had a put area: every character goes to both
+// sides with a sputc each. Kept only for the benchmark to compare against.
+struct chartee : public std::streambuf
+{
+	chartee(std::streambuf* sb1, std::streambuf* sb2)
+		: sb1(sb1)
+		, sb2(sb2)
+	{
+	}
+
+protected:
+	virtual int sync() override
+	{
+		int const r1 = sb1->pubsync();
+		int const r2 = sb2->pubsync();
+		return r1 == 0 && r2 == 0 ? 0 : -1;
+	}
+
+	virtual int_type overflow(int_type c) override
+	{
+		if (traits_type::eq_int_type(c, traits_type::eof())) {
+			return traits_type::not_eof(c);
+		}
+
+		char const ch = traits_type::to_char_type(c);
+		int_type const r1 = sb1->sputc(ch);
+		int_type const r2 = sb2->sputc(ch);
+		return traits_type::eq_int_type(r1, traits_type::eof()) || traits_type::eq_int_type(r2, traits_type::eof()) ? traits_type::eof() : c;
+	}
+
+	std::streambuf* sb1;
+	std::streambuf* sb2;
+};
+
+// writes recordset-like lines through a tee, as the elevated process writes
+// its stderr to both the console and the pipe; both sides go to NUL here so
+// only the tee itself is timed
+template<typename Tee>
+void BenchmarkTee(const char* kind, unsigned __int64 totalBytes)
+{
+	std::vector<std::string> lines;
+	for (int i = 0; i < 1000; ++i) {
+		std::ostringstream o;
+		o << "LogicalName AdventureWorks_Data" << i << "\tPhysicalName C:\\db\\AdventureWorks_" << i << ".mdf\tType D\tSize " << i * 8192ull;
+		lines.push_back(o.str());
+	}
+
+	std::filebuf nul1, nul2;
+	nul1.open("NUL", std::ios::out);
+	nul2.open("NUL", std::ios::out);
+
+	LARGE_INTEGER frequency, begin, end;
+	::QueryPerformanceFrequency(&frequency);
+
+	double cpuBegin = ProcessCpuSeconds();
+	::QueryPerformanceCounter(&begin);
+
+	unsigned __int64 bytes = 0;
+	{
+		Tee tee(&nul1, &nul2);
+		std::ostream out(&tee);
+		for (size_t i = 0; bytes < totalBytes; ++i) {
+			const std::string& line = lines[i % lines.size()];
+			out << line << '\n';
+			bytes += line.size() + 1;
+		}
+		out.flush();
+	}
+
+	::QueryPerformanceCounter(&end);
+	double cpuSeconds = ProcessCpuSeconds() - cpuBegin;
+
+	double seconds = static_cast<double>(end.QuadPart - begin.QuadPart) / frequency.QuadPart;
+	double gigabytes = bytes / 1073741824.0;
+
+	auto log = outputLog_.line();
+	log << std::left << std::setw(8) << "tee" << std::setw(7) << kind << std::right
+		<< std::fixed << std::setprecision(2)
+		<< std::setw(8) << (seconds > 0 ? gigabytes / seconds : 0) << " GB/s"
+		<< std::setw(8) << (gigabytes > 0 ? cpuSeconds / gigabytes : 0) << " cpu s/GB" << std::endl;
+}
+
+HRESULT RunBenchmark(const params& p)
+{
+	simconfig config;
+	if (!p.flags.benchmarkSpec.empty() && !config.parse(p.flags.benchmarkSpec)) {
+		outputLog_.line() << "Invalid benchmark spec `" << p.flags.benchmarkSpec << "`" << std::endl;
+		return E_INVALIDARG;
+	}
+
+	outputLog_.line() << "Benchmarking " << (config.totalBytes >> 20) << " MB"
+		<< " in " << (config.transferSize >> 10) << " KB transfers"
+		<< ", depth " << config.depth
+		<< ", flush every " << config.flushInterval
+		<< ", rate " << (config.bytesPerSecond >> 20) << " MB/s" << std::endl;
+
+	std::wstring tempFile = MakeTempFileName();
+
+	auto makeDevice = [&config](DWORD commandCode) {
+		simconfig c = config;
+		c.commandCode = commandCode;
+		return std::make_unique<simdevice>(c);
+	};
+
+	BenchmarkMatrix(VDC_Write, config.totalBytes, tempFile.c_str(), makeDevice);
+	BenchmarkMatrix(VDC_Read, config.totalBytes, tempFile.c_str(), makeDevice);
+
+	::DeleteFile(tempFile.c_str());
+
+	// the per character tee is slow, so at most 256MB goes through each
+	unsigned __int64 teeBytes = min(config.totalBytes, 256ull << 20);
+	BenchmarkTee<chartee>("chars", teeBytes);
+	BenchmarkTee<teebuf>("bulk", teeBytes);
+
+	return S_OK;
+}
+
+// re-issues a trace recorded with --record-trace against each sink or source
+HRESULT RunReplay(const params& p)
+{
+	std::vector<vditracerecord> records;
+	HRESULT hr = vditrace::load(p.flags.replayTrace, records);
+	if (!SUCCEEDED(hr)) {
+		outputLog_.line() << "Could not load trace " << p.flags.replayTrace << " (0x" << std::hex << hr << std::dec << ")" << std::endl;
+		return hr;
+	}
+
+	simconfig config = tracedevice::configFor(records);
+	if (!config.commandCode) {
+		outputLog_.line() << "Trace " << p.flags.replayTrace << " has no reads or writes to replay" << std::endl;
+		return E_INVALIDARG;
+	}
+
+	double seconds = tracedevice::duration(records);
+	double speed = p.flags.replaySpeed;
+
+	{
+		auto log = outputLog_.line();
+		log << "Replaying " << records.size() << " commands, " << (config.totalBytes >> 20) << " MB"
+			<< " recorded over " << std::fixed << std::setprecision(2) << seconds << " s"
+			<< " (" << (seconds > 0 ? config.totalBytes / 1073741824.0 / seconds : 0) << " GB/s)";
+		if (speed > 0) {
+			log << ", at " << speed << "x the recorded pace" << std::endl;
+		}
+		else {
+			log << ", as fast as possible" << std::endl;
+		}
+	}
+
+	std::wstring tempFile = MakeTempFileName();
+
+	hr = BenchmarkMatrix(config.commandCode, config.totalBytes, tempFile.c_str(), [&records, speed](DWORD) {
+		return std::make_unique<tracedevice>(records, speed);
+	});
+
+	::DeleteFile(tempFile.c_str());
+
+	return hr;
+}
+
 /****/
 
 
@@ -1480,17 +3835,30 @@ int wmain(int argc, wchar_t* wargv[])
 #ifdef _DEBUG
 		bool parseParamsResult = TestParseParams();
 		assert(parseParamsResult);
+		bool incompressibleResult = TestIncompressible();
+		assert(incompressibleResult);
+		bool likePatternResult = TestLikePattern();
+		assert(likePatternResult);
 #endif
 	}
 	
-	if (SUCCEEDED(p.hr) && !p.command.empty()) {
+	if (!p.flags.replayTrace.empty()) {
+		p.hr = RunReplay(p);
+	}
+	else if (p.flags.benchmark) {
+		p.hr = RunBenchmark(p);
+	}
+	else if (SUCCEEDED(p.hr) && !p.command.empty()) {
 		p.hr = Run(p);
 	}
 
 	if (E_ACCESSDENIED == p.hr) {
-		nowide::cerr << "Run failed with E_ACCESSDENIED; mssqlPipe may need to run as an administrator." << std::endl;
+		outputLog_.line() << "Run failed with E_ACCESSDENIED; mssqlPipe may need to run as an administrator." << std::endl;
 	}
 
+	// everything queued has to reach the console and the tee before it goes away
+	outputLog_.flush();
+
 	pTeeAndRedirectCerr.reset();
 
 #ifdef _DEBUG
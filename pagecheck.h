@@ -0,0 +1,410 @@
+#pragma once
+
+#include <emmintrin.h>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// the header at the start of every 8KB page of a SQL Server database
+#pragma pack(push, 1)
+struct sqlpageheader
+{
+	uint8_t headerVersion;
+	uint8_t type;
+	uint8_t typeFlagBits;
+	uint8_t level;
+	uint16_t flagBits;
+	uint16_t indexId;
+	uint32_t prevPage;
+	uint16_t prevFile;
+	uint16_t pminlen;
+	uint32_t nextPage;
+	uint16_t nextFile;
+	uint16_t slotCnt;
+	uint32_t objId;
+	uint16_t freeCnt;
+	uint16_t freeData;
+	uint32_t pageId;
+	uint16_t fileId;
+	uint16_t reservedCnt;
+	uint8_t lsn[10];
+	uint16_t xactReserved;
+	uint8_t xdesId[6];
+	uint16_t ghostRecCnt;
+	uint32_t tornBits;
+	uint8_t reserved[32];
+};
+#pragma pack(pop)
+
+static_assert(sizeof(sqlpageheader) == 96, "page header is 96 bytes");
+
+// what can be checked of a page on its own. With page_verify checksum the
+// page carries a checksum of all of its 16 sectors in tornBits; with
+// torn_page_detection every sector ends in the same 2 bit stamp instead.
+struct sqlpage
+{
+	static constexpr uint32_t size = 0x2000;
+	static constexpr uint32_t sectorSize = 0x200;
+	static constexpr uint32_t sectorCount = size / sectorSize;
+
+	enum : uint16_t
+	{
+		hasTornBits = 0x100,
+		hasChecksum = 0x200,
+	};
+
+	static uint32_t rotl32(uint32_t x, uint32_t n)
+	{
+		n &= 31;
+		return n ? (x << n) | (x >> (32 - n)) : x;
+	}
+
+	// whether buf looks enough like a page header to be worth checking
+	static bool plausible(const uint8_t* buf, sqlpageheader& h)
+	{
+		memcpy(&h, buf, sizeof(h));
+
+		switch (h.type) {
+		case 1: case 2: case 3: case 4: case 7: case 8: case 9: case 10: case 11: case 13: case 15: case 16: case 17:
+			break;
+		default:
+			return false;
+		}
+
+		return h.headerVersion == 1
+			&& (h.flagBits & (hasChecksum | hasTornBits))
+			&& h.fileId
+			&& h.freeData >= sizeof(sqlpageheader) && h.freeData <= size
+			&& h.freeCnt <= size - sizeof(sqlpageheader)
+			&& h.slotCnt <= (size - sizeof(sqlpageheader)) / 2;
+	}
+
+	// the xor of each sector, rotated by its distance from the last, with the
+	// checksum itself counted as 0; the sectors are folded 64 bytes at a time
+	static uint32_t checksum(const uint8_t* buf)
+	{
+		uint32_t sum = 0;
+		for (uint32_t sector = 0; sector < sectorCount; ++sector) {
+			const __m128i* p = reinterpret_cast<const __m128i*>(buf + sector * sectorSize);
+			__m128i a = _mm_loadu_si128(p);
+			__m128i b = _mm_loadu_si128(p + 1);
+			__m128i c = _mm_loadu_si128(p + 2);
+			__m128i d = _mm_loadu_si128(p + 3);
+			for (uint32_t i = 4; i < sectorSize / sizeof(__m128i); i += 4) {
+				a = _mm_xor_si128(a, _mm_loadu_si128(p + i));
+				b = _mm_xor_si128(b, _mm_loadu_si128(p + i + 1));
+				c = _mm_xor_si128(c, _mm_loadu_si128(p + i + 2));
+				d = _mm_xor_si128(d, _mm_loadu_si128(p + i + 3));
+			}
+			a = _mm_xor_si128(_mm_xor_si128(a, b), _mm_xor_si128(c, d));
+			a = _mm_xor_si128(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(1, 0, 3, 2)));
+			a = _mm_xor_si128(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1)));
+
+			uint32_t x = static_cast<uint32_t>(_mm_cvtsi128_si32(a));
+			if (!sector) {
+				x ^= reinterpret_cast<const sqlpageheader*>(buf)->tornBits;
+			}
+
+			sum ^= rotl32(x, 15 - sector);
+		}
+		return sum;
+	}
+
+	static bool stampsMatch(const uint8_t* buf)
+	{
+		uint8_t stamp = buf[sectorSize - 1] & 3;
+		for (uint32_t sector = 1; sector < sectorCount; ++sector) {
+			if ((buf[(sector + 1) * sectorSize - 1] & 3) != stamp) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// null when the page is good, otherwise what is wrong with it
+	static const char* verify(const uint8_t* buf, const sqlpageheader& h)
+	{
+		if (h.flagBits & hasChecksum) {
+			return checksum(buf) == h.tornBits ? nullptr : "checksum mismatch";
+		}
+		return stampsMatch(buf) ? nullptr : "torn page";
+	}
+
+	// finds the pages in buf, whose first byte is at stream offset base. Pages
+	// sit on 512 byte boundaries among the stream's own headers, so the scan
+	// goes sector by sector until a page checks out, then a page at a time. A
+	// page that fails is only taken for one on the grid of a good one, so
+	// data that merely looks like a page header, as in an encrypted backup,
+	// is not. onPage sees the pages that start in [ownFrom, ownTo), with null
+	// or what is wrong with them.
+	template<typename F>
+	static void scan(const uint8_t* buf, uint64_t base, size_t len, uint64_t ownFrom, uint64_t ownTo, F onPage)
+	{
+		uint64_t end = base + len;
+
+		bool anchored = false;
+		uint64_t anchor = 0;
+
+		uint64_t pos = base;
+		while (pos + size <= end) {
+			const uint8_t* page = buf + (pos - base);
+
+			sqlpageheader h;
+			if (!plausible(page, h)) {
+				pos += sectorSize;
+				continue;
+			}
+
+			const char* problem = verify(page, h);
+			if (problem) {
+				bool onGrid = anchored && 0 == (pos - anchor) % size;
+
+				sqlpageheader next;
+				if (!onGrid && pos + 2 * size <= end && plausible(page + size, next)) {
+					onGrid = !verify(page + size, next);
+				}
+
+				if (!onGrid) {
+					pos += sectorSize;
+					continue;
+				}
+			}
+
+			anchored = true;
+			anchor = pos;
+
+			if (pos >= ownFrom && pos < ownTo) {
+				onPage(h, pos, problem);
+			}
+
+			pos += size;
+		}
+	}
+};
+
+// checks the data pages in a backup stream as it passes, off the pump's
+// thread. The stream is copied in 4MB chunks, each with the 16KB before it,
+// to a few workers; when they all are busy the chunk goes unchecked rather
+// than holding up the pipe.
+struct pagecheck
+{
+	static constexpr uint32_t chunkSize = 0x400000;
+	static constexpr uint32_t carrySize = 2 * sqlpage::size;
+
+	// called from the workers, so it has to be thread safe
+	typedef std::function<void(const sqlpageheader& h, uint64_t offset, const char* problem)> reporter;
+
+	explicit pagecheck(reporter report)
+		: pagesChecked(0)
+		, badPages(0)
+		, skippedBytes(0)
+		, report(report)
+	{
+		size_t threads = (std::max)(1u, (std::min)(std::thread::hardware_concurrency() / 2, 4u));
+		chunks.resize(threads + 2);
+		for (auto&& c : chunks) {
+			c.data.reset(new uint8_t[carrySize + chunkSize]);
+			freeList.push_back(&c);
+		}
+
+		for (size_t i = 0; i < threads; ++i) {
+			workers.emplace_back([this] { checkLoop(); });
+		}
+	}
+
+	~pagecheck()
+	{
+		finish();
+	}
+
+	// takes a copy of buf, or counts it as skipped
+	void feed(const uint8_t* buf, uint32_t len)
+	{
+		while (len > 0) {
+			if (chunkLeft == chunkSize && !current && !skipping) {
+				current = takeFree(false);
+				skipping = !current;
+			}
+
+			uint32_t n = (std::min)(len, chunkLeft);
+			if (current) {
+				memcpy(current->data.get() + current->len, buf, n);
+				current->len += n;
+			}
+			else {
+				skippedBytes += n;
+			}
+
+			keepTail(buf, n);
+			offset += n;
+			buf += n;
+			len -= n;
+			chunkLeft -= n;
+
+			if (!chunkLeft) {
+				if (current) {
+					submit(false);
+				}
+				skipping = false;
+				chunkLeft = chunkSize;
+			}
+		}
+	}
+
+	// checks the rest of the stream and waits for the workers
+	void finish()
+	{
+		if (workers.empty()) {
+			return;
+		}
+
+		// the last pages of a full chunk belong to the next one, even if it is empty
+		if (!current && !skipping) {
+			current = takeFree(true);
+		}
+		if (current) {
+			submit(true);
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cv.notify_all();
+
+		for (auto&& t : workers) {
+			t.join();
+		}
+		workers.clear();
+	}
+
+	std::atomic<uint64_t> pagesChecked;
+	std::atomic<uint64_t> badPages;
+	std::atomic<uint64_t> skippedBytes;
+
+protected:
+	struct chunk
+	{
+		std::unique_ptr<uint8_t[]> data;
+		uint32_t len = 0;
+
+		// the stream offset of data[carry]
+		uint64_t start = 0;
+		uint32_t carry = 0;
+		bool last = false;
+	};
+
+	chunk* takeFree(bool wait)
+	{
+		chunk* c = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (wait) {
+				cv.wait(lock, [this] { return !freeList.empty(); });
+			}
+			if (freeList.empty()) {
+				return nullptr;
+			}
+			c = freeList.front();
+			freeList.pop_front();
+		}
+
+		c->start = offset;
+		c->carry = static_cast<uint32_t>(tail.size());
+		c->last = false;
+		memcpy(c->data.get(), tail.data(), tail.size());
+		c->len = c->carry;
+		return c;
+	}
+
+	void submit(bool last)
+	{
+		current->last = last;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			fullList.push_back(current);
+		}
+		cv.notify_all();
+
+		current = nullptr;
+	}
+
+	void keepTail(const uint8_t* buf, uint32_t len)
+	{
+		if (len >= carrySize) {
+			tail.assign(buf + len - carrySize, buf + len);
+			return;
+		}
+		tail.insert(tail.end(), buf, buf + len);
+		if (tail.size() > carrySize) {
+			tail.erase(tail.begin(), tail.begin() + (tail.size() - carrySize));
+		}
+	}
+
+	void checkLoop()
+	{
+		for (;;) {
+			chunk* c = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this] { return !fullList.empty() || stopping; });
+				if (fullList.empty()) {
+					return;
+				}
+				c = fullList.front();
+				fullList.pop_front();
+			}
+
+			check(*c);
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				freeList.push_back(c);
+			}
+			cv.notify_all();
+		}
+	}
+
+	// a chunk owns the pages that start from one page before its own bytes
+	// up to one page before the next chunk's, so each page is counted once;
+	// the carry before that only finds the grid
+	void check(const chunk& c)
+	{
+		uint64_t base = c.start - c.carry;
+		uint64_t end = base + c.len;
+		uint64_t ownFrom = c.start - (std::min)(c.start, static_cast<uint64_t>(sqlpage::size));
+		uint64_t ownTo = c.last ? end : end - (std::min)(end, static_cast<uint64_t>(sqlpage::size));
+
+		sqlpage::scan(c.data.get(), base, c.len, ownFrom, ownTo, [this](const sqlpageheader& h, uint64_t pos, const char* problem) {
+			++pagesChecked;
+			if (problem) {
+				++badPages;
+				report(h, pos, problem);
+			}
+		});
+	}
+
+	reporter report;
+
+	std::vector<chunk> chunks;
+	chunk* current = nullptr;
+	bool skipping = false;
+	uint32_t chunkLeft = chunkSize;
+	uint64_t offset = 0;
+	std::vector<uint8_t> tail;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<chunk*> freeList;
+	std::deque<chunk*> fullList;
+	std::vector<std::thread> workers;
+	bool stopping = false;
+};
@@ -11,12 +11,27 @@ void showUsage()
 Usage:
 
 mssqlPipe [instance] [as username[:password]] (backup|restore|pipe) ... 
-
-... backup [database] dbname [to filename]
-... restore [database] dbname [from filename] [to filepath] [with replace]
+mssqlPipe verify filename [manifest filename] [range offset length]
+mssqlPipe analyze [filename]
+mssqlPipe [instance] [as username[:password]] estimate [database] dbname [to filename] [with option...]
+
+... backup [database] dbname [to filename] [base filename] [manifest filename] [with option...]
+... backup databases (pattern|all) to directory [with option...]
+... restore all from directory [to filepath[;filepath...]] [log to filepath] [with replace|option...]
+... restore [database] dbname [from filename] [base filename] [to filepath[;filepath...]] [log to filepath] [with replace|option...]
 ... restore filelistonly [from filename]
 ... pipe (to|from) devicename [(to|from) filename]
 
+Backup options: compression, no_compression, buffercount n, maxtransfersize n,
+blocksize n, autotune. Restores take buffercount, maxtransfersize and blocksize.
+
+With base, a backup is written as its difference from that earlier backup,
+and a restore needs the same base to rebuild it. With manifest, a backup also
+writes a tree of hashes over every 4MB of the file, which verify checks.
+analyze reports what a backup is made of, without SQL Server. estimate
+samples a few seconds of a backup, throwing it away, to predict its size,
+duration and disk space with the same options.
+
 stdin or stdout will be used if no filenames specified. Windows authentication
 (SSPI) will be used if [as username[:password]] is not specified.
 
@@ -29,6 +44,8 @@ mssqlPipe backup database AdventureWorks | 7za a AdventureWorks.xz -txz -si
 mssqlPipe restore AdventureWorks from AdventureWorks.bak with replace
 mssqlPipe pipe from VirtualDevice42 > output.bak
 mssqlPipe pipe to VirtualDevice42 < input.bak
+mssqlPipe backup AdventureWorks to s3://bucket/AdventureWorks.bak
+mssqlPipe --jobs 8 backup databases all to z:/nightly
 
 Happy piping!
 )";
@@ -146,6 +163,59 @@ std::string makeCommandLineDiff(std::string cmdLineA, std::string cmdLineB)
 	return result;
 }
 
+// one with option that tunes the backup or restore statement, checked
+// against the limits of a virtual device; returns what was wrong, if anything
+const char* ParseTuningOption(const char**& arg, const char** argEnd, tuning& tune, bool backup)
+{
+	std::string option = ToLower(*arg);
+
+	if (backup && (option == "compression" || option == "no_compression")) {
+		tune.compression = option;
+		++arg;
+		return nullptr;
+	}
+	if (backup && option == "autotune") {
+		tune.autotune = true;
+		++arg;
+		return nullptr;
+	}
+	if (option != "buffercount" && option != "maxtransfersize" && option != "blocksize") {
+		return "invalid with option";
+	}
+
+	++arg;
+	if (arg >= argEnd) {
+		return "missing value for with option";
+	}
+
+	unsigned __int64 value = parse_size(*arg);
+	++arg;
+
+	// only the shape is checked here; how large a transfer or block the
+	// device takes is for it to say, and CheckGeometry reports it
+	if (!value || value > MAXDWORD) {
+		return "with option value out of range";
+	}
+
+	if (option == "buffercount") {
+		tune.bufferCount = static_cast<DWORD>(value);
+	}
+	else if (option == "maxtransfersize") {
+		if (value % 0x10000) {
+			return "maxtransfersize must be a multiple of 64k";
+		}
+		tune.maxTransferSize = static_cast<DWORD>(value);
+	}
+	else {
+		if (value < 512 || (value & (value - 1))) {
+			return "blocksize must be a power of 2 from 512";
+		}
+		tune.blockSize = static_cast<DWORD>(value);
+	}
+
+	return nullptr;
+}
+
 params ParseSqlParams(int argc, const char* argv[], bool quiet)
 {
 	params p;
@@ -216,6 +286,10 @@ params ParseSqlParams(int argc, const char* argv[], bool quiet)
 				if (arg < argEnd && iequals(*arg, "database")) {
 					++arg;
 				}
+				else if (arg < argEnd && iequals(*arg, "databases")) {
+					p.subcommand = ToLower(*arg);
+					++arg;
+				}
 				break;
 			}
 			else if (iequals(sz, "restore")) {
@@ -235,6 +309,19 @@ params ParseSqlParams(int argc, const char* argv[], bool quiet)
 				p.command = ToLower(sz);
 				break;
 			}
+			else if (iequals(sz, "estimate")) {
+				argVerb = arg++;
+				p.command = ToLower(sz);
+				if (arg < argEnd && iequals(*arg, "database")) {
+					++arg;
+				}
+				break;
+			}
+			else if (iequals(sz, "verify") || iequals(sz, "analyze")) {
+				argVerb = arg++;
+				p.command = ToLower(sz);
+				break;
+			}
 
 			++arg;
 		}
@@ -355,6 +442,103 @@ params ParseSqlParams(int argc, const char* argv[], bool quiet)
 			return invalidArgs("extra args at end");
 		}
 	}
+	else if (p.isVerify()) {
+		if (arg >= argEnd) {
+			return invalidArgs("verify requires a file name");
+		}
+
+		p.from = *arg;
+		++arg;
+
+		// manifest file, by default next to the backup
+		if (arg < argEnd && iequals(*arg, "manifest")) {
+			++arg;
+
+			if (arg >= argEnd) {
+				return invalidArgs("missing manifest file name");
+			}
+
+			p.manifest = *arg;
+			++arg;
+		}
+
+		// range offset length
+		if (arg < argEnd && iequals(*arg, "range")) {
+			++arg;
+
+			if (arg + 1 >= argEnd) {
+				return invalidArgs("range requires an offset and a length");
+			}
+
+			p.rangeOffset = parse_size(*arg);
+			++arg;
+			p.rangeLength = parse_size(*arg);
+			++arg;
+
+			if (!p.rangeLength) {
+				return invalidArgs("range length must not be 0");
+			}
+		}
+
+		if (arg < argEnd) {
+			return invalidArgs("extra args at end");
+		}
+	}
+	else if (p.isAnalyze()) {
+		// a file, a url or stdin
+		if (arg < argEnd) {
+			p.from = *arg;
+			++arg;
+		}
+
+		if (arg < argEnd) {
+			return invalidArgs("extra args at end");
+		}
+	}
+	else if (p.isEstimate()) {
+		if (arg >= argEnd) {
+			return invalidArgs("estimate requires a database name");
+		}
+
+		p.database = *arg;
+		++arg;
+
+		// where the backup would go, for its free space
+		if (arg < argEnd && iequals(*arg, "to")) {
+			++arg;
+
+			if (arg >= argEnd) {
+				return invalidArgs("missing file name");
+			}
+
+			p.to = *arg;
+			++arg;
+		}
+
+		if (arg < argEnd && iequals(*arg, "with")) {
+			++arg;
+
+			if (arg >= argEnd) {
+				return invalidArgs("missing option after with");
+			}
+
+			while (arg < argEnd) {
+				const char* option = *arg;
+				const char* error = ParseTuningOption(arg, argEnd, p.tune, true);
+				if (error) {
+					return invalidArgs(error, option);
+				}
+			}
+
+			if (p.tune.autotune) {
+				return invalidArgs("estimate uses what autotune picked before, but does not autotune");
+			}
+		}
+
+		if (arg < argEnd) {
+			return invalidArgs("extra args at end");
+		}
+	}
 	else if (p.isRestore() && p.subcommand == "filelistonly") {
 		// filelistonly 
 
@@ -395,6 +579,42 @@ params ParseSqlParams(int argc, const char* argv[], bool quiet)
 				++arg;
 			}
 
+			// base file
+			if (arg < argEnd && iequals(*arg, "base")) {
+				++arg;
+
+				if (arg >= argEnd) {
+					return invalidArgs("missing base file name");
+				}
+
+				p.base = *arg;
+				++arg;
+			}
+
+			// manifest file
+			if (arg < argEnd && iequals(*arg, "manifest")) {
+				++arg;
+
+				if (arg >= argEnd) {
+					return invalidArgs("missing manifest file name");
+				}
+
+				p.manifest = *arg;
+				++arg;
+			}
+
+			if (p.subcommand == "databases" && (p.database.empty() || p.to.empty())) {
+				return invalidArgs("backup databases requires a pattern or all, and a directory to back up to");
+			}
+
+			if (p.subcommand == "databases" && !p.base.empty()) {
+				return invalidArgs("backup databases does not take a base");
+			}
+
+			if (p.subcommand == "databases" && !p.manifest.empty()) {
+				return invalidArgs("backup databases does not take a manifest");
+			}
+
 			// TODO with copy only, not copy only, etc?
 
 			if (arg < argEnd && iequals(*arg, "with")) {
@@ -404,9 +624,17 @@ params ParseSqlParams(int argc, const char* argv[], bool quiet)
 					return invalidArgs("missing option after with");
 				}
 
-				// no with options for backup yet
+				while (arg < argEnd) {
+					const char* option = *arg;
+					const char* error = ParseTuningOption(arg, argEnd, p.tune, true);
+					if (error) {
+						return invalidArgs(error, option);
+					}
+				}
 
-				return invalidArgs("invalid with option");
+				if (p.tune.autotune && (p.tune.bufferCount || p.tune.maxTransferSize)) {
+					return invalidArgs("autotune picks buffercount and maxtransfersize itself");
+				}
 			}
 
 			if (arg < argEnd) {
@@ -428,6 +656,22 @@ params ParseSqlParams(int argc, const char* argv[], bool quiet)
 				++arg;
 			}
 
+			// base file
+			if (arg < argEnd && iequals(*arg, "base")) {
+				++arg;
+
+				if (arg >= argEnd) {
+					return invalidArgs("missing base file name");
+				}
+
+				p.base = *arg;
+				++arg;
+			}
+
+			if (iequals(p.database, "all") && !p.base.empty()) {
+				return invalidArgs("restore all does not take a base");
+			}
+
 			// to path
 			if (arg < argEnd && iequals(*arg, "to")) {
 				++arg;
@@ -440,6 +684,18 @@ params ParseSqlParams(int argc, const char* argv[], bool quiet)
 				++arg;
 			}
 
+			// log to path
+			if (arg + 1 < argEnd && iequals(*arg, "log") && iequals(*(arg + 1), "to")) {
+				arg += 2;
+
+				if (arg >= argEnd) {
+					return invalidArgs("missing log path");
+				}
+
+				p.logTo = *arg;
+				++arg;
+			}
+
 			// with replace
 
 			if (arg < argEnd && iequals(*arg, "with")) {
@@ -449,12 +705,18 @@ params ParseSqlParams(int argc, const char* argv[], bool quiet)
 					return invalidArgs("missing option after with");
 				}
 
-				if (iequals(*arg, "replace")) {
-					p.subcommand = ToLower(*arg);
-					++arg;
-				}
-				else {
-					return invalidArgs("invalid with option");
+				while (arg < argEnd) {
+					if (iequals(*arg, "replace")) {
+						p.subcommand = ToLower(*arg);
+						++arg;
+						continue;
+					}
+
+					const char* option = *arg;
+					const char* error = ParseTuningOption(arg, argEnd, p.tune, false);
+					if (error) {
+						return invalidArgs(error, option);
+					}
 				}
 			}
 		}
@@ -482,11 +744,91 @@ params ParseParams(int argc, const char* argv[], bool quiet)
 				flags.noelevate = true;
 			} else if (iequals(arg, "--test")) {
 				flags.test = true;
+			} else if (iequals(arg, "--benchmark")) {
+				flags.benchmark = true;
+				// optionally followed by a spec like size=1g,transfer=1m
+				if (i + 1 < argc && strchr(argv[i + 1], '=')) {
+					++i;
+					flags.benchmarkSpec = argv[i];
+				}
 			} else if (iequals(arg, "--tee")) {
 				++i;
 				if (i < argc) {
 					flags.tee = argv[i];
 				}
+			} else if (iequals(arg, "--pipebuffer")) {
+				++i;
+				if (i < argc) {
+					flags.pipeBuffer = static_cast<DWORD>(parse_size(argv[i]));
+				}
+			} else if (iequals(arg, "--transport")) {
+				++i;
+				if (i < argc) {
+					flags.transport = argv[i];
+				}
+			} else if (iequals(arg, "--io")) {
+				++i;
+				if (i < argc) {
+					flags.io = argv[i];
+				}
+			} else if (iequals(arg, "--compress")) {
+				++i;
+				if (i < argc) {
+					flags.compress = argv[i];
+				}
+			} else if (iequals(arg, "--pagecheck")) {
+				flags.pageCheck = true;
+			} else if (iequals(arg, "--connections")) {
+				++i;
+				if (i < argc) {
+					flags.connections = strtoul(argv[i], nullptr, 0);
+				}
+			} else if (iequals(arg, "--partsize")) {
+				++i;
+				if (i < argc) {
+					flags.partSize = static_cast<DWORD>(parse_size(argv[i]));
+				}
+			} else if (iequals(arg, "--jobs")) {
+				++i;
+				if (i < argc) {
+					flags.jobs = strtoul(argv[i], nullptr, 0);
+				}
+			} else if (iequals(arg, "--maxrate")) {
+				++i;
+				if (i < argc) {
+					flags.maxRate = parse_size(argv[i]);
+				}
+			} else if (iequals(arg, "--cachettl")) {
+				++i;
+				if (i < argc) {
+					flags.cacheTtl = strtoul(argv[i], nullptr, 0);
+				}
+			} else if (iequals(arg, "--retries")) {
+				++i;
+				if (i < argc) {
+					flags.retries = strtoul(argv[i], nullptr, 0);
+				}
+			} else if (iequals(arg, "--handoff")) {
+				++i;
+				if (i < argc) {
+					flags.handoff = argv[i];
+				}
+			} else if (iequals(arg, "--record-trace")) {
+				++i;
+				if (i < argc) {
+					flags.recordTrace = argv[i];
+				}
+			} else if (iequals(arg, "--replay-trace")) {
+				++i;
+				if (i < argc) {
+					flags.replayTrace = argv[i];
+				}
+			} else if (iequals(arg, "--replay-speed")) {
+				++i;
+				if (i < argc) {
+					// 0 replays as fast as the pump goes
+					flags.replaySpeed = strtod(argv[i], nullptr);
+				}
 			} else {
 				args.push_back(arg);
 			}
@@ -495,13 +837,41 @@ params ParseParams(int argc, const char* argv[], bool quiet)
 		}		
 	}
 
-	params p = ParseSqlParams(static_cast<int>(args.size()), static_cast<const char**>(&args[0]), quiet);
+	// a benchmark or replay needs no verb, so skip the usage in that case
+	bool flagsOnly = args.size() < 2 && (flags.benchmark || !flags.replayTrace.empty());
+
+	params p = ParseSqlParams(static_cast<int>(args.size()), static_cast<const char**>(&args[0]), quiet || flagsOnly);
 
 	p.flags = flags;
 	
 	return p;
 }
 
+// the with options of a backup or restore, in a fixed order
+std::vector<std::string> MakeTuningOptions(const tuning& tune)
+{
+	std::vector<std::string> options;
+	if (!tune.compression.empty()) {
+		options.push_back(tune.compression);
+	}
+	if (tune.autotune) {
+		options.push_back("autotune");
+	}
+	if (tune.bufferCount) {
+		options.push_back("buffercount");
+		options.push_back(std::to_string(tune.bufferCount));
+	}
+	if (tune.maxTransferSize) {
+		options.push_back("maxtransfersize");
+		options.push_back(format_size(tune.maxTransferSize));
+	}
+	if (tune.blockSize) {
+		options.push_back("blocksize");
+		options.push_back(format_size(tune.blockSize));
+	}
+	return options;
+}
+
 std::string MakeParams(const params& p)
 {
 	std::string commandLine;
@@ -529,6 +899,33 @@ std::string MakeParams(const params& p)
 		append("--tee");
 		append(p.flags.tee);
 	}
+	if (!p.flags.io.empty()) {
+		append("--io");
+		append(p.flags.io);
+	}
+	if (!p.flags.compress.empty()) {
+		append("--compress");
+		append(p.flags.compress);
+	}
+	if (p.flags.pageCheck) {
+		append("--pagecheck");
+	}
+	if (p.flags.retries != paramflags::defaultRetries) {
+		append("--retries");
+		append(std::to_string(p.flags.retries));
+	}
+	if (p.flags.cacheTtl != paramflags::defaultCacheTtl) {
+		append("--cachettl");
+		append(std::to_string(p.flags.cacheTtl));
+	}
+	if (!p.flags.handoff.empty()) {
+		append("--handoff");
+		append(p.flags.handoff);
+	}
+	if (!p.flags.recordTrace.empty()) {
+		append("--record-trace");
+		append(p.flags.recordTrace);
+	}
 
 	if (!p.instance.empty()) {
 		append(p.instance);
@@ -570,10 +967,51 @@ std::string MakeParams(const params& p)
 			append(p.from);
 		}
 	}
+	else if (p.isAnalyze()) {
+
+		append(p.from);
+	}
+	else if (p.isEstimate()) {
+
+		assert(!p.database.empty());
+
+		append(p.database);
+
+		if (!p.to.empty()) {
+			append("to");
+			append(p.to);
+		}
+
+		if (!p.tune.empty()) {
+			append("with");
+			for (auto&& option : MakeTuningOptions(p.tune)) {
+				append(option);
+			}
+		}
+	}
+	else if (p.isVerify()) {
+
+		append(p.from);
+
+		if (!p.manifest.empty()) {
+			append("manifest");
+			append(p.manifest);
+		}
+
+		if (p.rangeLength) {
+			append("range");
+			append(format_size(p.rangeOffset));
+			append(format_size(p.rangeLength));
+		}
+	}
 	else if (p.isBackup()) {
 
 		assert(!p.database.empty());
 
+		if (p.subcommand == "databases") {
+			append(p.subcommand);
+		}
+
 		append(p.database);
 
 		if (!p.to.empty()) {
@@ -581,7 +1019,24 @@ std::string MakeParams(const params& p)
 			append(p.to);
 		}
 
+		if (!p.base.empty()) {
+			append("base");
+			append(p.base);
+		}
+
+		if (!p.manifest.empty()) {
+			append("manifest");
+			append(p.manifest);
+		}
+
 		assert(p.from.empty());
+
+		if (!p.tune.empty()) {
+			append("with");
+			for (auto&& option : MakeTuningOptions(p.tune)) {
+				append(option);
+			}
+		}
 	}
 	else if (p.isRestore()) {
 
@@ -594,14 +1049,30 @@ std::string MakeParams(const params& p)
 			append(p.from);
 		}
 
+		if (!p.base.empty()) {
+			append("base");
+			append(p.base);
+		}
+
 		if (!p.to.empty()) {
 			append("to");
 			append(p.to);
 		}
 
-		if (p.subcommand == "replace") {
+		if (!p.logTo.empty()) {
+			append("log");
+			append("to");
+			append(p.logTo);
+		}
+
+		if (p.subcommand == "replace" || !p.tune.empty()) {
 			append("with");
-			append(p.subcommand);
+			if (p.subcommand == "replace") {
+				append(p.subcommand);
+			}
+			for (auto&& option : MakeTuningOptions(p.tune)) {
+				append(option);
+			}
 		}
 	}
 
@@ -632,6 +1103,18 @@ std::ostream& operator<<(std::ostream& o, const params& p)
 	if (!p.to.empty()) {
 		o << "to=" << p.to << ";";
 	}
+	if (!p.logTo.empty()) {
+		o << "logTo=" << p.logTo << ";";
+	}
+	if (!p.base.empty()) {
+		o << "base=" << p.base << ";";
+	}
+	if (!p.manifest.empty()) {
+		o << "manifest=" << p.manifest << ";";
+	}
+	if (p.rangeLength) {
+		o << "range=" << p.rangeOffset << "+" << p.rangeLength << ";";
+	}
 	if (!p.as.empty()) {
 		o << "as=" << p.as << ";";
 	}
@@ -642,6 +1125,14 @@ std::ostream& operator<<(std::ostream& o, const params& p)
 		o << "password=" << p.password << ";";
 	}
 
+	if (!p.tune.empty()) {
+		o << "with=";
+		for (auto&& option : MakeTuningOptions(p.tune)) {
+			o << option << " ";
+		}
+		o << ";";
+	}
+
 	if (p.isPipe()) {
 		o << "device=" << p.device << ";";
 	}
@@ -702,17 +1193,41 @@ bool TestParseParams()
 	if (!test("mssqlPipe myinstance backup AdventureWorks")) { return false; }
 	if (!test("mssqlPipe myinstance as sa:hunter2 backup AdventureWorks")) { return false; }
 
+	// flags
+	if (!test("mssqlPipe --record-trace backup.trace backup AdventureWorks")) { return false; }
+	if (!test("mssqlPipe --io overlapped restore AdventureWorks from z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe --compress auto backup AdventureWorks to z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe --compress xpress_huff pipe from VirtualDevice to z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe --pagecheck backup AdventureWorks to z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe --compress auto --pagecheck restore AdventureWorks from z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe --retries 0 restore AdventureWorks from z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe --cachettl 0 restore AdventureWorks from z:/db/AdventureWorks.bak")) { return false; }
+
 	// backup
 	if (!test("mssqlPipe backup AdventureWorks")) { return false; }
 	if (!test("mssqlPipe backup database AdventureWorks")) { return false; }
 	if (!test("mssqlPipe backup AdventureWorks to z:/db")) { return false; }
+	if (!test("mssqlPipe backup AdventureWorks to s3://backups/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe backup databases all to z:/db")) { return false; }
+	if (!test("mssqlPipe backup databases Sales* to s3://backups/nightly")) { return false; }
+	if (!test("mssqlPipe backup AdventureWorks to z:/db/AdventureWorks.bak with compression buffercount 64 maxtransfersize 4m")) { return false; }
+	if (!test("mssqlPipe backup AdventureWorks with no_compression blocksize 64k")) { return false; }
+	if (!test("mssqlPipe backup databases all to z:/db with compression autotune")) { return false; }
+	if (!test("mssqlPipe backup AdventureWorks to z:/db/AdventureWorks.delta base z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe backup AdventureWorks to z:/db/AdventureWorks.bak manifest z:/db/AdventureWorks.bak.manifest with compression")) { return false; }
 
 	// restore
 	if (!test("mssqlPipe restore AdventureWorks")) { return false; }
 	if (!test("mssqlPipe restore database AdventureWorks")) { return false; }
 	if (!test("mssqlPipe restore AdventureWorks from z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe restore AdventureWorks from s3://backups/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe restore all from z:/backups to c:/db/ with replace")) { return false; }
+	if (!test("mssqlPipe restore AdventureWorks from z:/db/AdventureWorks.bak to d:/data/;e:/data/ log to f:/log/ with replace")) { return false; }
+	if (!test("mssqlPipe restore AdventureWorks from https://example.com/AdventureWorks.bak")) { return false; }
 	if (!test("mssqlPipe restore AdventureWorks with replace")) { return false; }
 	if (!test("mssqlPipe restore AdventureWorks from z:/db/AdventureWorks.bak with replace")) { return false; }
+	if (!test("mssqlPipe restore AdventureWorks from z:/db/AdventureWorks.bak with replace buffercount 32 maxtransfersize 1m")) { return false; }
+	if (!test("mssqlPipe restore AdventureWorks from z:/db/AdventureWorks.delta base z:/db/AdventureWorks.bak to c:/db/ with replace")) { return false; }
 
 	// restore filelistonly
 	if (!test("mssqlPipe restore filelistonly")) { return false; }
@@ -724,6 +1239,21 @@ bool TestParseParams()
 	if (!test("mssqlPipe pipe to VirtualDevice from AdventureWorks.bak")) { return false; }
 	if (!test("mssqlPipe pipe from VirtualDevice to AdventureWorks.bak")) { return false; }
 
+	// verify
+	if (!test("mssqlPipe verify z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe verify z:/db/AdventureWorks.bak manifest z:/db/AdventureWorks.manifest range 10g 512m")) { return false; }
+	if (!test("mssqlPipe verify z:/db/AdventureWorks.bak range 0 4m")) { return false; }
+
+	// analyze
+	if (!test("mssqlPipe analyze")) { return false; }
+	if (!test("mssqlPipe analyze z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe analyze s3://backups/AdventureWorks.bak")) { return false; }
+
+	// estimate
+	if (!test("mssqlPipe estimate AdventureWorks")) { return false; }
+	if (!test("mssqlPipe myinstance as sa:hunter2 estimate AdventureWorks to z:/db/AdventureWorks.bak")) { return false; }
+	if (!test("mssqlPipe --compress auto estimate AdventureWorks to s3://backups/AdventureWorks.bak with compression buffercount 64 maxtransfersize 4m")) { return false; }
+
 	return true;
 }
 #endif
\ No newline at end of file
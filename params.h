@@ -8,9 +8,46 @@
 
 struct paramflags
 {
+	static constexpr DWORD defaultRetries = 5;
+	static constexpr DWORD defaultJobs = 4;
+	static constexpr DWORD defaultCacheTtl = 3600;
+
 	bool noelevate = false;
 	bool test = false;
 	std::string tee;
+	DWORD pipeBuffer = 0;
+	std::string transport;
+	std::string io;
+	std::string compress;
+	bool pageCheck = false;
+	DWORD connections = 0;
+	DWORD partSize = 0;
+	DWORD retries = defaultRetries;
+	DWORD jobs = 0;
+	unsigned __int64 maxRate = 0;
+	DWORD cacheTtl = defaultCacheTtl;
+	std::string handoff;
+	bool benchmark = false;
+	std::string benchmarkSpec;
+	std::string recordTrace;
+	std::string replayTrace;
+	double replaySpeed = 1.0;
+};
+
+// with options passed through to the backup or restore statement; 0 or
+// empty leaves the choice to SQL Server
+struct tuning
+{
+	DWORD bufferCount = 0;
+	DWORD maxTransferSize = 0;
+	DWORD blockSize = 0;
+	std::string compression;
+	bool autotune = false;
+
+	bool empty() const
+	{
+		return !bufferCount && !maxTransferSize && !blockSize && compression.empty() && !autotune;
+	}
 };
 
 struct params
@@ -22,6 +59,13 @@ struct params
 	std::string device;
 	std::string from;
 	std::string to;
+	std::string logTo;
+	std::string base;
+	std::string manifest;
+
+	// the part of the file verify checks; a length of 0 checks all of it
+	unsigned __int64 rangeOffset = 0;
+	unsigned __int64 rangeLength = 0;
 
 	std::string as;
 	std::string username;
@@ -31,6 +75,7 @@ struct params
 	std::string errorMessage;
 
 	paramflags flags;
+	tuning tune;
 
 	friend std::ostream& operator<<(std::ostream& o, const params& p);
 
@@ -55,6 +100,21 @@ struct params
 	{
 		return iequals(command, "pipe");
 	}
+
+	bool isVerify() const
+	{
+		return iequals(command, "verify");
+	}
+
+	bool isAnalyze() const
+	{
+		return iequals(command, "analyze");
+	}
+
+	bool isEstimate() const
+	{
+		return iequals(command, "estimate");
+	}
 };
 
 
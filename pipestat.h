@@ -7,12 +7,12 @@ struct pipestat
 	DWORD ticksBegin = 0;
 	DWORD ticksLastStatus = 0;
 
-	std::mutex& outputMutex;
+	logsink& outputLog;
 	bool quiet = false;
 
-	pipestat(std::mutex& outputMutex, bool quiet)
+	pipestat(logsink& outputLog, bool quiet)
 		: ticksBegin(::GetTickCount())
-		, outputMutex(outputMutex)
+		, outputLog(outputLog)
 		, quiet(quiet)
 	{
 		ticksLastStatus = ticksBegin;
@@ -73,15 +73,15 @@ struct pipestat
 		double totalKilobytes = totalBytes / 1024.0;
 		double kilobytesPerSec = totalKilobytes / totalSeconds;
 
-		std::unique_lock<std::mutex> lock(outputMutex);
+		auto log = outputLog.line();
 
 		if (totalSeconds <= 1.0) {
-			nowide::cerr << prefix << std::setw(9) << static_cast<int>(totalKilobytes)
+			log << prefix << std::setw(9) << static_cast<int>(totalKilobytes)
 				<< " kb in " << " < 1 second"
 				<< std::endl;
 		}
 		else {
-			nowide::cerr << prefix << std::setw(9) << static_cast<int>(totalKilobytes)
+			log << prefix << std::setw(9) << static_cast<int>(totalKilobytes)
 				<< " kb in " << std::setw(4) << static_cast<int>(totalSeconds) << " seconds ("
 				<< std::setw(6) << static_cast<int>(kilobytesPerSec) << " kb/sec)"
 				<< std::endl;
@@ -0,0 +1,117 @@
+#pragma once
+
+// one throughput budget shared by every job in a batch. A writer takes what
+// it needs straight away and then sleeps off whatever that puts the budget
+// in debt, so concurrent writers queue up behind each other at the set rate.
+struct ratelimit
+{
+	explicit ratelimit(unsigned __int64 bytesPerSecond)
+		: bytesPerSecond(static_cast<double>(bytesPerSecond))
+	{
+		::QueryPerformanceFrequency(&frequency);
+		::QueryPerformanceCounter(&last);
+	}
+
+	void acquire(DWORD len)
+	{
+		if (bytesPerSecond <= 0) {
+			return;
+		}
+
+		double debt = 0;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			LARGE_INTEGER now;
+			::QueryPerformanceCounter(&now);
+			double elapsed = static_cast<double>(now.QuadPart - last.QuadPart) / frequency.QuadPart;
+			last = now;
+
+			// at most a second's worth of burst after an idle spell
+			available = min(available + elapsed * bytesPerSecond, bytesPerSecond);
+			available -= len;
+			debt = -available;
+		}
+
+		if (debt > 0) {
+			::Sleep(static_cast<DWORD>(debt * 1000 / bytesPerSecond));
+		}
+	}
+
+protected:
+	double bytesPerSecond = 0;
+	double available = 0;
+	LARGE_INTEGER frequency = {};
+	LARGE_INTEGER last = {};
+	std::mutex mutex;
+};
+
+// counts what one job writes, for the merged progress view, and keeps it
+// within the shared budget
+struct meteredsink : public bytesink
+{
+	meteredsink(std::unique_ptr<bytesink> sink, std::atomic<unsigned __int64>& bytes, ratelimit* limit)
+		: sink(std::move(sink))
+		, bytes(bytes)
+		, limit(limit)
+	{
+	}
+
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		if (limit) {
+			limit->acquire(len);
+		}
+
+		BOOL ret = sink->write(buf, len, pdwBytes);
+		bytes += *pdwBytes;
+		stats = sink->stats;
+		return ret;
+	}
+
+	virtual BOOL flush() override
+	{
+		return sink->flush();
+	}
+
+	virtual BOOL close() override
+	{
+		BOOL ret = sink->close();
+		stats = sink->stats;
+		return ret;
+	}
+
+protected:
+	std::unique_ptr<bytesink> sink;
+	std::atomic<unsigned __int64>& bytes;
+	ratelimit* limit = nullptr;
+};
+
+// the same for what one job reads
+struct meteredsource : public bytesource
+{
+	meteredsource(std::unique_ptr<bytesource> source, std::atomic<unsigned __int64>& bytes, ratelimit* limit)
+		: source(std::move(source))
+		, bytes(bytes)
+		, limit(limit)
+	{
+	}
+
+	virtual BOOL read(BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		BOOL ret = source->read(buf, len, pdwBytes);
+		bytes += *pdwBytes;
+		stats = source->stats;
+
+		if (limit && *pdwBytes) {
+			limit->acquire(*pdwBytes);
+		}
+
+		return ret;
+	}
+
+protected:
+	std::unique_ptr<bytesource> source;
+	std::atomic<unsigned __int64>& bytes;
+	ratelimit* limit = nullptr;
+};
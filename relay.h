@@ -0,0 +1,218 @@
+#pragma once
+
+#include <deque>
+#include <atomic>
+#include <condition_variable>
+
+// relays bytes from one handle to another with a reader and a writer thread
+// joined by a small ring of large buffers, so reads and writes overlap.
+struct relay
+{
+	static constexpr size_t defaultBufferSize = 0x100000;
+	static constexpr size_t defaultBufferCount = 4;
+
+	__int64 totalBytes = 0;
+	DWORD lastError = 0;
+
+	relay(size_t bufferSize = defaultBufferSize, size_t bufferCount = defaultBufferCount)
+		: bufferSize(bufferSize ? bufferSize : defaultBufferSize)
+	{
+		if (!bufferCount) {
+			bufferCount = defaultBufferCount;
+		}
+
+		buffers.resize(bufferCount);
+		for (auto&& buffer : buffers) {
+			buffer.data.reset(new BYTE[this->bufferSize]);
+			freeList.push_back(&buffer);
+		}
+	}
+
+	HRESULT run(HANDLE hInput, HANDLE hOutput)
+	{
+		std::thread reader([this, hInput] { readLoop(hInput); });
+
+		writeLoop(hOutput);
+
+		reader.join();
+
+		return lastError ? HRESULT_FROM_WIN32(lastError) : S_OK;
+	}
+
+protected:
+	struct buffer
+	{
+		std::unique_ptr<BYTE[]> data;
+		DWORD len = 0;
+	};
+
+	buffer* pop(std::deque<buffer*>& list)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this, &list] { return !list.empty() || stopped; });
+		if (list.empty()) {
+			return nullptr;
+		}
+		buffer* b = list.front();
+		list.pop_front();
+		return b;
+	}
+
+	void push(std::deque<buffer*>& list, buffer* b)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			list.push_back(b);
+		}
+		cv.notify_all();
+	}
+
+	void stop(DWORD err)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (!lastError && err && err != ERROR_BROKEN_PIPE && err != ERROR_HANDLE_EOF) {
+				lastError = err;
+			}
+			stopped = true;
+		}
+		cv.notify_all();
+	}
+
+	void readLoop(HANDLE hInput)
+	{
+		for (;;) {
+			buffer* b = pop(freeList);
+			if (!b) {
+				return;
+			}
+
+			DWORD dwBytesRead = 0;
+			BOOL ret = ::ReadFile(hInput, b->data.get(), static_cast<DWORD>(bufferSize), &dwBytesRead, nullptr);
+			DWORD err = ret ? 0 : ::GetLastError();
+
+			b->len = dwBytesRead;
+			if (dwBytesRead) {
+				push(fullList, b);
+			}
+
+			if (!ret || !dwBytesRead) {
+				// an empty buffer marks the end of the stream for the writer
+				if (dwBytesRead) {
+					b = pop(freeList);
+				}
+				if (b) {
+					b->len = 0;
+					push(fullList, b);
+				}
+				if (err) {
+					stop(err);
+				}
+				return;
+			}
+		}
+	}
+
+	void writeLoop(HANDLE hOutput)
+	{
+		for (;;) {
+			buffer* b = pop(fullList);
+			if (!b || !b->len) {
+				stop(0);
+				return;
+			}
+
+			DWORD dwBytesWritten = 0;
+			while (dwBytesWritten < b->len) {
+				DWORD dwBytes = 0;
+				BOOL ret = ::WriteFile(hOutput, b->data.get() + dwBytesWritten, b->len - dwBytesWritten, &dwBytes, nullptr);
+				dwBytesWritten += dwBytes;
+				if (!ret || (dwBytes == 0)) {
+					DWORD err = ::GetLastError();
+					stop(err ? err : ERROR_WRITE_FAULT);
+					return;
+				}
+			}
+			totalBytes += dwBytesWritten;
+
+			push(freeList, b);
+		}
+	}
+
+	size_t bufferSize = 0;
+	std::vector<buffer> buffers;
+	std::deque<buffer*> freeList;
+	std::deque<buffer*> fullList;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool stopped = false;
+};
+
+// forwards whatever arrives on the elevated process' stderr pipe, on its own
+// thread, with blocking reads that end when the process closes its end
+struct stderrforwarder
+{
+	stderrforwarder(HANDLE hPipe, logsink& outputLog)
+		: hPipe(hPipe)
+		, outputLog(outputLog)
+	{
+		if (hPipe) {
+			thread = std::thread([this] { forwardLoop(); });
+		}
+	}
+
+	~stderrforwarder()
+	{
+		stop();
+	}
+
+	// waits a while for the process to close its end, so what is left in the
+	// pipe is read first; a process that still holds it has its read cancelled
+	void stop()
+	{
+		if (!thread.joinable()) {
+			return;
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (!cv.wait_for(lock, std::chrono::seconds(1), [this] { return finished; })) {
+				::CancelSynchronousIo(thread.native_handle());
+			}
+		}
+
+		thread.join();
+	}
+
+protected:
+	void forwardLoop()
+	{
+		constexpr DWORD buflen = 0x4000;
+		std::unique_ptr<char[]> buf(new char[buflen]);
+
+		for (;;) {
+			DWORD dwBytesRead = 0;
+			if (!::ReadFile(hPipe, buf.get(), buflen, &dwBytesRead, nullptr)) {
+				break;
+			}
+
+			if (dwBytesRead > 0) {
+				outputLog.push(std::string(buf.get(), dwBytesRead));
+			}
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			finished = true;
+		}
+		cv.notify_all();
+	}
+
+	HANDLE hPipe = nullptr;
+	logsink& outputLog;
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool finished = false;
+	std::thread thread;
+};
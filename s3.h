@@ -0,0 +1,498 @@
+#pragma once
+
+#include <deque>
+
+#include <nowide/cenv.hpp>
+
+#include "sha256.h"
+#include "http.h"
+
+// an s3://bucket/key location, and how to reach it. Credentials, region
+// and endpoint come from the usual environment variables:
+// AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY, AWS_SESSION_TOKEN, AWS_REGION,
+// and AWS_ENDPOINT_URL for any other S3 compatible store, such as a local
+// MinIO at http://localhost:9000, which is then addressed path style.
+struct s3location
+{
+	static constexpr const char* prefix = "s3://";
+
+	std::string bucket;
+	std::string key;
+
+	httpurl endpoint;
+	bool pathStyle = false;
+
+	std::string region;
+	std::string accessKey;
+	std::string secretKey;
+	std::string sessionToken;
+
+	static bool isS3(const std::string& url)
+	{
+		return iequals(url.substr(0, strlen(prefix)), prefix);
+	}
+
+	static std::string env(const char* name, const char* defaultValue = "")
+	{
+		const char* value = nowide::getenv(name);
+		return value && *value ? value : defaultValue;
+	}
+
+	bool parse(const std::string& url)
+	{
+		if (!isS3(url)) {
+			return false;
+		}
+
+		std::string rest = url.substr(strlen(prefix));
+		size_t slash = rest.find('/');
+		if (slash == std::string::npos || slash == 0 || slash + 1 == rest.size()) {
+			return false;
+		}
+		bucket = rest.substr(0, slash);
+		key = rest.substr(slash + 1);
+
+		region = env("AWS_REGION", env("AWS_DEFAULT_REGION", "us-east-1").c_str());
+		accessKey = env("AWS_ACCESS_KEY_ID");
+		secretKey = env("AWS_SECRET_ACCESS_KEY");
+		sessionToken = env("AWS_SESSION_TOKEN");
+
+		std::string endpointUrl = env("AWS_ENDPOINT_URL");
+		if (endpointUrl.empty()) {
+			endpointUrl = "https://" + bucket + ".s3." + region + ".amazonaws.com";
+		}
+		else {
+			pathStyle = true;
+		}
+
+		return endpoint.parse(endpointUrl) && !accessKey.empty() && !secretKey.empty();
+	}
+
+	// the object's path as sent, and signed
+	std::string path() const
+	{
+		return (pathStyle ? "/" + uriEncode(bucket, true) : std::string()) + "/" + uriEncode(key, false);
+	}
+
+	static std::string uriEncode(const std::string& s, bool encodeSlash)
+	{
+		std::ostringstream o;
+		o << std::hex << std::uppercase << std::setfill('0');
+		for (unsigned char c : s) {
+			if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && !encodeSlash)) {
+				o << c;
+			}
+			else {
+				o << '%' << std::setw(2) << static_cast<int>(c);
+			}
+		}
+		return o.str();
+	}
+
+	// AWS signature version 4 headers for a request on this object. query
+	// must be canonical: sorted, encoded, with '=' after every name. The
+	// payload is not hashed; the transport already protects it.
+	std::vector<std::string> sign(const std::string& verb, const std::string& query, std::vector<std::string> headers = std::vector<std::string>()) const
+	{
+		SYSTEMTIME st;
+		::GetSystemTime(&st);
+
+		char amzDate[32];
+		sprintf_s(amzDate, "%04u%02u%02uT%02u%02u%02uZ", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+		std::string date(amzDate, 8);
+
+		const std::string payloadHash = "UNSIGNED-PAYLOAD";
+
+		std::string canonicalHeaders = "host:" + endpoint.hostHeader() + "\n"
+			+ "x-amz-content-sha256:" + payloadHash + "\n"
+			+ "x-amz-date:" + amzDate + "\n";
+		std::string signedHeaders = "host;x-amz-content-sha256;x-amz-date";
+		if (!sessionToken.empty()) {
+			canonicalHeaders += "x-amz-security-token:" + sessionToken + "\n";
+			signedHeaders += ";x-amz-security-token";
+		}
+
+		std::string canonicalRequest = verb + "\n" + path() + "\n" + query + "\n" + canonicalHeaders + "\n" + signedHeaders + "\n" + payloadHash;
+
+		std::string scope = date + "/" + region + "/s3/aws4_request";
+		std::string stringToSign = std::string("AWS4-HMAC-SHA256\n") + amzDate + "\n" + scope + "\n" + sha256::hex(sha256::hash(canonicalRequest));
+
+		std::string signingKey = sha256::hmac(sha256::hmac(sha256::hmac(sha256::hmac("AWS4" + secretKey, date), region), "s3"), "aws4_request");
+		std::string signature = sha256::hex(sha256::hmac(signingKey, stringToSign));
+
+		headers.push_back("x-amz-content-sha256: " + payloadHash);
+		headers.push_back(std::string("x-amz-date: ") + amzDate);
+		if (!sessionToken.empty()) {
+			headers.push_back("x-amz-security-token: " + sessionToken);
+		}
+		headers.push_back("Authorization: AWS4-HMAC-SHA256 Credential=" + accessKey + "/" + scope + ", SignedHeaders=" + signedHeaders + ", Signature=" + signature);
+
+		return headers;
+	}
+
+	// sends a signed request for this object
+	HRESULT send(httpclient& client, const std::string& verb, const std::string& query, const void* body, DWORD bodyLen, httpresponse& response, std::vector<std::string> headers = std::vector<std::string>(), BYTE* out = nullptr, DWORD outLen = 0) const
+	{
+		std::string target = path() + (query.empty() ? std::string() : "?" + query);
+		HRESULT hr = client.send(verb, target, sign(verb, query, headers), body, bodyLen, response, out, outLen);
+		if (SUCCEEDED(hr) && !response.ok()) {
+			hr = HRESULT_FROM_WIN32(response.status == 404 ? ERROR_FILE_NOT_FOUND : response.status == 403 ? ERROR_ACCESS_DENIED : ERROR_BAD_NET_RESP);
+		}
+		return hr;
+	}
+
+	// the text of the first <tag> in an xml response
+	static std::string xmlValue(const std::string& xml, const std::string& tag)
+	{
+		size_t start = xml.find("<" + tag + ">");
+		if (start == std::string::npos) {
+			return std::string();
+		}
+		start += tag.size() + 2;
+		size_t end = xml.find("</" + tag + ">", start);
+		return end == std::string::npos ? std::string() : xml.substr(start, end - start);
+	}
+};
+
+/****/
+
+// uploads the stream as an S3 multipart upload. The pump fills one part
+// buffer at a time; full parts go to a few uploader threads, and the pump
+// only waits when every buffer is queued or in flight, which bounds memory
+// to (connections + 1) parts. close completes the upload; a sink destroyed
+// without closing aborts it, so a failed backup leaves no object behind.
+// Parts double in size every growEvery parts, so the 10000 part limit of S3
+// does not cap a large backup at 10000 times the starting size.
+struct s3sink : public bytesink
+{
+	static constexpr DWORD defaultPartSize = 0x2000000;
+	static constexpr DWORD defaultConnections = 4;
+	static constexpr DWORD maxParts = 10000;
+	static constexpr DWORD minPartSize = 0x500000;
+	static constexpr DWORD maxPartSize = 0x40000000;
+	static constexpr DWORD growEvery = 1000;
+	static constexpr int attempts = 3;
+
+	s3sink(const s3location& location, DWORD connections = defaultConnections, DWORD partSize = defaultPartSize)
+		: location(location)
+		, connections(connections ? connections : defaultConnections)
+		, partSize(max(partSize ? partSize : defaultPartSize, minPartSize))
+	{
+	}
+
+	~s3sink()
+	{
+		stop();
+
+		if (!uploadId.empty() && !completed) {
+			httpresponse response;
+			location.send(client, "DELETE", "uploadId=" + s3location::uriEncode(uploadId, true), nullptr, 0, response);
+		}
+	}
+
+	// starts the multipart upload
+	HRESULT begin()
+	{
+		HRESULT hr = client.open(location.endpoint, connections);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+
+		httpresponse response;
+		hr = location.send(client, "POST", "uploads=", nullptr, 0, response);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+
+		uploadId = s3location::xmlValue(response.body, "UploadId");
+		if (uploadId.empty()) {
+			return HRESULT_FROM_WIN32(ERROR_BAD_NET_RESP);
+		}
+
+		parts.resize(connections + 1);
+		for (auto&& p : parts) {
+			p.buffer.reset(new BYTE[partSize]);
+			p.capacity = partSize;
+			freeList.push_back(&p);
+		}
+
+		for (DWORD i = 0; i < connections; ++i) {
+			uploaders.emplace_back([this] { uploadLoop(); });
+		}
+
+		return S_OK;
+	}
+
+	virtual BOOL write(const BYTE* buf, DWORD len, DWORD* pdwBytes) override
+	{
+		*pdwBytes = 0;
+
+		while (len > 0) {
+			if (!current) {
+				current = takeFree();
+				if (!current) {
+					::SetLastError(lastError);
+					return FALSE;
+				}
+			}
+
+			DWORD n = min(len, current->size - current->len);
+			memcpy(current->buffer.get() + current->len, buf, n);
+			current->len += n;
+			buf += n;
+			len -= n;
+			*pdwBytes += n;
+
+			if (current->len == current->size) {
+				if (!submit()) {
+					return FALSE;
+				}
+			}
+		}
+
+		return TRUE;
+	}
+
+	// parts can not be smaller than minPartSize, so a flush only waits for
+	// the full ones already submitted
+	virtual BOOL flush() override
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] { return (fullList.empty() && !inFlight) || failed; });
+		if (failed) {
+			::SetLastError(lastError);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	// uploads what is left and completes the upload
+	virtual BOOL close() override
+	{
+		if (current && current->len) {
+			if (!submit()) {
+				return FALSE;
+			}
+		}
+		else if (!nextPartNumber) {
+			// an empty stream is still one (empty) part
+			current = takeFree();
+			if (!current || !submit()) {
+				return FALSE;
+			}
+		}
+
+		if (!flush()) {
+			return FALSE;
+		}
+
+		stop();
+
+		std::ostringstream o;
+		o << "<CompleteMultipartUpload>";
+		for (size_t i = 0; i < etags.size(); ++i) {
+			o << "<Part><PartNumber>" << (i + 1) << "</PartNumber><ETag>" << etags[i] << "</ETag></Part>";
+		}
+		o << "</CompleteMultipartUpload>";
+		std::string xml = o.str();
+
+		httpresponse response;
+		HRESULT hr = location.send(client, "POST", "uploadId=" + s3location::uriEncode(uploadId, true), xml.data(), static_cast<DWORD>(xml.size()), response
+			, { "Content-Type: application/xml" });
+
+		// completion can fail after the 200 has been sent, with an error in the body
+		if (SUCCEEDED(hr) && response.body.find("<Error>") != std::string::npos) {
+			hr = HRESULT_FROM_WIN32(ERROR_BAD_NET_RESP);
+		}
+		if (!SUCCEEDED(hr)) {
+			::SetLastError(HRESULT_CODE(hr));
+			return FALSE;
+		}
+
+		completed = true;
+		return TRUE;
+	}
+
+protected:
+	struct part
+	{
+		std::unique_ptr<BYTE[]> buffer;
+		DWORD capacity = 0;
+		DWORD size = 0;
+		DWORD len = 0;
+		DWORD number = 0;
+	};
+
+	// the size of part number, counting from 1
+	DWORD partSizeFor(DWORD number) const
+	{
+		unsigned __int64 size = static_cast<unsigned __int64>(partSize) << ((number - 1) / growEvery);
+		return static_cast<DWORD>(min(size, static_cast<unsigned __int64>(max(partSize, maxPartSize))));
+	}
+
+	// a free buffer, grown for the next part if need be
+	part* takeFree()
+	{
+		part* p = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this] { return !freeList.empty() || failed; });
+			if (failed) {
+				return nullptr;
+			}
+			p = freeList.front();
+			freeList.pop_front();
+		}
+
+		p->len = 0;
+		p->size = partSizeFor(nextPartNumber + 1);
+		if (p->capacity < p->size) {
+			p->buffer.reset(new BYTE[p->size]);
+			p->capacity = p->size;
+		}
+		return p;
+	}
+
+	bool submit()
+	{
+		if (nextPartNumber >= maxParts) {
+			lastError = ERROR_FILE_TOO_LARGE;
+			::SetLastError(lastError);
+			return false;
+		}
+
+		current->number = ++nextPartNumber;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			etags.resize(nextPartNumber);
+			fullList.push_back(current);
+		}
+		cv.notify_all();
+
+		current = nullptr;
+		return true;
+	}
+
+	void uploadLoop()
+	{
+		for (;;) {
+			part* p = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this] { return !fullList.empty() || stopping || failed; });
+				if (fullList.empty() || failed) {
+					return;
+				}
+				p = fullList.front();
+				fullList.pop_front();
+				++inFlight;
+			}
+
+			std::ostringstream query;
+			query << "partNumber=" << p->number << "&uploadId=" << s3location::uriEncode(uploadId, true);
+
+			httpresponse response;
+			HRESULT hr = S_OK;
+			for (int attempt = 0; attempt < attempts; ++attempt) {
+				if (attempt) {
+					::Sleep(1000 << attempt);
+				}
+				hr = location.send(client, "PUT", query.str(), p->buffer.get(), p->len, response);
+				if (SUCCEEDED(hr) || response.status == 403 || response.status == 404) {
+					break;
+				}
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				--inFlight;
+				if (SUCCEEDED(hr)) {
+					etags[p->number - 1] = response.header("ETag");
+					freeList.push_back(p);
+				}
+				else if (!failed) {
+					failed = true;
+					lastError = HRESULT_FACILITY(hr) == FACILITY_WIN32 ? HRESULT_CODE(hr) : ERROR_WRITE_FAULT;
+				}
+			}
+			cv.notify_all();
+		}
+	}
+
+	void stop()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cv.notify_all();
+
+		for (auto&& t : uploaders) {
+			t.join();
+		}
+		uploaders.clear();
+	}
+
+	s3location location;
+	httpclient client;
+	DWORD connections = 0;
+	DWORD partSize = 0;
+
+	std::string uploadId;
+	bool completed = false;
+
+	std::vector<part> parts;
+	part* current = nullptr;
+	DWORD nextPartNumber = 0;
+	std::vector<std::string> etags;
+
+	std::vector<std::thread> uploaders;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<part*> freeList;
+	std::deque<part*> fullList;
+	DWORD inFlight = 0;
+	bool stopping = false;
+	bool failed = false;
+	DWORD lastError = 0;
+};
+
+/****/
+
+// reads an s3 object with parallel ranged GETs
+struct s3source : public rangedsource
+{
+	s3source(std::shared_ptr<httpclient> client, const s3location& location, unsigned __int64 totalBytes, DWORD connections, unsigned __int64 offset)
+		: rangedsource([client, location](unsigned __int64 offset, DWORD len, BYTE* buf, DWORD& received) {
+			std::ostringstream range;
+			range << "Range: bytes=" << offset << "-" << (offset + len - 1);
+
+			httpresponse response;
+			HRESULT hr = location.send(*client, "GET", std::string(), nullptr, 0, response, { range.str() }, buf, len);
+			received = response.bodyBytes;
+			return hr;
+		}, totalBytes, connections, defaultChunkSize, offset)
+	{
+	}
+
+	// looks up the object's size, then starts reading ahead from offset
+	static HRESULT open(const s3location& location, DWORD connections, std::unique_ptr<bytesource>& source, unsigned __int64 offset = 0)
+	{
+		auto client = std::make_shared<httpclient>();
+		HRESULT hr = client->open(location.endpoint, connections ? connections : defaultConnections);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+
+		httpresponse response;
+		hr = location.send(*client, "HEAD", std::string(), nullptr, 0, response);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+
+		unsigned __int64 totalBytes = _strtoui64(response.header("Content-Length").c_str(), nullptr, 10);
+
+		source = std::make_unique<s3source>(client, location, totalBytes, connections, offset);
+		return S_OK;
+	}
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <bcrypt.h>
+
+// SHA-256, or HMAC-SHA-256 when given a key, through BCrypt
+struct sha256
+{
+	static constexpr DWORD digestSize = 32;
+
+	explicit sha256(const std::string& hmacKey = std::string())
+	{
+		if (!BCRYPT_SUCCESS(::BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_SHA256_ALGORITHM, nullptr, hmacKey.empty() ? 0 : BCRYPT_ALG_HANDLE_HMAC_FLAG))) {
+			hAlg = nullptr;
+			return;
+		}
+
+		PUCHAR key = hmacKey.empty() ? nullptr : reinterpret_cast<PUCHAR>(const_cast<char*>(hmacKey.data()));
+		if (!BCRYPT_SUCCESS(::BCryptCreateHash(hAlg, &hHash, nullptr, 0, key, static_cast<ULONG>(hmacKey.size()), 0))) {
+			hHash = nullptr;
+		}
+	}
+
+	~sha256()
+	{
+		if (hHash) {
+			::BCryptDestroyHash(hHash);
+		}
+		if (hAlg) {
+			::BCryptCloseAlgorithmProvider(hAlg, 0);
+		}
+	}
+
+	sha256(const sha256&) = delete;
+	sha256& operator=(const sha256&) = delete;
+
+	void update(const void* data, size_t len)
+	{
+		const BYTE* p = static_cast<const BYTE*>(data);
+		while (hHash && len) {
+			ULONG n = static_cast<ULONG>(min(len, static_cast<size_t>(0x40000000)));
+			::BCryptHashData(hHash, const_cast<PUCHAR>(p), n, 0);
+			p += n;
+			len -= n;
+		}
+	}
+
+	void update(const std::string& data)
+	{
+		update(data.data(), data.size());
+	}
+
+	// the raw digest; the object can not be updated afterwards
+	std::string finish()
+	{
+		std::string digest(digestSize, '\0');
+		if (hHash) {
+			::BCryptFinishHash(hHash, reinterpret_cast<PUCHAR>(&digest[0]), digestSize, 0);
+		}
+		return digest;
+	}
+
+	static std::string hash(const void* data, size_t len)
+	{
+		sha256 h;
+		h.update(data, len);
+		return h.finish();
+	}
+
+	static std::string hash(const std::string& data)
+	{
+		return hash(data.data(), data.size());
+	}
+
+	static std::string hmac(const std::string& key, const std::string& data)
+	{
+		sha256 h(key);
+		h.update(data);
+		return h.finish();
+	}
+
+	static std::string hex(const std::string& digest)
+	{
+		static const char digits[] = "0123456789abcdef";
+		std::string s;
+		s.reserve(digest.size() * 2);
+		for (unsigned char c : digest) {
+			s.push_back(digits[c >> 4]);
+			s.push_back(digits[c & 0xf]);
+		}
+		return s;
+	}
+
+protected:
+	BCRYPT_ALG_HANDLE hAlg = nullptr;
+	BCRYPT_HASH_HANDLE hHash = nullptr;
+};
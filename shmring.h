@@ -0,0 +1,327 @@
+#pragma once
+
+#include <atomic>
+
+// single producer, single consumer ring buffer in a named file mapping, used
+// as an alternative to the stdio named pipe between the parent and the
+// elevated process. The producer reads straight into the mapping and the
+// consumer copies straight out of it, so data crosses the process boundary
+// with one copy instead of going through a kernel pipe.
+struct shmring
+{
+	static constexpr const char* prefix = "shm:";
+	static constexpr DWORD defaultCapacity = 0x1000000;
+
+	~shmring()
+	{
+		close();
+
+		if (header) {
+			::UnmapViewOfFile(header);
+		}
+		for (HANDLE h : { hMapping, hDataEvent, hSpaceEvent, hPeer }) {
+			if (h) {
+				::CloseHandle(h);
+			}
+		}
+	}
+
+	static bool isShm(const std::string& name)
+	{
+		return 0 == name.find(prefix);
+	}
+
+	// creates the mapping, before the process on the other end is launched
+	HRESULT create(const std::string& name, DWORD capacity)
+	{
+		if (!capacity) {
+			capacity = defaultCapacity;
+		}
+
+		HRESULT hr = init(name, capacity, true);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+
+		new (header) shmheader();
+		header->capacity = capacity;
+		header->ownerProcessId = ::GetCurrentProcessId();
+
+		return S_OK;
+	}
+
+	// waits for the launched process to open the ring; false if it exited first
+	bool waitAttached(HANDLE hPeerProcess)
+	{
+		if (!hPeer) {
+			::DuplicateHandle(::GetCurrentProcess(), hPeerProcess, ::GetCurrentProcess(), &hPeer, SYNCHRONIZE, FALSE, 0);
+		}
+
+		while (!header->attached) {
+			if (!wait(writer ? hSpaceEvent : hDataEvent)) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// opens a mapping made by create, in another process
+	HRESULT open(const std::string& name)
+	{
+		HRESULT hr = init(name, 0, false);
+		if (!SUCCEEDED(hr)) {
+			return hr;
+		}
+
+		hPeer = ::OpenProcess(SYNCHRONIZE, FALSE, header->ownerProcessId);
+
+		header->attached = 1;
+		::SetEvent(hDataEvent);
+		::SetEvent(hSpaceEvent);
+
+		return S_OK;
+	}
+
+	// returns a contiguous writable span, waiting for the reader if the ring is full
+	DWORD acquireWrite(BYTE** ppBuf, DWORD maxLen)
+	{
+		for (;;) {
+			if (header->readerClosed) {
+				return 0;
+			}
+
+			auto head = header->head.load(std::memory_order_relaxed);
+			auto tail = header->tail.load(std::memory_order_acquire);
+
+			DWORD space = static_cast<DWORD>(header->capacity - (head - tail));
+			if (space) {
+				DWORD offset = static_cast<DWORD>(head % header->capacity);
+				DWORD len = min(min(space, header->capacity - offset), maxLen);
+				*ppBuf = data + offset;
+				return len;
+			}
+
+			if (!wait(hSpaceEvent)) {
+				return 0;
+			}
+		}
+	}
+
+	void commitWrite(DWORD len)
+	{
+		header->head.fetch_add(len, std::memory_order_release);
+		::SetEvent(hDataEvent);
+	}
+
+	// returns a contiguous readable span, waiting for the writer if the ring is empty
+	DWORD acquireRead(BYTE** ppBuf, DWORD maxLen)
+	{
+		for (;;) {
+			auto tail = header->tail.load(std::memory_order_relaxed);
+			auto head = header->head.load(std::memory_order_acquire);
+
+			DWORD avail = static_cast<DWORD>(head - tail);
+			if (avail) {
+				DWORD offset = static_cast<DWORD>(tail % header->capacity);
+				DWORD len = min(min(avail, header->capacity - offset), maxLen);
+				*ppBuf = data + offset;
+				return len;
+			}
+
+			// the writer commits its last bytes before it closes, so once closed
+			// a fresh look at head tells whether those bytes came in meanwhile
+			if (header->writerClosed.load(std::memory_order_acquire)) {
+				if (header->head.load(std::memory_order_acquire) != tail) {
+					continue;
+				}
+				return 0;
+			}
+
+			if (!wait(hDataEvent)) {
+				return 0;
+			}
+		}
+	}
+
+	void commitRead(DWORD len)
+	{
+		header->tail.fetch_add(len, std::memory_order_release);
+		::SetEvent(hSpaceEvent);
+	}
+
+	DWORD write(const void* buf, DWORD len)
+	{
+		DWORD written = 0;
+		while (written < len) {
+			BYTE* p = nullptr;
+			DWORD n = acquireWrite(&p, len - written);
+			if (!n) {
+				break;
+			}
+			memcpy(p, static_cast<const BYTE*>(buf) + written, n);
+			commitWrite(n);
+			written += n;
+		}
+		return written;
+	}
+
+	DWORD read(void* buf, DWORD len)
+	{
+		DWORD totalRead = 0;
+		while (totalRead < len) {
+			BYTE* p = nullptr;
+			DWORD n = acquireRead(&p, len - totalRead);
+			if (!n) {
+				break;
+			}
+			memcpy(static_cast<BYTE*>(buf) + totalRead, p, n);
+			commitRead(n);
+			totalRead += n;
+		}
+		return totalRead;
+	}
+
+	// fills the ring from a handle until the end of its stream
+	HRESULT fillFrom(HANDLE hInput, __int64& totalBytes)
+	{
+		for (;;) {
+			BYTE* p = nullptr;
+			DWORD n = acquireWrite(&p, header->capacity);
+			if (!n) {
+				return header->readerClosed ? S_OK : E_ABORT;
+			}
+
+			DWORD dwBytesRead = 0;
+			BOOL ret = ::ReadFile(hInput, p, n, &dwBytesRead, nullptr);
+			DWORD err = ret ? 0 : ::GetLastError();
+
+			commitWrite(dwBytesRead);
+			totalBytes += dwBytesRead;
+
+			if (!ret || !dwBytesRead) {
+				closeWrite();
+				return (err && err != ERROR_BROKEN_PIPE && err != ERROR_HANDLE_EOF) ? HRESULT_FROM_WIN32(err) : S_OK;
+			}
+		}
+	}
+
+	// drains the ring to a handle until the writer closes it
+	HRESULT drainTo(HANDLE hOutput, __int64& totalBytes)
+	{
+		for (;;) {
+			BYTE* p = nullptr;
+			DWORD n = acquireRead(&p, header->capacity);
+			if (!n) {
+				return S_OK;
+			}
+
+			DWORD dwBytesWritten = 0;
+			while (dwBytesWritten < n) {
+				DWORD dwBytes = 0;
+				BOOL ret = ::WriteFile(hOutput, p + dwBytesWritten, n - dwBytesWritten, &dwBytes, nullptr);
+				dwBytesWritten += dwBytes;
+				if (!ret || (dwBytes == 0)) {
+					DWORD err = ::GetLastError();
+					closeRead();
+					return HRESULT_FROM_WIN32(err ? err : ERROR_WRITE_FAULT);
+				}
+			}
+
+			commitRead(n);
+			totalBytes += n;
+		}
+	}
+
+	// tells the other side we will not produce or consume any more
+	void closeWrite()
+	{
+		if (header && !header->writerClosed.exchange(1)) {
+			::SetEvent(hDataEvent);
+		}
+	}
+
+	void closeRead()
+	{
+		if (header && !header->readerClosed.exchange(1)) {
+			::SetEvent(hSpaceEvent);
+		}
+	}
+
+	void close()
+	{
+		if (writer) {
+			closeWrite();
+		}
+		else {
+			closeRead();
+		}
+	}
+
+	// true on the side producing data into the ring
+	bool writer = false;
+
+protected:
+	struct shmheader
+	{
+		std::atomic<unsigned __int64> head{ 0 };
+		std::atomic<unsigned __int64> tail{ 0 };
+		std::atomic<LONG> writerClosed{ 0 };
+		std::atomic<LONG> readerClosed{ 0 };
+		std::atomic<LONG> attached{ 0 };
+		DWORD capacity = 0;
+		DWORD ownerProcessId = 0;
+	};
+
+	static constexpr DWORD headerSize = 0x1000;
+	static_assert(sizeof(shmheader) <= headerSize, "shmheader must fit in the first page");
+
+	HRESULT init(const std::string& name, DWORD capacity, bool create)
+	{
+		std::wstring base = widen(name.substr(strlen(prefix)));
+
+		if (create) {
+			hMapping = ::CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, headerSize + capacity, base.c_str());
+			hDataEvent = ::CreateEvent(nullptr, FALSE, FALSE, (base + L"_data").c_str());
+			hSpaceEvent = ::CreateEvent(nullptr, FALSE, FALSE, (base + L"_space").c_str());
+		}
+		else {
+			hMapping = ::OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, base.c_str());
+			hDataEvent = ::OpenEvent(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (base + L"_data").c_str());
+			hSpaceEvent = ::OpenEvent(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (base + L"_space").c_str());
+		}
+
+		if (!hMapping || !hDataEvent || !hSpaceEvent) {
+			DWORD err = ::GetLastError();
+			return err ? HRESULT_FROM_WIN32(err) : E_FAIL;
+		}
+
+		void* view = ::MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		if (!view) {
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		header = static_cast<shmheader*>(view);
+		data = static_cast<BYTE*>(view) + headerSize;
+
+		return S_OK;
+	}
+
+	// waits for the other side; false if it went away
+	bool wait(HANDLE hEvent)
+	{
+		HANDLE handles[] = { hEvent, hPeer };
+		DWORD count = hPeer ? 2 : 1;
+
+		DWORD ret = ::WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+		return ret == WAIT_OBJECT_0;
+	}
+
+	HANDLE hMapping = nullptr;
+	HANDLE hDataEvent = nullptr;
+	HANDLE hSpaceEvent = nullptr;
+	HANDLE hPeer = nullptr;
+
+	shmheader* header = nullptr;
+	BYTE* data = nullptr;
+};
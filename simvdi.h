@@ -0,0 +1,251 @@
+#pragma once
+
+// settings for the simulated virtual device, parsed from a spec such as
+// "size=1g,transfer=1m,depth=2,flush=64,rate=200m"
+struct simconfig
+{
+	DWORD commandCode = VDC_Write;
+	unsigned __int64 totalBytes = 0x40000000;
+	DWORD transferSize = 0x100000;
+	DWORD depth = 1;
+	DWORD flushInterval = 0;
+	unsigned __int64 bytesPerSecond = 0;
+
+	bool parse(const std::string& spec)
+	{
+		std::istringstream i(spec);
+		std::string item;
+		while (std::getline(i, item, ',')) {
+			size_t split = item.find('=');
+			if (split == std::string::npos) {
+				return false;
+			}
+			std::string key = item.substr(0, split);
+			unsigned __int64 value = parse_size(item.substr(split + 1));
+
+			if (iequals(key, "size")) {
+				totalBytes = value;
+			}
+			else if (iequals(key, "transfer")) {
+				transferSize = static_cast<DWORD>(value);
+			}
+			else if (iequals(key, "depth")) {
+				depth = static_cast<DWORD>(value);
+			}
+			else if (iequals(key, "flush")) {
+				flushInterval = static_cast<DWORD>(value);
+			}
+			else if (iequals(key, "rate")) {
+				bytesPerSecond = value;
+			}
+			else {
+				return false;
+			}
+		}
+
+		return transferSize && depth;
+	}
+};
+
+// stands in for the IClientVirtualDevice SQL Server hands us, issuing
+// VDC_Write (backup) or VDC_Read (restore) commands, plus optional
+// VDC_Flush, so the pump can be measured without a server. It lives on
+// the stack of whoever drives it, so reference counting is a formality.
+struct simdevice : public IClientVirtualDevice
+{
+	explicit simdevice(const simconfig& config)
+		: config(config)
+	{
+		::QueryPerformanceFrequency(&frequency);
+
+		slots.resize(config.depth);
+		for (auto&& s : slots) {
+			s.buffer = static_cast<BYTE*>(::VirtualAlloc(nullptr, config.transferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+			fillBuffer(s.buffer, config.transferSize);
+		}
+
+		latencies.reserve(static_cast<size_t>(config.totalBytes / config.transferSize) + 1);
+	}
+
+	virtual ~simdevice()
+	{
+		for (auto&& s : slots) {
+			if (s.buffer) {
+				::VirtualFree(s.buffer, 0, MEM_RELEASE);
+			}
+		}
+	}
+
+	STDMETHOD(QueryInterface)(REFIID riid, void** ppv) override
+	{
+		if (riid == __uuidof(IUnknown) || riid == __uuidof(IClientVirtualDevice)) {
+			*ppv = static_cast<IClientVirtualDevice*>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppv = nullptr;
+		return E_NOINTERFACE;
+	}
+
+	STDMETHOD_(ULONG, AddRef)() override
+	{
+		return ++refs;
+	}
+
+	STDMETHOD_(ULONG, Release)() override
+	{
+		return --refs;
+	}
+
+	STDMETHOD(GetCommand)(DWORD dwTimeOut, VDC_Command** ppCmd) override
+	{
+		*ppCmd = nullptr;
+
+		slot* next = nullptr;
+		for (auto&& s : slots) {
+			if (!s.busy) {
+				next = &s;
+				break;
+			}
+		}
+		if (!next) {
+			return VD_E_TIMEOUT;
+		}
+
+		if (stopped || !schedule(next->cmd)) {
+			return VD_E_CLOSE;
+		}
+
+		next->busy = true;
+		next->cmd.buffer = next->buffer;
+
+		::QueryPerformanceCounter(&next->issued);
+
+		*ppCmd = &next->cmd;
+		return S_OK;
+	}
+
+	STDMETHOD(CompleteCommand)(VDC_Command* pCmd, DWORD dwCompletionCode, DWORD dwBytesTransferred, DWORDLONG dwlPosition) override
+	{
+		LARGE_INTEGER completed;
+		::QueryPerformanceCounter(&completed);
+
+		for (auto&& s : slots) {
+			if (&s.cmd != pCmd) {
+				continue;
+			}
+
+			s.busy = false;
+			latencies.push_back((completed.QuadPart - s.issued.QuadPart) * 1000000.0 / frequency.QuadPart);
+
+			if (dwCompletionCode) {
+				++errors;
+				// stop issuing, like the server aborting the operation
+				stopped = true;
+				return VD_E_ABORT;
+			}
+
+			bytesCompleted += dwBytesTransferred;
+			if (pCmd->commandCode != VDC_Flush && dwBytesTransferred < pCmd->size) {
+				// the source ran dry before the server expected
+				stopped = true;
+			}
+			return S_OK;
+		}
+
+		return VD_E_INVALID;
+	}
+
+	// microseconds between handing out a command and its completion
+	double percentile(double fraction)
+	{
+		if (latencies.empty()) {
+			return 0;
+		}
+		std::sort(latencies.begin(), latencies.end());
+		size_t i = static_cast<size_t>(fraction * (latencies.size() - 1));
+		return latencies[i];
+	}
+
+	simconfig config;
+
+	unsigned __int64 bytesIssued = 0;
+	unsigned __int64 bytesCompleted = 0;
+	unsigned __int64 commandsIssued = 0;
+	DWORD errors = 0;
+	bool stopped = false;
+
+	std::vector<double> latencies;
+
+	// deterministic, incompressible filler
+	static void fillBuffer(BYTE* buf, DWORD len)
+	{
+		unsigned __int64 x = 0x9E3779B97F4A7C15ull ^ reinterpret_cast<ULONG_PTR>(buf);
+		for (DWORD i = 0; i + sizeof(x) <= len; i += sizeof(x)) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			memcpy(buf + i, &x, sizeof(x));
+		}
+	}
+
+protected:
+	struct slot
+	{
+		VDC_Command cmd = {};
+		BYTE* buffer = nullptr;
+		LARGE_INTEGER issued = {};
+		bool busy = false;
+	};
+
+	// fills in the next command to hand out; false once there are no more
+	virtual bool schedule(VDC_Command& cmd)
+	{
+		if (bytesIssued >= config.totalBytes) {
+			return false;
+		}
+
+		throttle();
+
+		cmd.position = bytesIssued;
+
+		++commandsIssued;
+		if (config.flushInterval && config.commandCode == VDC_Write && 0 == (commandsIssued % (config.flushInterval + 1))) {
+			cmd.commandCode = VDC_Flush;
+			cmd.size = 0;
+		}
+		else {
+			cmd.commandCode = config.commandCode;
+			cmd.size = static_cast<DWORD>(min(static_cast<unsigned __int64>(config.transferSize), config.totalBytes - bytesIssued));
+			bytesIssued += cmd.size;
+		}
+
+		return true;
+	}
+
+	void throttle()
+	{
+		if (!config.bytesPerSecond) {
+			return;
+		}
+
+		LARGE_INTEGER now;
+		::QueryPerformanceCounter(&now);
+		if (!started.QuadPart) {
+			started = now;
+			return;
+		}
+
+		double elapsed = static_cast<double>(now.QuadPart - started.QuadPart) / frequency.QuadPart;
+		double due = static_cast<double>(bytesIssued) / config.bytesPerSecond;
+		if (due > elapsed) {
+			::Sleep(static_cast<DWORD>((due - elapsed) * 1000));
+		}
+	}
+
+	std::vector<slot> slots;
+	ULONG refs = 1;
+
+	LARGE_INTEGER frequency = {};
+	LARGE_INTEGER started = {};
+};
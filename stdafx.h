@@ -5,7 +5,7 @@
 
 #pragma once
 
-#define _WIN32_WINNT 0x0501
+#define _WIN32_WINNT 0x0600
 
 #include <WinSDKVer.h>
 #include <SDKDDKVer.h>
@@ -24,6 +24,7 @@
 
 #include <array>
 #include <set>
+#include <map>
 
 #include <string>
 #include <algorithm>
@@ -80,6 +80,62 @@ inline std::string escape(std::string str)
 	return q;
 }
 
+// a name in brackets, as quotename makes it: only ] is doubled, since a
+// quote inside brackets is just a quote
+inline std::string bracket(const std::string& name)
+{
+	std::string q;
+	q.reserve(name.size() + 2);
+
+	q.push_back('[');
+	for (auto c : name) {
+		q.push_back(c);
+		if (c == ']') {
+			q.push_back(']');
+		}
+	}
+	q.push_back(']');
+
+	return q;
+}
+
+// a file name pattern as a like pattern: * and ? are the wildcards, and the
+// %, _ and [ of the name itself match only themselves
+inline std::string like_pattern(const std::string& pattern)
+{
+	std::string like;
+	like.reserve(pattern.size());
+
+	for (auto c : pattern) {
+		if (c == '*') {
+			like.push_back('%');
+		}
+		else if (c == '?') {
+			like.push_back('_');
+		}
+		else if (c == '%' || c == '_' || c == '[') {
+			like.push_back('[');
+			like.push_back(c);
+			like.push_back(']');
+		}
+		else {
+			like.push_back(c);
+		}
+	}
+
+	return like;
+}
+
+#ifdef _DEBUG
+inline bool TestLikePattern()
+{
+	return like_pattern("Sales_2023") == "Sales[_]2023"
+		&& like_pattern("Sales_*") == "Sales[_]%"
+		&& like_pattern("100%?") == "100[%]_"
+		&& like_pattern("[a]*") == "[[]a]%";
+}
+#endif
+
 /****/
 
 inline std::vector<std::string> make_argv(int argc, wchar_t** argv)
@@ -124,6 +180,37 @@ inline std::vector<const char*> make_argv_ptrs(const std::vector<std::string>& a
 
 /****/
 
+// a byte count with an optional k, m or g suffix, like 16m
+inline unsigned __int64 parse_size(const std::string& value)
+{
+	char* end = nullptr;
+	unsigned __int64 n = _strtoui64(value.c_str(), &end, 0);
+	switch (end && *end ? tolower(*end) : 0) {
+	case 'k':
+		n <<= 10;
+		break;
+	case 'm':
+		n <<= 20;
+		break;
+	case 'g':
+		n <<= 30;
+		break;
+	}
+	return n;
+}
+
+// the reverse of parse_size, with the largest suffix that divides evenly
+inline std::string format_size(unsigned __int64 n)
+{
+	const char* suffixes = "gmk";
+	for (int shift = 30; shift > 0; shift -= 10, ++suffixes) {
+		if (n && 0 == (n & ((1ull << shift) - 1))) {
+			return std::to_string(n >> shift) + *suffixes;
+		}
+	}
+	return std::to_string(n);
+}
+
 inline std::string make_guid()
 {
 	wchar_t guid[39] = { 0 };
@@ -133,6 +220,30 @@ inline std::string make_guid()
 	return narrow(guid, _countof(guid) - 1);
 }
 
+// path made absolute against the current directory, for a process that
+// starts elsewhere, as the elevated one starts in System32
+inline std::string FullPath(const std::string& path)
+{
+	if (path.empty()) {
+		return path;
+	}
+
+	std::wstring wide = widen(path);
+	DWORD len = ::GetFullPathName(wide.c_str(), 0, nullptr, nullptr);
+	if (!len) {
+		return path;
+	}
+
+	std::wstring full(len, L'\0');
+	len = ::GetFullPathName(wide.c_str(), len, &full[0], nullptr);
+	if (!len || len >= full.size()) {
+		return path;
+	}
+	full.resize(len);
+
+	return narrow(full);
+}
+
 template<typename _IIID>
 void ComIssueError(HRESULT hr, const _com_ptr_t<_IIID>& p)
 {
@@ -192,6 +303,8 @@ struct CoInit
 
 /****/
 
+// writes to two streambufs at once, collecting output in its own put area
+// so each flush reaches both sides as one bulk sputn instead of per character
 template <typename char_type,
 	typename traits = std::char_traits<char_type> >
 	class basic_teebuf :
@@ -201,43 +314,84 @@ public:
 	typedef typename traits::int_type int_type;
 
 	basic_teebuf(std::basic_streambuf<char_type, traits>* sb1,
-		std::basic_streambuf<char_type, traits>* sb2)
+		std::basic_streambuf<char_type, traits>* sb2,
+		size_t buflen = 0x1000)
 		: sb1(sb1)
 		, sb2(sb2)
+		, buffer(buflen ? buflen : 1)
+	{
+		this->setp(buffer.data(), buffer.data() + buffer.size());
+	}
+
+	~basic_teebuf()
 	{
+		flushBuffer();
 	}
 
 private:
 	virtual int sync() override
 	{
+		bool const flushed = flushBuffer();
 		int const r1 = sb1->pubsync();
 		int const r2 = sb2->pubsync();
-		return r1 == 0 && r2 == 0 ? 0 : -1;
+		return flushed && r1 == 0 && r2 == 0 ? 0 : -1;
 	}
 
 	virtual int_type overflow(int_type c) override
 	{
 		int_type const eof = traits::eof();
 
-		if (traits::eq_int_type(c, eof))
-		{
-			return traits::not_eof(c);
+		if (!flushBuffer()) {
+			return eof;
 		}
-		else
-		{
-			char_type const ch = traits::to_char_type(c);
-			int_type const r1 = sb1->sputc(ch);
-			int_type const r2 = sb2->sputc(ch);
-
-			return
-				traits::eq_int_type(r1, eof) ||
-				traits::eq_int_type(r2, eof) ? eof : c;
+
+		if (!traits::eq_int_type(c, eof)) {
+			*this->pptr() = traits::to_char_type(c);
+			this->pbump(1);
+		}
+
+		return traits::not_eof(c);
+	}
+
+	virtual std::streamsize xsputn(const char_type* s, std::streamsize n) override
+	{
+		if (n > this->epptr() - this->pptr()) {
+			if (!flushBuffer()) {
+				return 0;
+			}
+
+			// too big to be worth copying; hand it straight through
+			if (n >= static_cast<std::streamsize>(buffer.size())) {
+				std::streamsize const r1 = sb1->sputn(s, n);
+				std::streamsize const r2 = sb2->sputn(s, n);
+				return r1 < r2 ? r1 : r2;
+			}
+		}
+
+		traits::copy(this->pptr(), s, static_cast<size_t>(n));
+		this->pbump(static_cast<int>(n));
+		return n;
+	}
+
+	bool flushBuffer()
+	{
+		std::streamsize const n = this->pptr() - this->pbase();
+		if (!n) {
+			return true;
 		}
+
+		std::streamsize const r1 = sb1->sputn(this->pbase(), n);
+		std::streamsize const r2 = sb2->sputn(this->pbase(), n);
+
+		this->setp(buffer.data(), buffer.data() + buffer.size());
+
+		return r1 == n && r2 == n;
 	}
 
 private:
 	std::basic_streambuf<char_type, traits>* sb1;
 	std::basic_streambuf<char_type, traits>* sb2;
+	std::vector<char_type> buffer;
 };
 
 typedef basic_teebuf<char> teebuf;
@@ -0,0 +1,196 @@
+#pragma once
+
+// compact binary log of the virtual device commands a pump handled, written
+// by --record-trace and replayed offline against the pump by --replay-trace
+#pragma pack(push, 4)
+struct vditraceheader
+{
+	char magic[8];
+	DWORD version;
+	DWORD recordSize;
+};
+
+struct vditracerecord
+{
+	DWORD commandCode;
+	DWORD size;
+	DWORDLONG position;
+	DWORDLONG gotMicros;
+	DWORDLONG completedMicros;
+	DWORD completionCode;
+	DWORD bytesTransferred;
+};
+#pragma pack(pop)
+
+struct vditrace
+{
+	static constexpr DWORD version = 1;
+
+	~vditrace()
+	{
+		close();
+	}
+
+	HRESULT create(const std::string& fileName)
+	{
+		hFile = ::CreateFile(widen(fileName).c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (INVALID_HANDLE_VALUE == hFile) {
+			hFile = nullptr;
+			return HRESULT_FROM_WIN32(::GetLastError());
+		}
+
+		::QueryPerformanceFrequency(&frequency);
+		::QueryPerformanceCounter(&started);
+
+		vditraceheader header = { { 'M', 'S', 'P', 'T', 'R', 'A', 'C', 'E' }, version, sizeof(vditracerecord) };
+		DWORD dwBytes = 0;
+		::WriteFile(hFile, &header, sizeof(header), &dwBytes, nullptr);
+
+		records.reserve(pending);
+
+		return S_OK;
+	}
+
+	// microseconds since the trace was created
+	DWORDLONG now() const
+	{
+		LARGE_INTEGER counter;
+		::QueryPerformanceCounter(&counter);
+		return static_cast<DWORDLONG>((counter.QuadPart - started.QuadPart) * 1000000 / frequency.QuadPart);
+	}
+
+	// call before completing the command, while pCmd still belongs to us
+	void record(const VDC_Command* pCmd, DWORDLONG gotMicros, DWORD completionCode, DWORD bytesTransferred)
+	{
+		if (!hFile || !pCmd) {
+			return;
+		}
+
+		vditracerecord r = { pCmd->commandCode, pCmd->size, pCmd->position, gotMicros, now(), completionCode, bytesTransferred };
+		records.push_back(r);
+
+		if (records.size() >= pending) {
+			flush();
+		}
+	}
+
+	void flush()
+	{
+		if (hFile && !records.empty()) {
+			DWORD dwBytes = 0;
+			::WriteFile(hFile, records.data(), static_cast<DWORD>(records.size() * sizeof(vditracerecord)), &dwBytes, nullptr);
+		}
+		records.clear();
+	}
+
+	void close()
+	{
+		flush();
+		if (hFile) {
+			::CloseHandle(hFile);
+			hFile = nullptr;
+		}
+	}
+
+	static HRESULT load(const std::string& fileName, std::vector<vditracerecord>& records)
+	{
+		std::ifstream in(widen(fileName), std::ios::binary);
+		if (!in) {
+			return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+		}
+
+		vditraceheader header = {};
+		in.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!in || 0 != memcmp(header.magic, "MSPTRACE", sizeof(header.magic)) || header.version != version || header.recordSize != sizeof(vditracerecord)) {
+			return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+		}
+
+		vditracerecord r;
+		while (in.read(reinterpret_cast<char*>(&r), sizeof(r))) {
+			records.push_back(r);
+		}
+
+		return S_OK;
+	}
+
+protected:
+	static constexpr size_t pending = 4096;
+
+	HANDLE hFile = nullptr;
+	LARGE_INTEGER frequency = {};
+	LARGE_INTEGER started = {};
+	std::vector<vditracerecord> records;
+};
+
+// simulated device that re-issues a recorded trace, either at its original
+// pace scaled by speed, or as fast as the pump takes it when speed is 0
+struct tracedevice : public simdevice
+{
+	tracedevice(const std::vector<vditracerecord>& records, double speed)
+		: simdevice(configFor(records))
+		, records(records)
+		, speed(speed)
+	{
+		::QueryPerformanceCounter(&started);
+	}
+
+	static simconfig configFor(const std::vector<vditracerecord>& records)
+	{
+		simconfig config;
+		config.totalBytes = 0;
+		config.transferSize = 1;
+		config.commandCode = 0;
+		for (auto&& r : records) {
+			if (r.commandCode == VDC_Read || r.commandCode == VDC_Write) {
+				config.totalBytes += r.size;
+				config.transferSize = max(config.transferSize, r.size);
+				if (!config.commandCode) {
+					config.commandCode = r.commandCode;
+				}
+			}
+		}
+		return config;
+	}
+
+	// how long the recorded operation took, in seconds
+	static double duration(const std::vector<vditracerecord>& records)
+	{
+		return records.empty() ? 0 : records.back().completedMicros / 1000000.0;
+	}
+
+protected:
+	virtual bool schedule(VDC_Command& cmd) override
+	{
+		if (index >= records.size()) {
+			return false;
+		}
+
+		const vditracerecord& r = records[index++];
+
+		if (speed > 0) {
+			// hold the command back until it is due, like a server still producing it
+			LARGE_INTEGER now;
+			::QueryPerformanceCounter(&now);
+			double elapsed = static_cast<double>(now.QuadPart - started.QuadPart) / frequency.QuadPart;
+			double due = r.gotMicros / 1000000.0 / speed;
+			if (due > elapsed) {
+				::Sleep(static_cast<DWORD>((due - elapsed) * 1000));
+			}
+		}
+
+		cmd.commandCode = r.commandCode;
+		cmd.size = r.size;
+		cmd.position = r.position;
+
+		++commandsIssued;
+		if (r.commandCode == VDC_Read || r.commandCode == VDC_Write) {
+			bytesIssued += r.size;
+		}
+
+		return true;
+	}
+
+	const std::vector<vditracerecord>& records;
+	size_t index = 0;
+	double speed = 1.0;
+};